@@ -0,0 +1,164 @@
+/*
+ * bench/bench_index.c - Reference index lookup microbenchmark
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Builds a reference index of N files with paths like those of a real
+ * scan, reporting its memory per file and the time taken to sort and free
+ * it. Then times size lookups, by binary search over the sorted sizes and
+ * through the size table, and checks that both find the same runs. Half
+ * of the lookups are sizes present in the index, half are random sizes,
+ * which are mostly absent.
+ *
+ * Usage: bench_index [FILES [LOOKUPS]]   (defaults: 10000000 files, 1000000 lookups)
+ *
+ * Allow about 80 bytes per file: 100M files need around 8 GB.
+ */
+
+#include "cpdd.h"
+#include <stdint.h>
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* File sizes spread roughly log-uniformly from 4 KiB to 1 GiB, with a
+ * share of small sizes below 64 KiB so that some runs hold several files */
+static off_t random_size(void) {
+    uint64_t r = next_random();
+
+    if (r % 10 == 0) {
+        return (off_t)(r >> 40) % 65536;
+    }
+    return (off_t)((r >> 8) & ((UINT64_C(1) << (12 + (r >> 59) % 19)) - 1));
+}
+
+static double seconds_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    long files = argc > 1 ? atol(argv[1]) : 10000000L;
+    long lookups = argc > 2 ? atol(argv[2]) : 1000000L;
+    options_t opts;
+    sorted_file_info_t *index;
+    off_t *queries;
+    long long found_search = 0, found_table = 0;
+    double start, search_time, table_time, build_time, sort_time, free_time;
+    size_t memory;
+
+    if (files < 1 || files > INT32_MAX || lookups < 1) {
+        fprintf(stderr, "Usage: %s [FILES [LOOKUPS]]\n", argv[0]);
+        return 1;
+    }
+
+    memset(&opts, 0, sizeof(opts));
+    opts.hash_algorithm = HASH_MD5;
+    index = create_reference_index(&opts);
+    queries = malloc(sizeof(off_t) * lookups);
+    if (!index || !queries) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 1;
+    }
+    /* A thousand files to a directory */
+    index->dir_count = (int)((files + 999) / 1000);
+    index->dirs = calloc(index->dir_count, sizeof(dir_info_t));
+    if (!index->dirs) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 1;
+    }
+    for (int i = 0; i < index->dir_count; i++) {
+        char dir[64];
+        snprintf(dir, sizeof(dir), "/srv/reference/backups/dir%05d", i);
+        index->dirs[i].path = strdup(dir);
+    }
+    for (long i = 0; i < files; i++) {
+        char name[32];
+        entry_stat_t est;
+
+        memset(&est, 0, sizeof(est));
+        est.size = random_size();
+        est.ino = (ino_t)i;
+        snprintf(name, sizeof(name), "file%08ld.dat", i);
+        if (file_table_add(&index->files, (int)(i / 1000), name, &est) < 0) {
+            fprintf(stderr, "Error: Memory allocation failed after %ld files\n", i);
+            return 1;
+        }
+    }
+    start = seconds_now();
+    if (file_table_sort(&index->files, index->dirs) != 0) {
+        fprintf(stderr, "Error: Memory allocation failed sorting %ld files\n", files);
+        return 1;
+    }
+    sort_time = seconds_now() - start;
+    memory = file_table_memory(&index->files);
+
+    for (long i = 0; i < lookups; i++) {
+        queries[i] = (i & 1) ? random_size() : index->files.sizes[next_random() % files];
+    }
+
+    start = seconds_now();
+    build_size_index(index);
+    build_time = seconds_now() - start;
+
+    start = seconds_now();
+    for (long i = 0; i < lookups; i++) {
+        int first = 0;
+        int count = search_size_run(index, queries[i], &first);
+        found_search += count ? first + count : 0;
+    }
+    search_time = seconds_now() - start;
+
+    start = seconds_now();
+    for (long i = 0; i < lookups; i++) {
+        int first = 0;
+        int count = lookup_size_run(index, queries[i], &first);
+        found_table += count ? first + count : 0;
+    }
+    table_time = seconds_now() - start;
+
+    printf("Files: %ld, index: %.1f bytes/file (sorted in %.2f s)\n",
+           files, (double)memory / files, sort_time);
+    printf("Lookups: %ld, table slots: %zu (built in %.2f s)\n",
+           lookups, index->size_index_mask + 1, build_time);
+    printf("  Binary search: %8.1f ns/lookup\n", search_time * 1e9 / lookups);
+    printf("  Size table:    %8.1f ns/lookup\n", table_time * 1e9 / lookups);
+    if (found_search != found_table) {
+        printf("  MISMATCH: lookups disagree\n");
+        return 1;
+    }
+
+    start = seconds_now();
+    free_sorted_file_info(index);
+    free_time = seconds_now() - start;
+    printf("  Index freed in %.3f s\n", free_time);
+    free(queries);
+    return 0;
+}
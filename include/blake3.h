@@ -0,0 +1,56 @@
+/*
+ * cpdd/include/blake3.h - BLAKE3 cryptographic hash
+ *
+ * Portable implementation of the BLAKE3 hash (default 32-byte output, no key)
+ * following the BLAKE3 specification by O'Connor, Aumasson, Neves and
+ * Wilcox-O'Hearn.
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BLAKE3_DIGEST_LENGTH 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+/* Streaming BLAKE3 state */
+typedef struct {
+    uint32_t cv[8];                            /* Chaining value of current chunk */
+    uint64_t chunk_counter;                    /* Index of current chunk */
+    unsigned char block[BLAKE3_BLOCK_LEN];     /* Input not yet compressed */
+    size_t block_len;                          /* Bytes in block */
+    size_t chunk_len;                          /* Bytes consumed in current chunk */
+    uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];    /* Chaining values of completed subtrees */
+    size_t cv_stack_len;                       /* Entries in cv_stack */
+} BLAKE3_CTX;
+
+/* BLAKE3 computation functions */
+void BLAKE3_Init(BLAKE3_CTX *ctx);
+void BLAKE3_Update(BLAKE3_CTX *ctx, const void *data, size_t len);
+void BLAKE3_Final(unsigned char digest[BLAKE3_DIGEST_LENGTH], BLAKE3_CTX *ctx);
+
+#endif
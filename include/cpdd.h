@@ -36,17 +36,71 @@
 #include <errno.h>
 #include <utime.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include "hash.h"
 
 /* Path and buffer size limits */
 #define MAX_PATH 16384
-#define MD5_DIGEST_LENGTH 16
 #define BUFFER_SIZE 8192
 
+/* File copies: user-space buffer, and bytes per kernel copy call */
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define COPY_CHUNK_SIZE (64 * 1024 * 1024)
+
+/* Sampled-block fingerprints for large same-sized files */
+#define FINGERPRINT_BLOCK_SIZE 4096
+#define FINGERPRINT_SAMPLES 3             /* Interior blocks, besides first and last */
+#define FINGERPRINT_MIN_SIZE (64 * 1024)
+
+/* Content comparison: mapped window, read window, and per-candidate block */
+#define COMPARE_MAP_SIZE (64 * 1024 * 1024)
+#define COMPARE_WINDOW_SIZE (1024 * 1024)
+#define COMPARE_BLOCK_SIZE (128 * 1024)
+
+/* Source data kept from matching for the copy: files up to the per-file
+ * size are staged, within a budget shared by all files in flight */
+#define SOURCE_STAGE_MAX (32 * 1024 * 1024)
+#define SOURCE_STAGE_BUDGET (256 * 1024 * 1024)
+
+/* With --max-index-memory: the write and read buffer of each sorted run
+ * spilled to disk, and rows per entry of the in-memory directory of sizes */
+#define SPILL_BUFFER_SIZE (256 * 1024)
+#define SIZE_DIRECTORY_STRIDE 4096
+
+/* Most same-sized references compared against a source in one pass */
+#define MAX_OPEN_CANDIDATES 64
+
+/* Size of each io_uring copy buffer */
+#define IO_RING_BUFFER_SIZE (256 * 1024)
+
+/* With --defer-hash, references with less than this left to hash after a
+ * mismatch are still hashed to the end while they are open */
+#define DEFER_HASH_MIN_REMAINING (1024 * 1024)
+
+/* Files waiting between pipeline stages, per queue */
+#define PIPELINE_QUEUE_SIZE 256
+
+/* Locks guarding lazily computed reference digests, striped by file */
+#define REFERENCE_LOCK_STRIPES 256
+
+/* Nanosecond timestamps from struct stat */
+#ifdef __APPLE__
+#define STAT_ATIME(st) ((st)->st_atimespec)
+#define STAT_MTIME(st) ((st)->st_mtimespec)
+#define STAT_CTIME(st) ((st)->st_ctimespec)
+#else
+#define STAT_ATIME(st) ((st)->st_atim)
+#define STAT_MTIME(st) ((st)->st_mtim)
+#define STAT_CTIME(st) ((st)->st_ctim)
+#endif
+
 /* Linking strategy options */
 typedef enum {
     LINK_NONE,    /* Regular copy */
     LINK_HARD,    /* Hard links to duplicates */
-    LINK_SOFT     /* Symbolic links to duplicates */
+    LINK_SOFT,    /* Symbolic links to duplicates */
+    LINK_REFLINK  /* Copy-on-write clones of duplicates */
 } link_type_t;
 
 /* File attributes to preserve during copy */
@@ -54,6 +108,7 @@ typedef struct {
     int mode;       /* File permissions */
     int ownership;  /* User/group ownership */
     int timestamps; /* Access/modification times */
+    int links;      /* Hard links between source files */
     int all;        /* Preserve all attributes */
 } preserve_t;
 
@@ -62,10 +117,12 @@ typedef struct {
     int files_copied;        /* Files physically copied */
     int files_hard_linked;   /* Files hard linked */
     int files_soft_linked;   /* Files soft linked */
+    int files_reflinked;     /* Files cloned from a reference */
     int files_skipped;       /* Files skipped (no-clobber) */
     off_t bytes_copied;      /* Bytes physically copied */
     off_t bytes_hard_linked; /* Bytes saved via hard links */
     off_t bytes_soft_linked; /* Bytes saved via soft links */
+    off_t bytes_reflinked;   /* Bytes shared via clones */
 } stats_t;
 
 /* Command line options */
@@ -83,42 +140,266 @@ typedef struct {
     int show_stats;         /* Display operation statistics */
     int human_readable;     /* Human-readable byte counts */
     preserve_t preserve;    /* Attributes to preserve */
+    int scan_threads;       /* Worker threads for reference scanning */
+    char *index_file;       /* Persistent reference index, or NULL */
+    int full_rescan;        /* Re-read every directory despite the index */
+    hash_algorithm_t hash_algorithm; /* Content hash used to compare candidates */
+    int defer_hash;         /* Stop reading references at the first mismatch */
+    int mmap_compare;       /* Compare unique-sized files through mappings */
+    int io_uring;           /* Use the io_uring backend where available */
+    int queue_depth;        /* io_uring submission queue entries */
+    int io_buffers;         /* io_uring copy buffers kept in flight */
+    int walk_threads;       /* Worker threads walking source directories */
+    int match_threads;      /* Worker threads matching source files */
+    int copy_threads;       /* Worker threads copying or linking files */
+    int dedup_copies;       /* Link later sources to files copied earlier in the run */
+    size_t max_index_memory; /* Spill the reference index to disk beyond this, or 0 */
+    int prune_references;   /* Index only references of a size some source file has */
 } options_t;
 
-/* Reference file information for deduplication */
+/* Deferred digest state of a reference read part way */
+typedef struct {
+    hash_ctx_t ctx;
+    off_t hashed;                       /* Bytes fed to ctx */
+} partial_hash_t;
+
+typedef struct file_table file_table_t;
+
+/* The start of a source file as read while matching it, so that a source
+ * without a match can be copied without reading those bytes again */
+typedef struct {
+    unsigned char *data;                /* Allocated on first use */
+    size_t length;                      /* Bytes staged, from offset 0 */
+    size_t capacity;                    /* Most bytes that may be staged */
+} source_stage_t;
+
+/* Working record for one file being matched: a source, a file copied
+ * during the run, or a reference loaded from its row of the index */
 typedef struct file_info {
     char *path;                         /* Full path to file */
     off_t size;                         /* File size in bytes */
-    unsigned char md5[MD5_DIGEST_LENGTH]; /* MD5 checksum */
-    int needs_md5;                      /* Whether MD5 calculation is needed */
-    int has_md5;                        /* Whether MD5 has been calculated */
+    unsigned char digest[HASH_MAX_DIGEST_LENGTH]; /* Content hash */
+    int needs_digest;                   /* Whether a content hash is needed */
+    int has_digest;                     /* Whether the content hash has been calculated */
+    uint64_t fingerprint;               /* Hash of a few sampled blocks */
+    int has_fingerprint;                /* Whether the fingerprint has been calculated */
+    partial_hash_t *partial;            /* Deferred digest state, or NULL */
+    source_stage_t *stage;              /* Source data read so far, or NULL */
+    int fd;                             /* Source held open by the caller, or -1 */
+    dev_t dev;                          /* Device containing the file */
+    ino_t ino;                          /* Inode number */
+    file_table_t *table;                /* Index the record was loaded from, or NULL */
+    int row;                            /* Row in table */
     struct file_info *next;             /* Next file in linked list */
 } file_info_t;
 
+/* A reference file that matched a source */
+typedef struct {
+    char *path;                         /* Allocated; freed by the caller */
+    int row;                            /* Row in the index, or -1 for a copy made in this run */
+} reference_t;
+
+/* Entry metadata gathered during directory traversal */
+typedef struct {
+    mode_t mode;            /* File type and permissions */
+    off_t size;             /* File size in bytes */
+    dev_t dev;              /* Device containing the file */
+    ino_t ino;              /* Inode number */
+    struct timespec mtime;  /* Last modification time */
+    struct timespec ctime;  /* Last status change time */
+} entry_stat_t;
+
 /* Command line parsing */
 int parse_args(int argc, char *argv[], options_t *opts);
 
 /* Main copy operations */
 int copy_directory(const options_t *opts, stats_t *stats);
-int create_directory_structure(const char *src_path, const char *dest_path);
 
-/* Sorted file info structure */
+/* Reference directory metadata, used to refresh the index incrementally */
 typedef struct {
-    file_info_t **files;
+    char *path;             /* Full path to directory */
+    dev_t dev;              /* Device containing the directory */
+    ino_t ino;              /* Inode number */
+    struct timespec mtime;  /* Last modification time */
+    struct timespec ctime;  /* Last status change time */
+} dir_info_t;
+
+/* Slot of the open-addressing table from a file size to its run of files
+ * in the sorted array */
+typedef struct {
+    off_t size;
+    int first;              /* Index of the first file of this size */
+    int count;              /* Files of this size; 0 marks an empty slot */
+} size_slot_t;
+
+/* Bump allocator for strings that are freed all at once */
+typedef struct arena_block arena_block_t;
+typedef struct {
+    arena_block_t *blocks;
+} string_arena_t;
+
+/* File table row flags */
+#define FILE_HAS_DIGEST       0x1
+#define FILE_HAS_FINGERPRINT  0x2
+
+/* Modification and status change times, kept for the persistent index */
+typedef struct {
+    struct timespec mtime;
+    struct timespec ctime;
+} file_times_t;
+
+/* Reference files stored column by column, with their names packed into
+ * an arena: a few large allocations however many files there are. A file's
+ * path is its directory's path and its name; the directories are listed
+ * separately, so their long shared prefixes are stored once. */
+struct file_table {
+    off_t *sizes;
+    char **names;               /* Base names, in arena */
+    int *dir_ids;               /* Index of each file's directory */
+    unsigned char *flags;       /* FILE_HAS_DIGEST, FILE_HAS_FINGERPRINT */
+    unsigned char *digests;     /* digest_length bytes per file */
+    uint64_t *fingerprints;
+    dev_t *devs;
+    ino_t *inos;
+    file_times_t *times;        /* NULL unless the table was created with times */
+    partial_hash_t **partials;  /* NULL unless digests may be deferred */
     int count;
     int capacity;
+    size_t digest_length;
+    string_arena_t arena;
+    void *mapping;              /* File the columns and names are mapped from, or NULL */
+    size_t mapping_length;
+};
+
+/* Sorted file info structure */
+typedef struct {
+    file_table_t files;         /* Reference files, ordered by size then path */
+    dir_info_t *dirs;           /* Directories the files were found in */
+    int dir_count;
+    hash_algorithm_t algorithm; /* Algorithm of the files' digests */
+    size_slot_t *size_index;    /* Table of sizes, or NULL to binary search */
+    size_t size_index_mask;     /* Table slots minus one */
+    off_t *size_directory;      /* First size of every SIZE_DIRECTORY_STRIDE rows, or NULL */
+    int size_directory_count;
+    file_info_t **live;     /* Files copied during this run, chained in buckets by size */
+    size_t live_buckets;    /* Number of buckets, a power of two (0 until first use) */
+    size_t live_count;
+    pthread_rwlock_t live_lock; /* Protects live, live_buckets and live_count */
+    dev_t link_device;          /* Device the destination is written to */
+    int link_device_only;       /* Only references on link_device can be linked to */
 } sorted_file_info_t;
 
+/* Reference index saved by a previous run */
+typedef struct saved_index saved_index_t;
+
+/* Work-stealing pool used for parallel directory traversal */
+typedef struct work_pool work_pool_t;
+typedef void (*work_fn_t)(work_pool_t *pool, int worker, void *item, void *ctx);
+int work_pool_run(int nthreads, void **items, int item_count, work_fn_t fn, void *ctx);
+void work_pool_push(work_pool_t *pool, int worker, void *item);
+
+/* Threaded stages connected by bounded queues */
+typedef struct pipeline pipeline_t;
+typedef struct {
+    void *(*fn)(void *item, void *ctx); /* Returns the item for the next stage, or NULL */
+    int threads;
+} pipeline_stage_t;
+pipeline_t *pipeline_start(const pipeline_stage_t *stages, int stage_count,
+                           size_t queue_capacity, void *ctx);
+void pipeline_submit(pipeline_t *pipeline, void *item);
+void pipeline_finish(pipeline_t *pipeline);
+
+/* Directory traversal helpers */
+mode_t dirent_mode(const struct dirent *entry);
+int stat_entry(int dirfd, const char *name, entry_stat_t *est);
+char *join_path(const char *dir, const char *name);
+
+/* Column-wise file tables and their string arena */
+void file_table_init(file_table_t *table, size_t digest_length, int with_times);
+int file_table_add(file_table_t *table, int dir_id, const char *name, const entry_stat_t *est);
+int file_table_copy_row(file_table_t *table, const file_table_t *from, int row, int dir_id);
+int file_table_merge(file_table_t *table, file_table_t *from, int dir_offset);
+int file_table_sort(file_table_t *table, const dir_info_t *dirs);
+size_t file_table_memory(const file_table_t *table);
+void file_table_free(file_table_t *table);
+
+/* Sorted runs of reference files spilled to disk, and their merge */
+typedef struct spill_set spill_set_t;
+spill_set_t *spill_set_create(size_t digest_length, int with_times);
+int spill_table(spill_set_t *set, file_table_t *table, const dir_info_t *dirs, int list);
+int spill_run_count(spill_set_t *set);
+int spill_merge(spill_set_t *set, const dir_info_t *dirs, const int *dir_offsets, int with_partials,
+                file_table_t *merged);
+void spill_set_free(spill_set_t *set);
+
+/* Sizes of the source files, for pruning the reference index */
+typedef struct size_filter size_filter_t;
+size_filter_t *collect_source_sizes(const options_t *opts);
+int size_filter_contains(const size_filter_t *filter, off_t size);
+void free_size_filter(size_filter_t *filter);
+
 /* File matching and deduplication */
+int collect_reference_files(const options_t *opts, saved_index_t *saved, const size_filter_t *sizes,
+                            file_table_t *files, dir_info_t **dirs, int *dir_count);
 sorted_file_info_t *scan_reference_directory(const options_t *opts);
-file_info_t *find_matching_file(sorted_file_info_t *ref_files, const char *src_file, const options_t *opts);
-int files_identical(const char *file1, const char *file2);
-int files_match(file_info_t *ref_file, file_info_t *src_file);
+sorted_file_info_t *create_reference_index(const options_t *opts);
+int add_live_reference(sorted_file_info_t *ref_files, const char *path, off_t size,
+                       const unsigned char *digest);
+size_t live_reference_count(sorted_file_info_t *ref_files);
+char *reference_path(const sorted_file_info_t *ref_files, int row);
+size_t size_hash(off_t size);
+int build_size_index(sorted_file_info_t *ref_files);
+int build_size_directory(sorted_file_info_t *ref_files);
+int lookup_size_run(const sorted_file_info_t *ref_files, off_t size, int *first);
+int search_size_run(const sorted_file_info_t *ref_files, off_t size, int *first);
+int find_live_match(sorted_file_info_t *ref_files, const char *src_file, int src_fd,
+                    const struct stat *src_st, source_stage_t *stage, const options_t *opts,
+                    reference_t *match);
+int find_matching_file(sorted_file_info_t *ref_files, const char *src_file, int src_fd,
+                       const struct stat *src_st, source_stage_t *stage, const options_t *opts,
+                       reference_t *match);
+size_t compare_buffers(const void *a, const void *b, size_t len);
+int compare_files(const char *path1, const char *path2, off_t *difference);
+int compare_fds(int fd1, int fd2, off_t *difference);
+int compare_fds_mapped(int fd1, int fd2, off_t *difference);
+void source_stage_init(source_stage_t *stage, size_t capacity);
+ssize_t source_stage_read(source_stage_t *stage, int fd, void *buffer, size_t length, off_t offset);
+void source_stage_add(source_stage_t *stage, const void *data, size_t length, off_t offset);
+void source_stage_free(source_stage_t *stage);
+void lock_reference_row(int row);
+void unlock_reference_row(int row);
+
+/* Asynchronous I/O backend (io_uring on Linux, POSIX elsewhere) */
+typedef struct io_ring io_ring_t;
+typedef struct {
+    int fd;
+    void *buffer;
+    size_t length;
+    off_t offset;
+    ssize_t result;         /* Bytes read, or -1 on error */
+} io_request_t;
+io_ring_t *io_ring_thread(const options_t *opts);
+int io_ring_copy(io_ring_t *ring, int src_fd, int dest_fd, off_t size);
+void read_requests(io_ring_t *ring, io_request_t *requests, int count);
+
+/* Persistent reference index */
+saved_index_t *load_saved_index(const char *index_file, const options_t *opts);
+void free_saved_index(saved_index_t *index);
+int saved_index_reuse_dir(saved_index_t *index, const dir_info_t *dir, file_table_t *files, int dir_id,
+                          void (*visit_subdir)(const char *path, void *arg), void *arg);
+int saved_index_find_dir(const saved_index_t *index, const char *path);
+void saved_index_lookup_digest(const saved_index_t *index, int saved_dir, file_table_t *files, int row);
+int save_reference_index(const char *index_file, const sorted_file_info_t *ref_files);
+void refresh_reference_ctime(sorted_file_info_t *ref_files, const reference_t *ref);
 
 /* File operations */
-int copy_or_link_file(const char *src, const char *dest, const char *ref, const options_t *opts, stats_t *stats);
+int copy_or_link_file(const char *src, int src_fd, const struct stat *src_st, int dest_dir_fd,
+                      const char *dest, const char *ref, const options_t *opts, stats_t *stats,
+                      hash_ctx_t *hash, const source_stage_t *stage);
 int should_overwrite(const char *dest_path, const options_t *opts);
 int preserve_file_attributes(const char *src, const char *dest, const preserve_t *preserve);
+int apply_file_attributes(int dest_fd, const char *dest, const struct stat *src_st,
+                          const preserve_t *preserve);
 int parse_preserve_list(const char *preserve_list, preserve_t *preserve);
 
 /* Statistics and output formatting */
@@ -127,6 +408,7 @@ void format_stats_line(const stats_t *stats, int human_readable, char *buffer, s
 void print_statistics(const stats_t *stats, int human_readable);
 void free_file_list(file_info_t *list);
 void free_sorted_file_info(sorted_file_info_t *sorted_files);
+void free_dir_info(dir_info_t *dirs, int dir_count);
 void print_usage(const char *program_name);
 
 /* Terminal output and status display */
@@ -143,5 +425,6 @@ void setup_signal_handlers(void);
 void register_incomplete_file(const char *path);
 void unregister_incomplete_file(void);
 void cleanup_incomplete_file(void);
+void cleanup_incomplete_files(void);
 
 #endif
@@ -0,0 +1,69 @@
+/*
+ * cpdd/include/hash.h - Content hash selection
+ *
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "md5.h"
+#include "xxh3.h"
+#include "blake3.h"
+
+/* Largest digest produced by any supported algorithm */
+#define HASH_MAX_DIGEST_LENGTH 32
+
+/* Content hash algorithms. The numeric values are persisted in index
+ * files, so new algorithms must only ever be appended. */
+typedef enum {
+    HASH_MD5 = 0,
+    HASH_XXH3 = 1,
+    HASH_BLAKE3 = 2
+} hash_algorithm_t;
+
+/* Streaming hash state for any supported algorithm */
+typedef struct {
+    hash_algorithm_t algorithm;
+    union {
+        MD5_CTX md5;
+        XXH3_CTX xxh3;
+        BLAKE3_CTX blake3;
+    } u;
+} hash_ctx_t;
+
+/* Streaming hash functions */
+void hash_init(hash_ctx_t *ctx, hash_algorithm_t algorithm);
+void hash_update(hash_ctx_t *ctx, const void *data, size_t len);
+void hash_final(hash_ctx_t *ctx, unsigned char *digest);
+
+/* Algorithm properties */
+size_t hash_digest_length(hash_algorithm_t algorithm);
+const char *hash_name(hash_algorithm_t algorithm);
+int hash_from_name(const char *name, hash_algorithm_t *algorithm);
+
+/* High-level file hash computation */
+int hash_file(const char *filename, hash_algorithm_t algorithm, unsigned char *digest);
+
+#endif
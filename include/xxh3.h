@@ -0,0 +1,55 @@
+/*
+ * cpdd/include/xxh3.h - XXH3 64-bit non-cryptographic hash
+ *
+ * Implementation of the XXH3 64-bit hash (default secret, seed 0) following
+ * the xxHash specification by Yann Collet. Output is identical to
+ * XXH3_64bits() from the reference library.
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef XXH3_H
+#define XXH3_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define XXH3_DIGEST_LENGTH 8
+#define XXH3_BUFFER_SIZE 256
+
+/* Streaming XXH3 state */
+typedef struct {
+    uint64_t acc[8];                        /* Accumulators */
+    unsigned char buffer[XXH3_BUFFER_SIZE]; /* Input not yet consumed */
+    size_t buffered;                        /* Bytes in buffer */
+    size_t stripes_in_block;                /* Stripes consumed in current block */
+    uint64_t total_len;                     /* Total bytes hashed */
+} XXH3_CTX;
+
+/* XXH3 computation functions */
+void XXH3_Init(XXH3_CTX *ctx);
+void XXH3_Update(XXH3_CTX *ctx, const void *data, size_t len);
+void XXH3_Final(unsigned char digest[XXH3_DIGEST_LENGTH], XXH3_CTX *ctx);
+
+/* One-shot hash of a buffer */
+uint64_t xxh3_64(const void *data, size_t len);
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * cpdd/src/common/blake3.c - BLAKE3 cryptographic hash
+ *
+ * Portable implementation of the BLAKE3 hash (default 32-byte output, no key)
+ * following the BLAKE3 specification by O'Connor, Aumasson, Neves and
+ * Wilcox-O'Hearn.
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "blake3.h"
+#include <string.h>
+
+#define CHUNK_START (1U << 0)
+#define CHUNK_END   (1U << 1)
+#define PARENT      (1U << 2)
+#define ROOT        (1U << 3)
+
+static const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const unsigned char MSG_SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}
+};
+
+static uint32_t read32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static void g(uint32_t *s, int a, int b, int c, int d, uint32_t x, uint32_t y) {
+    s[a] = s[a] + s[b] + x;
+    s[d] = rotr32(s[d] ^ s[a], 16);
+    s[c] = s[c] + s[d];
+    s[b] = rotr32(s[b] ^ s[c], 12);
+    s[a] = s[a] + s[b] + y;
+    s[d] = rotr32(s[d] ^ s[a], 8);
+    s[c] = s[c] + s[d];
+    s[b] = rotr32(s[b] ^ s[c], 7);
+}
+
+/* Compresses one block into cv, in place (the truncated 8-word output) */
+static void compress(uint32_t cv[8], const unsigned char block[BLAKE3_BLOCK_LEN],
+                     uint32_t block_len, uint64_t counter, uint32_t flags) {
+    uint32_t m[16];
+    uint32_t s[16];
+
+    for (int i = 0; i < 16; i++) {
+        m[i] = read32(block + 4 * i);
+    }
+    memcpy(s, cv, 8 * sizeof(uint32_t));
+    s[8] = IV[0];
+    s[9] = IV[1];
+    s[10] = IV[2];
+    s[11] = IV[3];
+    s[12] = (uint32_t)counter;
+    s[13] = (uint32_t)(counter >> 32);
+    s[14] = block_len;
+    s[15] = flags;
+
+    for (int r = 0; r < 7; r++) {
+        const unsigned char *sched = MSG_SCHEDULE[r];
+        g(s, 0, 4, 8, 12, m[sched[0]], m[sched[1]]);
+        g(s, 1, 5, 9, 13, m[sched[2]], m[sched[3]]);
+        g(s, 2, 6, 10, 14, m[sched[4]], m[sched[5]]);
+        g(s, 3, 7, 11, 15, m[sched[6]], m[sched[7]]);
+        g(s, 0, 5, 10, 15, m[sched[8]], m[sched[9]]);
+        g(s, 1, 6, 11, 12, m[sched[10]], m[sched[11]]);
+        g(s, 2, 7, 8, 13, m[sched[12]], m[sched[13]]);
+        g(s, 3, 4, 9, 14, m[sched[14]], m[sched[15]]);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        cv[i] = s[i] ^ s[i + 8];
+    }
+}
+
+/* Chaining value of a parent node from its two children */
+static void parent_cv(uint32_t out[8], const uint32_t left[8], const uint32_t right[8], uint32_t flags) {
+    unsigned char block[BLAKE3_BLOCK_LEN];
+
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 4; j++) {
+            block[4 * i + j] = (unsigned char)(left[i] >> (8 * j));
+            block[32 + 4 * i + j] = (unsigned char)(right[i] >> (8 * j));
+        }
+    }
+    memcpy(out, IV, sizeof(IV));
+    compress(out, block, BLAKE3_BLOCK_LEN, 0, PARENT | flags);
+}
+
+static uint32_t chunk_start_flag(const BLAKE3_CTX *ctx) {
+    return ctx->chunk_len <= BLAKE3_BLOCK_LEN ? CHUNK_START : 0;
+}
+
+/* Pushes a completed chunk's chaining value, merging completed subtrees.
+ * total_chunks is the number of chunks hashed so far, including this one;
+ * each trailing zero bit marks a subtree that is now complete. */
+static void push_chunk_cv(BLAKE3_CTX *ctx, uint32_t cv[8], uint64_t total_chunks) {
+    while ((total_chunks & 1) == 0) {
+        ctx->cv_stack_len--;
+        parent_cv(cv, ctx->cv_stack[ctx->cv_stack_len], cv, 0);
+        total_chunks >>= 1;
+    }
+    memcpy(ctx->cv_stack[ctx->cv_stack_len++], cv, 8 * sizeof(uint32_t));
+}
+
+void BLAKE3_Init(BLAKE3_CTX *ctx) {
+    memcpy(ctx->cv, IV, sizeof(IV));
+    ctx->chunk_counter = 0;
+    ctx->block_len = 0;
+    ctx->chunk_len = 0;
+    ctx->cv_stack_len = 0;
+}
+
+void BLAKE3_Update(BLAKE3_CTX *ctx, const void *data, size_t len) {
+    const unsigned char *input = data;
+
+    while (len > 0) {
+        size_t take;
+
+        /* A full chunk is only finalized once more input arrives, since
+         * the last chunk of the message is compressed with ROOT */
+        if (ctx->chunk_len == BLAKE3_CHUNK_LEN) {
+            compress(ctx->cv, ctx->block, BLAKE3_BLOCK_LEN, ctx->chunk_counter, CHUNK_END);
+            push_chunk_cv(ctx, ctx->cv, ctx->chunk_counter + 1);
+            memcpy(ctx->cv, IV, sizeof(IV));
+            ctx->chunk_counter++;
+            ctx->block_len = 0;
+            ctx->chunk_len = 0;
+        }
+
+        /* Likewise, a full block is held back until the chunk continues */
+        if (ctx->block_len == BLAKE3_BLOCK_LEN) {
+            compress(ctx->cv, ctx->block, BLAKE3_BLOCK_LEN, ctx->chunk_counter,
+                     ctx->chunk_len == BLAKE3_BLOCK_LEN ? CHUNK_START : 0);
+            ctx->block_len = 0;
+        }
+
+        take = BLAKE3_BLOCK_LEN - ctx->block_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(ctx->block + ctx->block_len, input, take);
+        ctx->block_len += take;
+        ctx->chunk_len += take;
+        input += take;
+        len -= take;
+    }
+}
+
+void BLAKE3_Final(unsigned char digest[BLAKE3_DIGEST_LENGTH], BLAKE3_CTX *ctx) {
+    uint32_t cv[8];
+    uint32_t flags = chunk_start_flag(ctx) | CHUNK_END;
+
+    memset(ctx->block + ctx->block_len, 0, BLAKE3_BLOCK_LEN - ctx->block_len);
+    memcpy(cv, ctx->cv, sizeof(cv));
+
+    if (ctx->cv_stack_len == 0) {
+        /* Single chunk message: the chunk itself is the root */
+        compress(cv, ctx->block, (uint32_t)ctx->block_len, ctx->chunk_counter, flags | ROOT);
+    } else {
+        compress(cv, ctx->block, (uint32_t)ctx->block_len, ctx->chunk_counter, flags);
+        /* Fold the remaining subtrees right to left; the last merge is the root */
+        for (size_t i = ctx->cv_stack_len; i-- > 0;) {
+            parent_cv(cv, ctx->cv_stack[i], cv, i == 0 ? ROOT : 0);
+        }
+    }
+
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 4; j++) {
+            digest[4 * i + j] = (unsigned char)(cv[i] >> (8 * j));
+        }
+    }
+    memset(ctx, 0, sizeof(*ctx));
+}
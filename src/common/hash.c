@@ -0,0 +1,142 @@
+/*
+ * cpdd/src/common/hash.c - Content hash selection
+ *
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "hash.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+void hash_init(hash_ctx_t *ctx, hash_algorithm_t algorithm) {
+    ctx->algorithm = algorithm;
+    switch (algorithm) {
+    case HASH_XXH3:
+        XXH3_Init(&ctx->u.xxh3);
+        break;
+    case HASH_BLAKE3:
+        BLAKE3_Init(&ctx->u.blake3);
+        break;
+    case HASH_MD5:
+    default:
+        MD5_Init(&ctx->u.md5);
+        break;
+    }
+}
+
+void hash_update(hash_ctx_t *ctx, const void *data, size_t len) {
+    switch (ctx->algorithm) {
+    case HASH_XXH3:
+        XXH3_Update(&ctx->u.xxh3, data, len);
+        break;
+    case HASH_BLAKE3:
+        BLAKE3_Update(&ctx->u.blake3, data, len);
+        break;
+    case HASH_MD5:
+    default:
+        MD5_Update(&ctx->u.md5, data, len);
+        break;
+    }
+}
+
+/* Writes hash_digest_length(ctx->algorithm) bytes to digest */
+void hash_final(hash_ctx_t *ctx, unsigned char *digest) {
+    switch (ctx->algorithm) {
+    case HASH_XXH3:
+        XXH3_Final(digest, &ctx->u.xxh3);
+        break;
+    case HASH_BLAKE3:
+        BLAKE3_Final(digest, &ctx->u.blake3);
+        break;
+    case HASH_MD5:
+    default:
+        MD5_Final(digest, &ctx->u.md5);
+        break;
+    }
+}
+
+size_t hash_digest_length(hash_algorithm_t algorithm) {
+    switch (algorithm) {
+    case HASH_XXH3:
+        return XXH3_DIGEST_LENGTH;
+    case HASH_BLAKE3:
+        return BLAKE3_DIGEST_LENGTH;
+    case HASH_MD5:
+    default:
+        return MD5_DIGEST_LENGTH;
+    }
+}
+
+const char *hash_name(hash_algorithm_t algorithm) {
+    switch (algorithm) {
+    case HASH_XXH3:
+        return "xxh3";
+    case HASH_BLAKE3:
+        return "blake3";
+    case HASH_MD5:
+    default:
+        return "md5";
+    }
+}
+
+/* Parses an algorithm name (case-insensitive). Returns 0 on success, -1 if unknown. */
+int hash_from_name(const char *name, hash_algorithm_t *algorithm) {
+    if (strcasecmp(name, "md5") == 0) {
+        *algorithm = HASH_MD5;
+    } else if (strcasecmp(name, "xxh3") == 0) {
+        *algorithm = HASH_XXH3;
+    } else if (strcasecmp(name, "blake3") == 0) {
+        *algorithm = HASH_BLAKE3;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int hash_file(const char *filename, hash_algorithm_t algorithm, unsigned char *digest) {
+    FILE *file;
+    hash_ctx_t ctx;
+    unsigned char buffer[65536];
+    size_t bytes_read;
+
+    file = fopen(filename, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    hash_init(&ctx, algorithm);
+
+    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        hash_update(&ctx, buffer, bytes_read);
+    }
+
+    if (ferror(file)) {
+        fclose(file);
+        return -1;
+    }
+
+    hash_final(&ctx, digest);
+    fclose(file);
+
+    return 0;
+}
@@ -0,0 +1,357 @@
+/*
+ * cpdd/src/common/xxh3.c - XXH3 64-bit non-cryptographic hash
+ *
+ * Implementation of the XXH3 64-bit hash (default secret, seed 0) following
+ * the xxHash specification by Yann Collet. Output is identical to
+ * XXH3_64bits() from the reference library.
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "xxh3.h"
+#include <string.h>
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define STRIPE_LEN 64
+#define SECRET_SIZE 192
+#define SECRET_CONSUME_RATE 8
+#define SECRET_LIMIT (SECRET_SIZE - STRIPE_LEN)
+#define STRIPES_PER_BLOCK (SECRET_LIMIT / SECRET_CONSUME_RATE)
+#define BLOCK_LEN (STRIPE_LEN * STRIPES_PER_BLOCK)
+#define SECRET_MERGEACCS_START 11
+#define SECRET_LASTACC_START 7
+#define MIDSIZE_MAX 240
+#define MIDSIZE_STARTOFFSET 3
+#define MIDSIZE_LASTOFFSET 17
+#define SECRET_SIZE_MIN 136
+
+static const unsigned char SECRET[SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+static uint32_t read32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read64(const unsigned char *p) {
+    return (uint64_t)read32(p) | ((uint64_t)read32(p + 4) << 32);
+}
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t swap64(uint64_t x) {
+    return ((x << 56) & 0xff00000000000000ULL) | ((x << 40) & 0x00ff000000000000ULL) |
+           ((x << 24) & 0x0000ff0000000000ULL) | ((x << 8)  & 0x000000ff00000000ULL) |
+           ((x >> 8)  & 0x00000000ff000000ULL) | ((x >> 24) & 0x0000000000ff0000ULL) |
+           ((x >> 40) & 0x000000000000ff00ULL) | ((x >> 56) & 0x00000000000000ffULL);
+}
+
+/* 64x64 -> 128 bit multiply, folded to 64 bits by XOR of the halves */
+static uint64_t mul128_fold64(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    uint64_t hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+    uint64_t lo_hi = (a & 0xFFFFFFFF) * (b >> 32);
+    uint64_t hi_hi = (a >> 32) * (b >> 32);
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+    return lower ^ upper;
+#endif
+}
+
+static uint64_t xxh64_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t xxh3_avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= PRIME_MX1;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t rrmxmx(uint64_t h, uint64_t len) {
+    h ^= rotl64(h, 49) ^ rotl64(h, 24);
+    h *= PRIME_MX2;
+    h ^= (h >> 35) + len;
+    h *= PRIME_MX2;
+    h ^= h >> 28;
+    return h;
+}
+
+static uint64_t mix16(const unsigned char *input, const unsigned char *secret) {
+    return mul128_fold64(read64(input) ^ read64(secret), read64(input + 8) ^ read64(secret + 8));
+}
+
+static uint64_t hash_0to16(const unsigned char *input, size_t len) {
+    if (len > 8) {
+        uint64_t lo = read64(input) ^ (read64(SECRET + 24) ^ read64(SECRET + 32));
+        uint64_t hi = read64(input + len - 8) ^ (read64(SECRET + 40) ^ read64(SECRET + 48));
+        return xxh3_avalanche(len + swap64(lo) + hi + mul128_fold64(lo, hi));
+    }
+    if (len >= 4) {
+        uint64_t combined = read32(input + len - 4) + ((uint64_t)read32(input) << 32);
+        return rrmxmx(combined ^ (read64(SECRET + 8) ^ read64(SECRET + 16)), len);
+    }
+    if (len > 0) {
+        uint32_t combined = ((uint32_t)input[0] << 16) | ((uint32_t)input[len >> 1] << 24) |
+                            (uint32_t)input[len - 1] | ((uint32_t)len << 8);
+        return xxh64_avalanche((uint64_t)combined ^ (uint64_t)(read32(SECRET) ^ read32(SECRET + 4)));
+    }
+    return xxh64_avalanche(read64(SECRET + 56) ^ read64(SECRET + 64));
+}
+
+static uint64_t hash_17to128(const unsigned char *input, size_t len) {
+    uint64_t acc = len * PRIME64_1;
+
+    if (len > 32) {
+        if (len > 64) {
+            if (len > 96) {
+                acc += mix16(input + 48, SECRET + 96);
+                acc += mix16(input + len - 64, SECRET + 112);
+            }
+            acc += mix16(input + 32, SECRET + 64);
+            acc += mix16(input + len - 48, SECRET + 80);
+        }
+        acc += mix16(input + 16, SECRET + 32);
+        acc += mix16(input + len - 32, SECRET + 48);
+    }
+    acc += mix16(input, SECRET);
+    acc += mix16(input + len - 16, SECRET + 16);
+
+    return xxh3_avalanche(acc);
+}
+
+static uint64_t hash_129to240(const unsigned char *input, size_t len) {
+    uint64_t acc = len * PRIME64_1;
+    uint64_t acc_end;
+    size_t rounds = len / 16;
+
+    for (size_t i = 0; i < 8; i++) {
+        acc += mix16(input + 16 * i, SECRET + 16 * i);
+    }
+    acc_end = mix16(input + len - 16, SECRET + SECRET_SIZE_MIN - MIDSIZE_LASTOFFSET);
+    acc = xxh3_avalanche(acc);
+    for (size_t i = 8; i < rounds; i++) {
+        acc_end += mix16(input + 16 * i, SECRET + 16 * (i - 8) + MIDSIZE_STARTOFFSET);
+    }
+    return xxh3_avalanche(acc + acc_end);
+}
+
+static uint64_t hash_short(const unsigned char *input, size_t len) {
+    if (len <= 16) {
+        return hash_0to16(input, len);
+    }
+    if (len <= 128) {
+        return hash_17to128(input, len);
+    }
+    return hash_129to240(input, len);
+}
+
+static void accumulate_512(uint64_t acc[8], const unsigned char *input, const unsigned char *secret) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t data = read64(input + 8 * i);
+        uint64_t key = data ^ read64(secret + 8 * i);
+        acc[i ^ 1] += data;
+        acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+}
+
+static void scramble(uint64_t acc[8], const unsigned char *secret) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= read64(secret + 8 * i);
+        a *= PRIME32_1;
+        acc[i] = a;
+    }
+}
+
+static void accumulate(uint64_t acc[8], const unsigned char *input, const unsigned char *secret, size_t stripes) {
+    for (size_t n = 0; n < stripes; n++) {
+        accumulate_512(acc, input + n * STRIPE_LEN, secret + n * SECRET_CONSUME_RATE);
+    }
+}
+
+/* Consumes whole stripes, scrambling the accumulators at block boundaries */
+static void consume_stripes(uint64_t acc[8], size_t *stripes_in_block, const unsigned char *input, size_t stripes) {
+    if (STRIPES_PER_BLOCK - *stripes_in_block <= stripes) {
+        size_t to_block_end = STRIPES_PER_BLOCK - *stripes_in_block;
+        size_t after_block = stripes - to_block_end;
+        accumulate(acc, input, SECRET + *stripes_in_block * SECRET_CONSUME_RATE, to_block_end);
+        scramble(acc, SECRET + SECRET_LIMIT);
+        accumulate(acc, input + to_block_end * STRIPE_LEN, SECRET, after_block);
+        *stripes_in_block = after_block;
+    } else {
+        accumulate(acc, input, SECRET + *stripes_in_block * SECRET_CONSUME_RATE, stripes);
+        *stripes_in_block += stripes;
+    }
+}
+
+static uint64_t merge_accs(const uint64_t acc[8], uint64_t start) {
+    const unsigned char *secret = SECRET + SECRET_MERGEACCS_START;
+    uint64_t result = start;
+
+    for (int i = 0; i < 4; i++) {
+        result += mul128_fold64(acc[2 * i] ^ read64(secret + 16 * i), acc[2 * i + 1] ^ read64(secret + 16 * i + 8));
+    }
+    return xxh3_avalanche(result);
+}
+
+static void init_acc(uint64_t acc[8]) {
+    acc[0] = PRIME32_3;
+    acc[1] = PRIME64_1;
+    acc[2] = PRIME64_2;
+    acc[3] = PRIME64_3;
+    acc[4] = PRIME64_4;
+    acc[5] = PRIME32_2;
+    acc[6] = PRIME64_5;
+    acc[7] = PRIME32_1;
+}
+
+uint64_t xxh3_64(const void *data, size_t len) {
+    const unsigned char *input = data;
+    uint64_t acc[8];
+    size_t blocks, stripes;
+
+    if (len <= MIDSIZE_MAX) {
+        return hash_short(input, len);
+    }
+
+    init_acc(acc);
+    blocks = (len - 1) / BLOCK_LEN;
+    for (size_t n = 0; n < blocks; n++) {
+        accumulate(acc, input + n * BLOCK_LEN, SECRET, STRIPES_PER_BLOCK);
+        scramble(acc, SECRET + SECRET_LIMIT);
+    }
+    stripes = ((len - 1) - BLOCK_LEN * blocks) / STRIPE_LEN;
+    accumulate(acc, input + blocks * BLOCK_LEN, SECRET, stripes);
+    accumulate_512(acc, input + len - STRIPE_LEN, SECRET + SECRET_LIMIT - SECRET_LASTACC_START);
+
+    return merge_accs(acc, len * PRIME64_1);
+}
+
+void XXH3_Init(XXH3_CTX *ctx) {
+    init_acc(ctx->acc);
+    ctx->buffered = 0;
+    ctx->stripes_in_block = 0;
+    ctx->total_len = 0;
+}
+
+void XXH3_Update(XXH3_CTX *ctx, const void *data, size_t len) {
+    const unsigned char *input = data;
+    const unsigned char *end = input + len;
+
+    ctx->total_len += len;
+
+    if (ctx->buffered + len <= XXH3_BUFFER_SIZE) {
+        memcpy(ctx->buffer + ctx->buffered, input, len);
+        ctx->buffered += len;
+        return;
+    }
+
+    if (ctx->buffered) {
+        size_t fill = XXH3_BUFFER_SIZE - ctx->buffered;
+        memcpy(ctx->buffer + ctx->buffered, input, fill);
+        input += fill;
+        consume_stripes(ctx->acc, &ctx->stripes_in_block, ctx->buffer, XXH3_BUFFER_SIZE / STRIPE_LEN);
+        ctx->buffered = 0;
+    }
+
+    /* Consume directly from the input, always keeping the tail buffered so
+     * the final stripe can be processed by XXH3_Final */
+    if ((size_t)(end - input) > XXH3_BUFFER_SIZE) {
+        const unsigned char *limit = end - XXH3_BUFFER_SIZE;
+        do {
+            consume_stripes(ctx->acc, &ctx->stripes_in_block, input, XXH3_BUFFER_SIZE / STRIPE_LEN);
+            input += XXH3_BUFFER_SIZE;
+        } while (input < limit);
+        memcpy(ctx->buffer + XXH3_BUFFER_SIZE - STRIPE_LEN, input - STRIPE_LEN, STRIPE_LEN);
+    }
+
+    memcpy(ctx->buffer, input, (size_t)(end - input));
+    ctx->buffered = (size_t)(end - input);
+}
+
+void XXH3_Final(unsigned char digest[XXH3_DIGEST_LENGTH], XXH3_CTX *ctx) {
+    uint64_t h;
+
+    if (ctx->total_len > MIDSIZE_MAX) {
+        uint64_t acc[8];
+        size_t stripes_in_block = ctx->stripes_in_block;
+
+        memcpy(acc, ctx->acc, sizeof(acc));
+        if (ctx->buffered >= STRIPE_LEN) {
+            size_t stripes = (ctx->buffered - 1) / STRIPE_LEN;
+            consume_stripes(acc, &stripes_in_block, ctx->buffer, stripes);
+            accumulate_512(acc, ctx->buffer + ctx->buffered - STRIPE_LEN,
+                           SECRET + SECRET_LIMIT - SECRET_LASTACC_START);
+        } else {
+            /* The last stripe straddles the previous buffer contents */
+            unsigned char last[STRIPE_LEN];
+            size_t catchup = STRIPE_LEN - ctx->buffered;
+            memcpy(last, ctx->buffer + XXH3_BUFFER_SIZE - catchup, catchup);
+            memcpy(last + catchup, ctx->buffer, ctx->buffered);
+            accumulate_512(acc, last, SECRET + SECRET_LIMIT - SECRET_LASTACC_START);
+        }
+        h = merge_accs(acc, ctx->total_len * PRIME64_1);
+    } else {
+        h = hash_short(ctx->buffer, (size_t)ctx->total_len);
+    }
+
+    /* Canonical (big-endian) representation, as printed by xxhsum */
+    for (int i = 0; i < XXH3_DIGEST_LENGTH; i++) {
+        digest[i] = (unsigned char)(h >> (56 - 8 * i));
+    }
+    memset(ctx, 0, sizeof(*ctx));
+}
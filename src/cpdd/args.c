@@ -24,6 +24,7 @@
 
 #include "cpdd.h"
 #include <getopt.h>
+#include <stdint.h>
 
 /* Parse comma-separated preserve attribute list */
 int parse_preserve_list(const char *preserve_list, preserve_t *preserve) {
@@ -43,14 +44,17 @@ int parse_preserve_list(const char *preserve_list, preserve_t *preserve) {
             preserve->ownership = 1;
         } else if (strcmp(token, "timestamps") == 0) {
             preserve->timestamps = 1;
+        } else if (strcmp(token, "links") == 0) {
+            preserve->links = 1;
         } else if (strcmp(token, "all") == 0) {
             preserve->all = 1;
             preserve->mode = 1;
             preserve->ownership = 1;
             preserve->timestamps = 1;
+            preserve->links = 1;
         } else {
             fprintf(stderr, "Error: Invalid preserve attribute '%s'\n", token);
-            fprintf(stderr, "Valid attributes: mode, ownership, timestamps, all\n");
+            fprintf(stderr, "Valid attributes: mode, ownership, timestamps, links, all\n");
             free(list_copy);
             return -1;
         }
@@ -68,13 +72,29 @@ void print_usage(const char *program_name) {
     printf("  -r, --reference DIR    Reference directory for content-based linking (can be used multiple times)\n");
     printf("  -L, --hard-link        Create hard links to reference files when content matches (default with -r)\n");
     printf("  -s, --symbolic-link    Create symbolic links to reference files when content matches\n");
+    printf("  --reflink              Clone reference files (copy-on-write) when content matches\n");
+    printf("  --dedup-copies         Also link files to identical files copied earlier in the run\n");
     printf("  -R, --recursive        Copy directories recursively\n");
     printf("  -n, --no-clobber       Never overwrite existing files\n");
     printf("  -i, --interactive      Prompt before overwrite\n");
     printf("  -p                     Same as --preserve=mode,ownership,timestamps\n");
     printf("  --preserve[=ATTR_LIST] Preserve the specified attributes\n");
     printf("                           (default: mode,ownership,timestamps)\n");
-    printf("                         Additional attributes: all\n");
+    printf("                         Additional attributes: links, all\n");
+    printf("  --scan-threads N       Scan reference directories with N threads (default: 1)\n");
+    printf("  --walk-threads N       Walk source directories with N threads (default: 1)\n");
+    printf("  --match-threads N      Match source files against references with N threads (default: 1)\n");
+    printf("  --copy-threads N       Copy or link files with N threads (default: 1)\n");
+    printf("  --index FILE           Cache reference digests in FILE between runs\n");
+    printf("  --full-rescan          Read every reference directory even if the index shows it unchanged\n");
+    printf("  --max-index-memory SIZE  Spill the reference index to disk beyond SIZE bytes (K, M, G suffixes)\n");
+    printf("  --prune-references     Index only reference files the size of some source file\n");
+    printf("  --hash ALGORITHM       Content hash for same-sized files: md5, xxh3 or blake3 (default: md5)\n");
+    printf("  --defer-hash           Stop reading a reference at its first mismatch, finishing its hash later\n");
+    printf("  --mmap-compare         Compare files through memory mappings (a file truncated meanwhile is fatal)\n");
+    printf("  --io-uring             Use io_uring for copy and compare I/O where available (Linux)\n");
+    printf("  --queue-depth N        io_uring submission queue depth (default: 32)\n");
+    printf("  --io-buffers N         io_uring copy buffers kept in flight (default: 8)\n");
     printf("  --stats                Show statistics after operation\n");
     printf("  -h, --human-readable   Show file sizes in human readable format\n");
     printf("  -v, --verbose          Verbose output (use multiple times for more verbosity: -vv, -vvv)\n");
@@ -100,6 +120,8 @@ int parse_args(int argc, char *argv[], options_t *opts) {
         {"reference",     required_argument, 0, 'r'},
         {"hard-link",     no_argument,       0, 'L'},
         {"symbolic-link", no_argument,       0, 's'},
+        {"reflink",       no_argument,       0, 'K'},
+        {"dedup-copies",  no_argument,       0, 'E'},
         {"recursive",     no_argument,       0, 'R'},
         {"no-clobber",    no_argument,       0, 'n'},
         {"interactive",   no_argument,       0, 'i'},
@@ -108,6 +130,20 @@ int parse_args(int argc, char *argv[], options_t *opts) {
         {"human-readable", no_argument,      0, 'h'},
         {"verbose",       no_argument,       0, 'v'},
         {"help",          no_argument,       0, 'H'},
+        {"scan-threads",  required_argument, 0, 'T'},
+        {"index",         required_argument, 0, 'I'},
+        {"full-rescan",   no_argument,       0, 'F'},
+        {"hash",          required_argument, 0, 'A'},
+        {"defer-hash",    no_argument,       0, 'D'},
+        {"mmap-compare",  no_argument,       0, 'O'},
+        {"io-uring",      no_argument,       0, 'U'},
+        {"queue-depth",   required_argument, 0, 'Q'},
+        {"io-buffers",    required_argument, 0, 'B'},
+        {"walk-threads",  required_argument, 0, 'W'},
+        {"match-threads", required_argument, 0, 'J'},
+        {"copy-threads",  required_argument, 0, 'C'},
+        {"max-index-memory", required_argument, 0, 'M'},
+        {"prune-references", no_argument,    0, 'G'},
         {0, 0, 0, 0}
     };
     
@@ -126,7 +162,23 @@ int parse_args(int argc, char *argv[], options_t *opts) {
     opts->preserve.mode = 0;
     opts->preserve.ownership = 0;
     opts->preserve.timestamps = 0;
+    opts->preserve.links = 0;
     opts->preserve.all = 0;
+    opts->scan_threads = 1;
+    opts->walk_threads = 1;
+    opts->match_threads = 1;
+    opts->copy_threads = 1;
+    opts->dedup_copies = 0;
+    opts->max_index_memory = 0;
+    opts->prune_references = 0;
+    opts->index_file = NULL;
+    opts->full_rescan = 0;
+    opts->hash_algorithm = HASH_MD5;
+    opts->defer_hash = 0;
+    opts->mmap_compare = 0;
+    opts->io_uring = 0;
+    opts->queue_depth = 32;
+    opts->io_buffers = 8;
     
     while ((opt = getopt_long(argc, argv, "r:LsRnipvhSH", long_options, &option_index)) != -1) {
         switch (opt) {
@@ -143,18 +195,28 @@ int parse_args(int argc, char *argv[], options_t *opts) {
             }
             case 'L':
                 if (opts->link_type != LINK_NONE) {
-                    fprintf(stderr, "Error: Cannot specify both hard and symbolic links\n");
+                    fprintf(stderr, "Error: Cannot specify more than one link type\n");
                     return -1;
                 }
                 opts->link_type = LINK_HARD;
                 break;
             case 's':
                 if (opts->link_type != LINK_NONE) {
-                    fprintf(stderr, "Error: Cannot specify both hard and symbolic links\n");
+                    fprintf(stderr, "Error: Cannot specify more than one link type\n");
                     return -1;
                 }
                 opts->link_type = LINK_SOFT;
                 break;
+            case 'K':
+                if (opts->link_type != LINK_NONE) {
+                    fprintf(stderr, "Error: Cannot specify more than one link type\n");
+                    return -1;
+                }
+                opts->link_type = LINK_REFLINK;
+                break;
+            case 'E':
+                opts->dedup_copies = 1;
+                break;
             case 'R':
                 opts->recursive = 1;
                 break;
@@ -197,6 +259,96 @@ int parse_args(int argc, char *argv[], options_t *opts) {
             case 'v':
                 opts->verbose++;
                 break;
+            case 'T': {
+                char *end;
+                long threads = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || threads < 1 || threads > 1024) {
+                    fprintf(stderr, "Error: Invalid scan thread count '%s'\n", optarg);
+                    return -1;
+                }
+                opts->scan_threads = (int)threads;
+                break;
+            }
+            case 'W':
+            case 'J':
+            case 'C': {
+                char *end;
+                long threads = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || threads < 1 || threads > 1024) {
+                    fprintf(stderr, "Error: Invalid %s thread count '%s'\n",
+                            opt == 'W' ? "walk" : opt == 'J' ? "match" : "copy", optarg);
+                    return -1;
+                }
+                if (opt == 'W') {
+                    opts->walk_threads = (int)threads;
+                } else if (opt == 'J') {
+                    opts->match_threads = (int)threads;
+                } else {
+                    opts->copy_threads = (int)threads;
+                }
+                break;
+            }
+            case 'I':
+                opts->index_file = optarg;
+                break;
+            case 'F':
+                opts->full_rescan = 1;
+                break;
+            case 'A':
+                if (hash_from_name(optarg, &opts->hash_algorithm) != 0) {
+                    fprintf(stderr, "Error: Unknown hash algorithm '%s' (expected md5, xxh3 or blake3)\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'D':
+                opts->defer_hash = 1;
+                break;
+            case 'O':
+                opts->mmap_compare = 1;
+                break;
+            case 'U':
+                opts->io_uring = 1;
+                break;
+            case 'Q':
+            case 'B': {
+                char *end;
+                long value = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || value < 1 || value > 4096) {
+                    fprintf(stderr, "Error: Invalid %s '%s'\n", opt == 'Q' ? "queue depth" : "buffer count", optarg);
+                    return -1;
+                }
+                if (opt == 'Q') {
+                    opts->queue_depth = (int)value;
+                } else {
+                    opts->io_buffers = (int)value;
+                }
+                break;
+            }
+            case 'M': {
+                char *end;
+                unsigned long long value = strtoull(optarg, &end, 10);
+                int shift = 0;
+                if (*end == 'K' || *end == 'k') {
+                    shift = 10;
+                } else if (*end == 'M' || *end == 'm') {
+                    shift = 20;
+                } else if (*end == 'G' || *end == 'g') {
+                    shift = 30;
+                }
+                if (shift) {
+                    end++;
+                }
+                if (*optarg < '0' || *optarg > '9' || *end != '\0' || value == 0 ||
+                    value > (SIZE_MAX >> shift)) {
+                    fprintf(stderr, "Error: Invalid index memory limit '%s'\n", optarg);
+                    return -1;
+                }
+                opts->max_index_memory = (size_t)value << shift;
+                break;
+            }
+            case 'G':
+                opts->prune_references = 1;
+                break;
             case 'H':
                 print_usage(argv[0]);
                 return 0;
@@ -219,14 +371,36 @@ int parse_args(int argc, char *argv[], options_t *opts) {
     opts->dest_dir = argv[argc - 1];
     
     /* Set hard links as default when reference directory is specified */
-    if (opts->ref_dir_count > 0 && opts->link_type == LINK_NONE) {
+    if ((opts->ref_dir_count > 0 || opts->dedup_copies) && opts->link_type == LINK_NONE) {
         opts->link_type = LINK_HARD;
     }
     
-    if (opts->link_type != LINK_NONE && opts->ref_dir_count == 0) {
+    if (opts->link_type != LINK_NONE && opts->ref_dir_count == 0 && !opts->dedup_copies) {
         fprintf(stderr, "Error: Link type specified but no reference directory provided\n");
         return -1;
     }
     
+    if (opts->max_index_memory && opts->ref_dir_count == 0) {
+        fprintf(stderr, "Error: --max-index-memory requires a reference directory\n");
+        return -1;
+    }
+    
+    if (opts->index_file && opts->ref_dir_count == 0) {
+        fprintf(stderr, "Error: --index requires a reference directory\n");
+        return -1;
+    }
+    
+    if (opts->prune_references && opts->ref_dir_count == 0) {
+        fprintf(stderr, "Error: --prune-references requires a reference directory\n");
+        return -1;
+    }
+    
+    /* A saved index must list every reference file, or the next run would
+     * take the pruned list of an unchanged directory as all of it */
+    if (opts->prune_references && opts->index_file) {
+        fprintf(stderr, "Error: --prune-references cannot be used with --index\n");
+        return -1;
+    }
+    
     return 0;
 }
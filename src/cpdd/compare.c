@@ -0,0 +1,358 @@
+/*
+ * cpdd/compare.c - Content comparison engine
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "cpdd.h"
+#include <pthread.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define COMPARE_X86 1
+#endif
+
+/* Returns the offset of the first differing byte, or len if none differ */
+typedef size_t (*compare_fn_t)(const unsigned char *a, const unsigned char *b, size_t len);
+
+/* Portable kernel: libc memcmp finds the differing block, a byte scan the offset */
+static size_t compare_generic(const unsigned char *a, const unsigned char *b, size_t len) {
+    size_t offset = 0;
+
+    while (offset < len) {
+        size_t chunk = len - offset < 4096 ? len - offset : 4096;
+        if (memcmp(a + offset, b + offset, chunk) != 0) {
+            while (a[offset] == b[offset]) {
+                offset++;
+            }
+            return offset;
+        }
+        offset += chunk;
+    }
+
+    return len;
+}
+
+#ifdef COMPARE_X86
+/* SSE2 is part of the x86-64 baseline, so this kernel is always available */
+static size_t compare_sse2(const unsigned char *a, const unsigned char *b, size_t len) {
+    size_t offset = 0;
+
+    for (; offset + 64 <= len; offset += 64) {
+        __m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + offset)),
+                                     _mm_loadu_si128((const __m128i *)(b + offset)));
+        __m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + offset + 16)),
+                                     _mm_loadu_si128((const __m128i *)(b + offset + 16)));
+        __m128i eq2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + offset + 32)),
+                                     _mm_loadu_si128((const __m128i *)(b + offset + 32)));
+        __m128i eq3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + offset + 48)),
+                                     _mm_loadu_si128((const __m128i *)(b + offset + 48)));
+        __m128i all = _mm_and_si128(_mm_and_si128(eq0, eq1), _mm_and_si128(eq2, eq3));
+
+        if (_mm_movemask_epi8(all) != 0xFFFF) {
+            break; /* Locate the byte below */
+        }
+    }
+    for (; offset + 16 <= len; offset += 16) {
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + offset)),
+                           _mm_loadu_si128((const __m128i *)(b + offset))));
+        if (mask != 0xFFFF) {
+            return offset + (size_t)__builtin_ctz(~mask);
+        }
+    }
+    for (; offset < len; offset++) {
+        if (a[offset] != b[offset]) {
+            return offset;
+        }
+    }
+
+    return len;
+}
+
+__attribute__((target("avx2")))
+static size_t compare_avx2(const unsigned char *a, const unsigned char *b, size_t len) {
+    size_t offset = 0;
+
+    for (; offset + 128 <= len; offset += 128) {
+        __m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + offset)),
+                                        _mm256_loadu_si256((const __m256i *)(b + offset)));
+        __m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + offset + 32)),
+                                        _mm256_loadu_si256((const __m256i *)(b + offset + 32)));
+        __m256i eq2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + offset + 64)),
+                                        _mm256_loadu_si256((const __m256i *)(b + offset + 64)));
+        __m256i eq3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + offset + 96)),
+                                        _mm256_loadu_si256((const __m256i *)(b + offset + 96)));
+        __m256i all = _mm256_and_si256(_mm256_and_si256(eq0, eq1), _mm256_and_si256(eq2, eq3));
+
+        if ((unsigned)_mm256_movemask_epi8(all) != 0xFFFFFFFFu) {
+            break; /* Locate the byte below */
+        }
+    }
+    for (; offset + 32 <= len; offset += 32) {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + offset)),
+                              _mm256_loadu_si256((const __m256i *)(b + offset))));
+        if (mask != 0xFFFFFFFFu) {
+            return offset + (size_t)__builtin_ctz(~mask);
+        }
+    }
+
+    return offset + compare_sse2(a + offset, b + offset, len - offset);
+}
+#endif
+
+static compare_fn_t compare_kernel = compare_generic;
+static pthread_once_t compare_kernel_once = PTHREAD_ONCE_INIT;
+
+static void select_compare_kernel(void) {
+#ifdef COMPARE_X86
+    __builtin_cpu_init();
+    compare_kernel = __builtin_cpu_supports("avx2") ? compare_avx2 : compare_sse2;
+#endif
+}
+
+/* Compares two buffers with the fastest kernel the CPU supports. Returns the
+ * offset of the first differing byte, or len if the buffers are identical. */
+size_t compare_buffers(const void *a, const void *b, size_t len) {
+    pthread_once(&compare_kernel_once, select_compare_kernel);
+    return compare_kernel(a, b, len);
+}
+
+/* Fills a window from an open file, retrying short and interrupted reads.
+ * Returns the bytes read, fewer than size only at end of file, or -1. */
+static ssize_t read_window(int fd, unsigned char *buffer, size_t size, off_t offset) {
+    size_t filled = 0;
+
+    while (filled < size) {
+        ssize_t bytes = pread(fd, buffer + filled, size - filled, offset + (off_t)filled);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes == 0) {
+            break;
+        }
+        filled += (size_t)bytes;
+    }
+    return (ssize_t)filled;
+}
+
+/* Compares two open files through large pread windows */
+static int compare_fds_pread(int fd1, int fd2, off_t start, off_t *difference) {
+    unsigned char *buffer1 = malloc(COMPARE_WINDOW_SIZE);
+    unsigned char *buffer2 = malloc(COMPARE_WINDOW_SIZE);
+    off_t offset = start;
+    int result = 1;
+
+    if (!buffer1 || !buffer2) {
+        free(buffer1);
+        free(buffer2);
+        return -1;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd1, start, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd2, start, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    for (;;) {
+        ssize_t bytes1 = read_window(fd1, buffer1, COMPARE_WINDOW_SIZE, offset);
+        ssize_t bytes2 = read_window(fd2, buffer2, COMPARE_WINDOW_SIZE, offset);
+        size_t common, same;
+
+        if (bytes1 < 0 || bytes2 < 0) {
+            result = -1;
+            break;
+        }
+        common = (size_t)(bytes1 < bytes2 ? bytes1 : bytes2);
+        same = compare_buffers(buffer1, buffer2, common);
+        if (same < common || bytes1 != bytes2) {
+            if (difference) {
+                *difference = offset + (off_t)same;
+            }
+            result = 0;
+            break;
+        }
+        if (bytes1 == 0) {
+            break;
+        }
+        offset += bytes1;
+    }
+
+    free(buffer1);
+    free(buffer2);
+    return result;
+}
+
+/*
+ * Compares two files through large pread windows, reporting where they
+ * first differ. Returns 1 if identical, 0 if they differ (storing the
+ * offset of the first differing byte in *difference, if not NULL), or -1
+ * on error. A file truncated by another process meanwhile just differs.
+ */
+int compare_files(const char *path1, const char *path2, off_t *difference) {
+    int fd1, fd2;
+    int result;
+
+    fd1 = open(path1, O_RDONLY);
+    if (fd1 < 0) {
+        return -1;
+    }
+    fd2 = open(path2, O_RDONLY);
+    if (fd2 < 0) {
+        close(fd1);
+        return -1;
+    }
+    result = compare_fds(fd1, fd2, difference);
+    close(fd1);
+    close(fd2);
+    return result;
+}
+
+/* As compare_files(), for files already open; the descriptors are left
+ * open and their offsets untouched */
+int compare_fds(int fd1, int fd2, off_t *difference) {
+    return compare_fds_pread(fd1, fd2, 0, difference);
+}
+
+/*
+ * As compare_fds(), but maps both files a window at a time and compares
+ * them in place, avoiding the copy through read buffers; if mapping fails,
+ * pread windows are used instead. As with any mmap reader, a file
+ * truncated by another process during the comparison raises SIGBUS, which
+ * ends the run, so this is only used when asked for with --mmap-compare.
+ */
+int compare_fds_mapped(int fd1, int fd2, off_t *difference) {
+    struct stat st1, st2;
+    off_t offset = 0;
+    int result = 1;
+
+    if (fstat(fd1, &st1) != 0 || fstat(fd2, &st2) != 0) {
+        return -1;
+    }
+
+    /* Different sizes, or files that cannot be mapped (pipes, devices),
+     * are handled by the read path, which also finds the first difference */
+    if (st1.st_size != st2.st_size || !S_ISREG(st1.st_mode) || !S_ISREG(st2.st_mode)) {
+        return compare_fds_pread(fd1, fd2, 0, difference);
+    }
+
+    while (offset < st1.st_size) {
+        size_t length = st1.st_size - offset < COMPARE_MAP_SIZE ? (size_t)(st1.st_size - offset) : COMPARE_MAP_SIZE;
+        void *map1 = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd1, offset);
+        void *map2 = map1 == MAP_FAILED ? MAP_FAILED : mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd2, offset);
+        size_t same;
+
+        if (map2 == MAP_FAILED) {
+            if (map1 != MAP_FAILED) {
+                munmap(map1, length);
+            }
+            result = compare_fds_pread(fd1, fd2, offset, difference);
+            break;
+        }
+
+        posix_madvise(map1, length, POSIX_MADV_SEQUENTIAL);
+        posix_madvise(map2, length, POSIX_MADV_SEQUENTIAL);
+        same = compare_buffers(map1, map2, length);
+        munmap(map1, length);
+        munmap(map2, length);
+
+        if (same < length) {
+            if (difference) {
+                *difference = offset + (off_t)same;
+            }
+            result = 0;
+            break;
+        }
+        offset += (off_t)length;
+    }
+
+    return result;
+}
+
+/* Prepares an empty stage for a source of up to capacity bytes; its buffer
+ * is only allocated once something is read */
+void source_stage_init(source_stage_t *stage, size_t capacity) {
+    stage->data = NULL;
+    stage->length = 0;
+    stage->capacity = capacity;
+}
+
+/* Keeps bytes read from the source at offset when they carry the staged
+ * prefix on. Bytes beyond a gap, or past the capacity, are not kept; if
+ * the buffer cannot be allocated the stage stays empty. */
+void source_stage_add(source_stage_t *stage, const void *data, size_t length, off_t offset) {
+    size_t skip;
+
+    if (!stage || stage->length == stage->capacity ||
+        offset > (off_t)stage->length || offset + (off_t)length <= (off_t)stage->length) {
+        return;
+    }
+    if (!stage->data) {
+        stage->data = malloc(stage->capacity);
+        if (!stage->data) {
+            return;
+        }
+    }
+    skip = stage->length - (size_t)offset;
+    if (length - skip > stage->capacity - stage->length) {
+        length = stage->capacity - stage->length + skip;
+    }
+    memcpy(stage->data + stage->length, (const unsigned char *)data + skip, length - skip);
+    stage->length += length - skip;
+}
+
+/* Reads up to length bytes of the source at offset: from the stage as far
+ * as it reaches, and from fd beyond it, staging what fd returns. Returns
+ * the number of bytes read, 0 at EOF, or -1 on error. */
+ssize_t source_stage_read(source_stage_t *stage, int fd, void *buffer, size_t length, off_t offset) {
+    size_t staged = 0;
+    ssize_t bytes;
+
+    if (stage && offset < (off_t)stage->length) {
+        staged = stage->length - (size_t)offset;
+        if (staged > length) {
+            staged = length;
+        }
+        memcpy(buffer, stage->data + offset, staged);
+        if (staged == length) {
+            return (ssize_t)staged;
+        }
+    }
+    bytes = pread(fd, (unsigned char *)buffer + staged, length - staged, offset + (off_t)staged);
+    if (bytes < 0) {
+        return staged > 0 ? (ssize_t)staged : -1;
+    }
+    source_stage_add(stage, (unsigned char *)buffer + staged, (size_t)bytes, offset + (off_t)staged);
+    return (ssize_t)(staged + (size_t)bytes);
+}
+
+void source_stage_free(source_stage_t *stage) {
+    free(stage->data);
+    stage->data = NULL;
+    stage->length = 0;
+    stage->capacity = 0;
+}
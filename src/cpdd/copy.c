@@ -22,14 +22,38 @@
    * THE SOFTWARE.
    */
 
+/* The dirent d_type constants and copy_file_range are extensions beyond POSIX */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#elif defined(__APPLE__)
+#define _DARWIN_C_SOURCE
+#endif
+
 #include "cpdd.h"
+#include <pthread.h>
+#include <sys/resource.h>
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
 
-// Path of the file currently being copied (for cleanup on signal)
-static char *current_incomplete_file = NULL;
+/* Files currently being copied, one entry per copying thread, so that an
+ * interrupted run does not leave partial files behind */
+typedef struct incomplete_file {
+    pthread_t owner;
+    char *path;
+    struct incomplete_file *next;
+} incomplete_file_t;
 
-// Signal handler to clean up incomplete file on termination
+static incomplete_file_t *incomplete_files = NULL;
+static pthread_mutex_t incomplete_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Signal handler to clean up incomplete files on termination
 static void signal_handler(int sig) {
-    cleanup_incomplete_file();
+    cleanup_incomplete_files();
     exit(128 + sig);
 }
 
@@ -42,37 +66,78 @@ void setup_signal_handlers(void) {
     signal(SIGPIPE, signal_handler);
 }
 
-// Registers the path of the file currently being copied
+// Finds the calling thread's entry; the caller holds incomplete_lock
+static incomplete_file_t *own_incomplete_file(void) {
+    for (incomplete_file_t *f = incomplete_files; f; f = f->next) {
+        if (pthread_equal(f->owner, pthread_self())) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// Registers the path of the file the calling thread is copying
 void register_incomplete_file(const char *path) {
-    if (current_incomplete_file) {
-        free(current_incomplete_file);
+    pthread_mutex_lock(&incomplete_lock);
+    incomplete_file_t *f = own_incomplete_file();
+    if (!f) {
+        f = calloc(1, sizeof(incomplete_file_t));
+        if (f) {
+            f->owner = pthread_self();
+            f->next = incomplete_files;
+            incomplete_files = f;
+        }
+    }
+    if (f) {
+        free(f->path);
+        f->path = strdup(path);
     }
-    current_incomplete_file = strdup(path);
+    pthread_mutex_unlock(&incomplete_lock);
 }
 
-// Unregisters the current incomplete file without deleting it
+// Unregisters the calling thread's incomplete file without deleting it
 void unregister_incomplete_file(void) {
-    if (current_incomplete_file) {
-        free(current_incomplete_file);
-        current_incomplete_file = NULL;
+    pthread_mutex_lock(&incomplete_lock);
+    incomplete_file_t *f = own_incomplete_file();
+    if (f) {
+        free(f->path);
+        f->path = NULL;
     }
+    pthread_mutex_unlock(&incomplete_lock);
 }
 
-// Cleans up the incomplete file if it exists
+// Removes the calling thread's incomplete file if it exists
 void cleanup_incomplete_file(void) {
-    if (current_incomplete_file) {
-        unlink(current_incomplete_file);
-        unregister_incomplete_file();
+    pthread_mutex_lock(&incomplete_lock);
+    incomplete_file_t *f = own_incomplete_file();
+    if (f && f->path) {
+        unlink(f->path);
+        free(f->path);
+        f->path = NULL;
+    }
+    pthread_mutex_unlock(&incomplete_lock);
+}
+
+// Removes every thread's incomplete file; used when the process is killed
+void cleanup_incomplete_files(void) {
+    for (incomplete_file_t *f = incomplete_files; f; f = f->next) {
+        if (f->path) {
+            unlink(f->path);
+        }
     }
 }
 
 /* Determines whether a destination file should be overwritten,
  * by firstly determining if the destination exists, whether the
  * user has specified --no-clobber, and optionally interactively
- * asking */
+ * asking. Without either option nothing needs checking. */
 int should_overwrite(const char *dest_path, const options_t *opts) {
     struct stat st;
     
+    if (!opts->no_clobber && !opts->interactive) {
+        return 1;
+    }
+    
     if (stat(dest_path, &st) != 0) {
         return 1;
     }
@@ -95,31 +160,32 @@ int should_overwrite(const char *dest_path, const options_t *opts) {
     return 1;
 }
 
-/* Given a source and destination, propagates attributes between them */
-int preserve_file_attributes(const char *src, const char *dest, const preserve_t *preserve) {
-    struct stat src_st;
-    struct utimbuf times;
-    
-    if (stat(src, &src_st) != 0) {
-        return -1;
-    }
-    
-    if (preserve->mode) {
-        if (chmod(dest, src_st.st_mode) != 0) {
+/* Applies the attributes of a source, as described by src_st, to dest_fd,
+ * or to the file at dest if dest_fd is -1. Ownership is changed before
+ * the mode, which a change of owner may strip of its set-ID bits, and
+ * timestamps keep their nanoseconds. */
+int apply_file_attributes(int dest_fd, const char *dest, const struct stat *src_st,
+                          const preserve_t *preserve) {
+    if (preserve->ownership) {
+        if ((dest_fd >= 0 ? fchown(dest_fd, src_st->st_uid, src_st->st_gid)
+                          : chown(dest, src_st->st_uid, src_st->st_gid)) != 0) {
             return -1;
         }
     }
     
-    if (preserve->ownership) {
-        if (chown(dest, src_st.st_uid, src_st.st_gid) != 0) {
+    if (preserve->mode) {
+        if ((dest_fd >= 0 ? fchmod(dest_fd, src_st->st_mode & 07777)
+                          : chmod(dest, src_st->st_mode & 07777)) != 0) {
             return -1;
         }
     }
     
     if (preserve->timestamps) {
-        times.actime = src_st.st_atime;
-        times.modtime = src_st.st_mtime;
-        if (utime(dest, &times) != 0) {
+        struct timespec times[2];
+        times[0] = STAT_ATIME(src_st);
+        times[1] = STAT_MTIME(src_st);
+        if ((dest_fd >= 0 ? futimens(dest_fd, times)
+                          : utimensat(AT_FDCWD, dest, times, 0)) != 0) {
             return -1;
         }
     }
@@ -127,6 +193,16 @@ int preserve_file_attributes(const char *src, const char *dest, const preserve_t
     return 0;
 }
 
+/* Given a source and destination, propagates attributes between them */
+int preserve_file_attributes(const char *src, const char *dest, const preserve_t *preserve) {
+    struct stat src_st;
+    
+    if (stat(src, &src_st) != 0) {
+        return -1;
+    }
+    return apply_file_attributes(-1, dest, &src_st, preserve);
+}
+
 /* Formats byte counts with human-readable quantities */
 void format_bytes(off_t bytes, int human_readable, char *buffer, size_t buffer_size) {
     if (!human_readable) {
@@ -157,58 +233,52 @@ void format_bytes(off_t bytes, int human_readable, char *buffer, size_t buffer_s
 /* String formats statistics from a copy operation. */
 void format_stats_line(const stats_t *stats, int human_readable, char *buffer, size_t buffer_size) {
     char total_bytes_str[32];
-    off_t total_bytes = stats->bytes_copied + stats->bytes_hard_linked + stats->bytes_soft_linked;
-    int total_files = stats->files_copied + stats->files_hard_linked + stats->files_soft_linked;
+    off_t total_bytes = stats->bytes_copied + stats->bytes_hard_linked + stats->bytes_soft_linked +
+                        stats->bytes_reflinked;
+    int total_files = stats->files_copied + stats->files_hard_linked + stats->files_soft_linked +
+                      stats->files_reflinked;
     
     format_bytes(total_bytes, human_readable, total_bytes_str, sizeof(total_bytes_str));
     
     snprintf(buffer, buffer_size, "Files: %d copied, %d linked, %d skipped | Total: %d files (%s)", 
-             stats->files_copied, stats->files_hard_linked + stats->files_soft_linked, 
+             stats->files_copied,
+             stats->files_hard_linked + stats->files_soft_linked + stats->files_reflinked,
              stats->files_skipped, total_files, total_bytes_str);
 }
 
 
 /* Prints final statistics */
 void print_statistics(const stats_t *stats, int human_readable) {
-    char copied_bytes[32], linked_bytes[32], soft_linked_bytes[32];
+    char copied_bytes[32], linked_bytes[32], soft_linked_bytes[32], reflinked_bytes[32];
     
     format_bytes(stats->bytes_copied, human_readable, copied_bytes, sizeof(copied_bytes));
     format_bytes(stats->bytes_hard_linked, human_readable, linked_bytes, sizeof(linked_bytes));
     format_bytes(stats->bytes_soft_linked, human_readable, soft_linked_bytes, sizeof(soft_linked_bytes));
+    format_bytes(stats->bytes_reflinked, human_readable, reflinked_bytes, sizeof(reflinked_bytes));
     
     printf("\nStatistics:\n");
     printf("  Files copied:     %d (%s)\n", stats->files_copied, copied_bytes);
     printf("  Files hard linked: %d (%s)\n", stats->files_hard_linked, linked_bytes);
     printf("  Files soft linked: %d (%s)\n", stats->files_soft_linked, soft_linked_bytes);
+    printf("  Files reflinked:  %d (%s)\n", stats->files_reflinked, reflinked_bytes);
     printf("  Files skipped:    %d\n", stats->files_skipped);
     
-    off_t total_bytes = stats->bytes_copied + stats->bytes_hard_linked + stats->bytes_soft_linked;
-    int total_files = stats->files_copied + stats->files_hard_linked + stats->files_soft_linked;
+    off_t total_bytes = stats->bytes_copied + stats->bytes_hard_linked + stats->bytes_soft_linked +
+                        stats->bytes_reflinked;
+    int total_files = stats->files_copied + stats->files_hard_linked + stats->files_soft_linked +
+                      stats->files_reflinked;
     char total_bytes_str[32];
     format_bytes(total_bytes, human_readable, total_bytes_str, sizeof(total_bytes_str));
     
     printf("  Total files:      %d (%s)\n", total_files, total_bytes_str);
 }
 
-/* Ensures that the directory structure for dest_path exists,
- * creating directories as needed, using the permissions of
- * the source path or its parent directory */
-int create_directory_structure(const char *src_path, const char *dest_path) {
-    struct stat st;
+/* Ensures that the directory dest_path is to be created in exists, with
+ * the permissions of the directory holding src_path */
+static int create_parent_directory(const char *src_path, const char *dest_path) {
     char dest_dir[MAX_PATH];
     char *last_slash;
     
-    if (stat(src_path, &st) != 0) {
-        return -1;
-    }
-    
-    if (S_ISDIR(st.st_mode)) {
-        if (mkdir(dest_path, st.st_mode) != 0 && errno != EEXIST) {
-            return -1;
-        }
-        return 0;
-    }
-    
     strncpy(dest_dir, dest_path, sizeof(dest_dir) - 1);
     dest_dir[sizeof(dest_dir) - 1] = '\0';
     
@@ -238,212 +308,1254 @@ int create_directory_structure(const char *src_path, const char *dest_path) {
     return 0;
 }
 
-// Copies a file from src to dest, optionally creating a hard or soft link
-int copy_or_link_file(const char *src, const char *dest, const char *ref, const options_t *opts, stats_t *stats) {
-    struct stat src_st;
-    int src_fd, dest_fd;
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read, bytes_written;
-    
-    if (stat(src, &src_st) != 0) {
+/* Copies the remaining data between two file descriptors with a large
+ * user-space buffer, feeding it to hash as well when that is not NULL.
+ * Returns 0 on success, -1 on error. */
+static int copy_fd_buffered(int src_fd, int dest_fd, hash_ctx_t *hash) {
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    ssize_t bytes_read;
+    int result = 0;
+
+    if (!buffer) {
+        return -1;
+    }
+    while ((bytes_read = read(src_fd, buffer, COPY_BUFFER_SIZE)) > 0) {
+        char *p = buffer;
+        if (hash) {
+            hash_update(hash, buffer, (size_t)bytes_read);
+        }
+        while (bytes_read > 0) {
+            ssize_t bytes_written = write(dest_fd, p, bytes_read);
+            if (bytes_written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_written <= 0) {
+                free(buffer);
+                return -1;
+            }
+            p += bytes_written;
+            bytes_read -= bytes_written;
+        }
+    }
+    if (bytes_read < 0) {
+        result = -1;
+    }
+    free(buffer);
+    return result;
+}
+
+/* Copies file data from src_fd to dest_fd, both at their current offsets.
+ * On Linux the kernel moves the data itself: copy_file_range() avoids any
+ * copy through user space and lets filesystems share extents or copy
+ * server-side, and sendfile() covers kernels and filesystem pairs that
+ * copy_file_range() does not. Anything else uses a large buffer. Both
+ * calls advance the file offsets, so a fallback part way through simply
+ * carries on from where the previous method stopped. Pseudo-files that
+ * report nothing to the kernel copy calls are read with the buffer. */
+static int copy_fd_data(int src_fd, int dest_fd) {
+#if defined(__linux__)
+    off_t total = 0;
+#ifdef __NR_copy_file_range
+    for (;;) {
+        ssize_t copied = syscall(__NR_copy_file_range, src_fd, NULL, dest_fd, NULL, COPY_CHUNK_SIZE, 0);
+        if (copied == 0 && total > 0) {
+            return 0;
+        }
+        if (copied == 0) {
+            break;
+        }
+        if (copied < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP &&
+                errno != EBADF && errno != EPERM) {
+                return -1;
+            }
+            break; /* Not supported here: try sendfile */
+        }
+        total += copied;
+    }
+#endif
+    for (;;) {
+        ssize_t copied = sendfile(dest_fd, src_fd, NULL, COPY_CHUNK_SIZE);
+        if (copied == 0 && total > 0) {
+            return 0;
+        }
+        if (copied == 0) {
+            break;
+        }
+        if (copied < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != ENOSYS && errno != EINVAL) {
+                return -1;
+            }
+            break; /* Not supported here: use a buffer */
+        }
+        total += copied;
+    }
+#endif
+    return copy_fd_buffered(src_fd, dest_fd, NULL);
+}
+
+/* Makes dest (relative to dir_fd) a copy-on-write clone of ref, so that
+ * both share the same extents until one of them is written. Fails with
+ * EOPNOTSUPP (or EXDEV, EINVAL, ...) where the filesystem cannot clone,
+ * leaving no dest behind. */
+static int clone_file(const char *ref, int dir_fd, const char *dest, mode_t mode) {
+#if defined(__linux__) && defined(FICLONE)
+    int ref_fd, dest_fd;
+    int result;
+    int saved_errno;
+
+    ref_fd = open(ref, O_RDONLY);
+    if (ref_fd < 0) {
         return -1;
     }
+    dest_fd = openat(dir_fd, dest, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (dest_fd < 0) {
+        saved_errno = errno;
+        close(ref_fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    result = ioctl(dest_fd, FICLONE, ref_fd);
+    saved_errno = errno;
+    close(ref_fd);
+    if (close(dest_fd) != 0 && result == 0) {
+        saved_errno = errno;
+        result = -1;
+    }
+    if (result != 0) {
+        unlinkat(dir_fd, dest, 0);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+#else
+    (void)ref;
+    (void)dir_fd;
+    (void)dest;
+    (void)mode;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+/* Describes how a matched file was linked, for verbose output */
+static const char *link_type_name(link_type_t link_type) {
+    switch (link_type) {
+        case LINK_HARD:    return "hard link";
+        case LINK_SOFT:    return "soft link";
+        case LINK_REFLINK: return "reflink";
+        default:           return "copy";
+    }
+}
+
+/* Writes out the part of the source staged while it was matched, leaving
+ * dest_fd after it. Returns 0 on success, -1 on error. */
+static int write_stage(int dest_fd, const source_stage_t *stage, hash_ctx_t *hash) {
+    const unsigned char *p = stage->data;
+    size_t remaining = stage->length;
+
+    if (hash) {
+        hash_update(hash, stage->data, stage->length);
+    }
+    while (remaining > 0) {
+        ssize_t bytes_written = write(dest_fd, p, remaining);
+        if (bytes_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_written <= 0) {
+            return -1;
+        }
+        p += bytes_written;
+        remaining -= (size_t)bytes_written;
+    }
+    return 0;
+}
+
+/* Copies a file from src to dest, optionally creating a hard or soft link or
+ * a clone. If hash is not NULL, a file that ends up copied is hashed as it
+ * is copied, which needs the data in user space and so bypasses the kernel
+ * and io_uring copy paths. If stage is not NULL, the bytes it holds were
+ * read while matching and are written from it; only the rest of the source
+ * is read. The source may be passed open as src_fd, with its metadata in
+ * src_st, so that it is neither opened nor stat'ed again; with -1 and NULL
+ * it is opened and stat'ed here. A passed descriptor is left open. With
+ * dest_dir_fd open on the directory dest is in, dest is written by its
+ * last component relative to it; with AT_FDCWD, by its full path. */
+int copy_or_link_file(const char *src, int src_fd, const struct stat *src_st, int dest_dir_fd,
+                      const char *dest, const char *ref, const options_t *opts, stats_t *stats,
+                      hash_ctx_t *hash, const source_stage_t *stage) {
+    const char *dest_name = dest;
+    struct stat own_st;
+    int own_fd = src_fd < 0;
+    int dest_fd;
+    int result;
+    
+    if (dest_dir_fd != AT_FDCWD && strrchr(dest, '/')) {
+        dest_name = strrchr(dest, '/') + 1;
+    }
     
+    if (!src_st) {
+        if ((src_fd >= 0 ? fstat(src_fd, &own_st) : stat(src, &own_st)) != 0) {
+            return -1;
+        }
+        src_st = &own_st;
+    }
+    
+    /* A reference that has gone away makes the link fail, and the file
+     * is then copied */
     if (ref && opts->link_type != LINK_NONE) {
-        struct stat ref_st;
         /* Remove destination file if it exists, since we've already decided to overwrite */
-        unlink(dest);
-        
-        /* Get the size of the reference file - use stat() to follow symlinks */
-        if (stat(ref, &ref_st) != 0) {
-            /* If we can't stat the reference file, fall through to regular copy */
-            if (opts->verbose) {
-                printf("Warning: Could not stat reference file %s\n", ref);
+        unlinkat(dest_dir_fd, dest_name, 0);
+        if (opts->link_type == LINK_HARD) {
+            if (linkat(AT_FDCWD, ref, dest_dir_fd, dest_name, 0) == 0) {
+                stats->files_hard_linked++;
+                stats->bytes_hard_linked += src_st->st_size;
+                return 0;
+            } else {
+                if (opts->verbose) {
+                    printf("Failed to create hard link for %s -> %s: %s\n", ref, dest, strerror(errno));
+                }
             }
-        } else {
-
-            if (opts->link_type == LINK_HARD) {
-                if (link(ref, dest) == 0) {
-                    stats->files_hard_linked++;
-                    stats->bytes_hard_linked += src_st.st_size;
-                    return 0;
-                } else {
-                    if (opts->verbose) {
-                        printf("Failed to create hard link for %s -> %s: %s\n", ref, dest, strerror(errno));
-                    }
+        } else if (opts->link_type == LINK_SOFT) {
+            if (symlinkat(ref, dest_dir_fd, dest_name) == 0) {
+                stats->files_soft_linked++;
+                stats->bytes_soft_linked += src_st->st_size;
+                return 0;
+            } else {
+                if (opts->verbose) {
+                    printf("Failed to create soft link for %s -> %s: %s\n", ref, dest, strerror(errno));
                 }
-            } else if (opts->link_type == LINK_SOFT) {
-                if (symlink(ref, dest) == 0) {
-                    stats->files_soft_linked++;
-                    stats->bytes_soft_linked += src_st.st_size;
-                    return 0;
-                } else {
-                    if (opts->verbose) {
-                        printf("Failed to create soft link for %s -> %s: %s\n", ref, dest, strerror(errno));
+            }
+        } else if (opts->link_type == LINK_REFLINK) {
+            if (clone_file(ref, dest_dir_fd, dest_name, src_st->st_mode) == 0) {
+                if (opts->preserve.mode || opts->preserve.ownership || opts->preserve.timestamps) {
+                    if (apply_file_attributes(-1, dest, src_st, &opts->preserve) != 0) {
+                        if (opts->verbose) {
+                            fprintf(stderr, "Warning: Failed to preserve attributes for %s\n", dest);
+                        }
                     }
                 }
+                stats->files_reflinked++;
+                stats->bytes_reflinked += src_st->st_size;
+                return 0;
+            } else {
+                /* Not supported by this filesystem or across devices: copy instead */
+                if (opts->verbose) {
+                    printf("Failed to create reflink for %s -> %s: %s\n", ref, dest, strerror(errno));
+                }
             }
         }
     }
     
-    // Open source file for reading
-    src_fd = open(src, O_RDONLY);
-    if (src_fd < 0) {
-        return -1;
+    // Open source file for reading, unless the caller has
+    if (own_fd) {
+        src_fd = open(src, O_RDONLY);
+        if (src_fd < 0) {
+            return -1;
+        }
     }
 
     // Open destination file for writing (create/truncate)
-    dest_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, src_st.st_mode);
+    dest_fd = openat(dest_dir_fd, dest_name, O_WRONLY | O_CREAT | O_TRUNC, src_st->st_mode);
     if (dest_fd < 0) {
-        close(src_fd);
+        if (own_fd) {
+            close(src_fd);
+        }
         return -1;
     }
     
     // Register the incomplete file for cleanup on signals
     register_incomplete_file(dest);
     
-    // Perform the copy
-    while ((bytes_read = read(src_fd, buffer, BUFFER_SIZE)) > 0) {
-        bytes_written = write(dest_fd, buffer, bytes_read);
-        if (bytes_written != bytes_read) {
+    // Write what matching already read, then copy the rest from there on
+    off_t staged = stage ? (off_t)stage->length : 0;
+    if (staged > 0 && (write_stage(dest_fd, stage, hash) != 0 ||
+                       lseek(src_fd, staged, SEEK_SET) != staged)) {
+        if (own_fd) {
             close(src_fd);
-            close(dest_fd);
-            cleanup_incomplete_file();
-            return -1;
         }
+        close(dest_fd);
+        cleanup_incomplete_file();
+        return -1;
     }
     
-    close(src_fd);
-    close(dest_fd);
+    // Perform the copy, through io_uring when enabled and available
+    io_ring_t *ring = hash || staged > 0 ? NULL : io_ring_thread(opts);
+    if (staged >= src_st->st_size) {
+        result = 0;
+    } else if (hash) {
+        result = copy_fd_buffered(src_fd, dest_fd, hash);
+    } else if (ring) {
+        result = io_ring_copy(ring, src_fd, dest_fd, src_st->st_size);
+    } else {
+        result = copy_fd_data(src_fd, dest_fd);
+    }
     
-    if (bytes_read < 0) {
-        cleanup_incomplete_file();
-        return -1;
+    if (own_fd) {
+        close(src_fd);
     }
     
-    if (opts->preserve.mode || opts->preserve.ownership || opts->preserve.timestamps) {
-        if (preserve_file_attributes(src, dest, &opts->preserve) != 0) {
+    // Attributes go on through the open descriptor, timestamps last
+    if (result == 0 && (opts->preserve.mode || opts->preserve.ownership || opts->preserve.timestamps)) {
+        if (apply_file_attributes(dest_fd, dest, src_st, &opts->preserve) != 0) {
             if (opts->verbose) {
                 fprintf(stderr, "Warning: Failed to preserve attributes for %s\n", dest);
             }
         }
     }
     
+    if (close(dest_fd) != 0) {
+        result = -1;
+    }
+    
+    if (result < 0) {
+        cleanup_incomplete_file();
+        return -1;
+    }
+    
     stats->files_copied++;
-    stats->bytes_copied += src_st.st_size;
+    stats->bytes_copied += src_st->st_size;
     
     unregister_incomplete_file();
     
     return 0;
 }
 
-static int copy_directory_recursive(const char *src_path, const char *dest_path, 
-                                   sorted_file_info_t *ref_files, const options_t *opts, stats_t *stats) {
-    DIR *src_dir;
-    struct dirent *entry;
+/* An open directory, shared by the walker listing it, or its source
+ * counterpart, and the files and subdirectories queued for it; the last
+ * of them to let go closes it */
+typedef struct {
+    int fd;
+    int refs;
+} dir_handle_t;
+
+/* A regular file on its way through the match and copy stages */
+typedef struct copy_job {
+    char *src;
+    char *dest;
+    dir_handle_t *dest_dir;     /* Open directory dest is in, or NULL to go by path */
+    int top_level;              /* Named on the command line, not found in a directory */
+    reference_t match;          /* Reference with identical content, if match.path is set */
+    size_t live_seen;           /* Copies in the index when the file was matched */
+    source_stage_t stage;       /* Source data read while matching (capacity 0 if none) */
+    int src_fd;                 /* Source opened by the match stage, or -1 */
+    struct stat st;             /* Source metadata, if have_stat is set */
+    int have_stat;
+    char *link_to;              /* Earlier copy of the same source inode to hard link */
+    struct source_inode *claim; /* Inode this is the first path of, still being written */
+    struct copy_job *next;      /* Next path waiting on the same inode */
+} copy_job_t;
+
+/* A source inode with several links, as first copied or linked in the run.
+ * While its first path is in flight the entry is pending, and the inode's
+ * other paths wait on it instead of being matched and copied themselves. */
+typedef struct source_inode {
+    dev_t dev;
+    ino_t ino;
+    char *dest;                 /* Destination it was, or is being, written to */
+    reference_t match;          /* Reference it was linked to, if match.path is set */
+    int pending;                /* The first path has not finished yet */
+    copy_job_t *waiters;        /* Later paths held back until it does */
+    struct source_inode *next;
+} source_inode_t;
+
+/* Outcomes of claim_source_inode */
+enum {
+    SOURCE_INODE_NEW,           /* First path seen: match and copy it */
+    SOURCE_INODE_SEEN,          /* Follows the recorded outcome of an earlier path */
+    SOURCE_INODE_WAITING        /* Held by the entry until the first path is done */
+};
+
+/* A destination directory waiting for its attributes */
+typedef struct {
+    char *src;
+    char *dest;
+} dir_job_t;
+
+/* State shared by the traversal and the match and copy stages of a run */
+typedef struct {
+    sorted_file_info_t *ref_files;
+    const options_t *opts;
+    stats_t *stats;
+    pthread_mutex_t lock;       /* Protects stats, failed, dirs and terminal output */
+    int failed;                 /* A source could not be fully copied */
+    pipeline_t *pipeline;       /* NULL when files are processed one at a time */
+    dir_job_t *dirs;            /* Directories whose attributes are applied last */
+    int dir_count;
+    int dir_capacity;
+    source_inode_t **inodes;    /* Hard-linked sources seen so far, by inode */
+    size_t inode_buckets;
+    size_t inode_count;
+    size_t staged;              /* Stage capacity held by files in flight */
+} copy_run_t;
+
+/* Wraps an open directory descriptor in a handle held once, or returns
+ * NULL (leaving fd open) if memory runs out */
+static dir_handle_t *new_dir_handle(int fd) {
+    dir_handle_t *dir = malloc(sizeof(dir_handle_t));
+
+    if (dir) {
+        dir->fd = fd;
+        dir->refs = 1;
+    }
+    return dir;
+}
+
+static dir_handle_t *hold_dir_handle(dir_handle_t *dir) {
+    if (dir) {
+        __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+    }
+    return dir;
+}
+
+static void release_dir_handle(dir_handle_t *dir) {
+    if (dir && __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(dir->fd);
+        free(dir);
+    }
+}
+
+static void free_copy_job(copy_job_t *job) {
+    if (job) {
+        if (job->src_fd >= 0) {
+            close(job->src_fd);
+        }
+        release_dir_handle(job->dest_dir);
+        free(job->src);
+        free(job->dest);
+        free(job->match.path);
+        free(job->link_to);
+        free(job);
+    }
+}
+
+/* Bucket of the source inode table; buckets is a power of two */
+static size_t inode_bucket(dev_t dev, ino_t ino, size_t buckets) {
+    uint64_t h = ((uint64_t)ino ^ ((uint64_t)dev << 32)) * UINT64_C(0x9E3779B97F4A7C15);
+    return (size_t)(h ^ (h >> 29)) & (buckets - 1);
+}
+
+static void free_source_inode(source_inode_t *entry) {
+    free(entry->dest);
+    free(entry->match.path);
+    free(entry);
+}
+
+/* Finds the entry for a source inode; the caller holds run->lock */
+static source_inode_t **find_source_inode(copy_run_t *run, dev_t dev, ino_t ino) {
+    source_inode_t **link;
+
+    if (!run->inode_buckets) {
+        return NULL;
+    }
+    link = &run->inodes[inode_bucket(dev, ino, run->inode_buckets)];
+    while (*link && ((*link)->dev != dev || (*link)->ino != ino)) {
+        link = &(*link)->next;
+    }
+    return *link ? link : NULL;
+}
+
+/* Adds an entry to the source inode table, growing it as needed; the
+ * caller holds run->lock. Returns 0, or -1 if the table cannot be made. */
+static int insert_source_inode(copy_run_t *run, source_inode_t *entry) {
+    size_t bucket;
+
+    if (run->inode_count >= run->inode_buckets) {
+        size_t new_buckets = run->inode_buckets ? run->inode_buckets * 2 : 1024;
+        source_inode_t **new_inodes = calloc(new_buckets, sizeof(source_inode_t *));
+        if (new_inodes) {
+            for (size_t i = 0; i < run->inode_buckets; i++) {
+                source_inode_t *e = run->inodes[i];
+                while (e) {
+                    source_inode_t *next = e->next;
+                    size_t b = inode_bucket(e->dev, e->ino, new_buckets);
+                    e->next = new_inodes[b];
+                    new_inodes[b] = e;
+                    e = next;
+                }
+            }
+            free(run->inodes);
+            run->inodes = new_inodes;
+            run->inode_buckets = new_buckets;
+        }
+    }
+    if (!run->inode_buckets) {
+        return -1;
+    }
+    bucket = inode_bucket(entry->dev, entry->ino, run->inode_buckets);
+    entry->next = run->inodes[bucket];
+    run->inodes[bucket] = entry;
+    run->inode_count++;
+    return 0;
+}
+
+/* Reuses the outcome of an inode's first path for a later one: with
+ * --preserve=links the job is hard linked to that path's destination,
+ * otherwise it takes the same reference without being matched again.
+ * Returns 0, or -1 if memory ran out and the job must go its own way. */
+static int follow_source_inode(const source_inode_t *entry, const options_t *opts, copy_job_t *job) {
+    if (opts->preserve.links) {
+        job->link_to = strdup(entry->dest);
+        return job->link_to ? 0 : -1;
+    }
+    if (entry->match.path) {
+        job->match.path = strdup(entry->match.path);
+        job->match.row = entry->match.row;
+        return job->match.path ? 0 : -1;
+    }
+    return 0;
+}
+
+/*
+ * Looks up the job's source inode before it is matched. The first path of
+ * an inode claims it with a pending entry; paths arriving while that one
+ * is in flight are handed to the entry, to be released when it is written,
+ * and paths arriving after follow its outcome at once. Allocation failures
+ * only lose the memo: the job is then matched and copied on its own.
+ */
+static int claim_source_inode(copy_run_t *run, copy_job_t *job) {
+    source_inode_t *entry = calloc(1, sizeof(source_inode_t));
+    source_inode_t **found;
+    int outcome = SOURCE_INODE_NEW;
+
+    if (entry) {
+        entry->dev = job->st.st_dev;
+        entry->ino = job->st.st_ino;
+        entry->dest = strdup(job->dest);
+        entry->pending = 1;
+    }
+
+    pthread_mutex_lock(&run->lock);
+    found = find_source_inode(run, job->st.st_dev, job->st.st_ino);
+    if (found && (*found)->pending) {
+        job->next = (*found)->waiters;
+        (*found)->waiters = job;
+        outcome = SOURCE_INODE_WAITING;
+    } else if (found) {
+        outcome = follow_source_inode(*found, run->opts, job) == 0 ? SOURCE_INODE_SEEN : SOURCE_INODE_NEW;
+    } else if (entry && entry->dest && insert_source_inode(run, entry) == 0) {
+        job->claim = entry;
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&run->lock);
+
+    if (entry) {
+        free_source_inode(entry);
+    }
+    return outcome;
+}
+
+/*
+ * Records how the first path of a claimed inode went and returns the paths
+ * that waited on it, now ready for the copy stage. Once it is written they
+ * follow it. Should it fail, the next waiting path takes over the claim and
+ * must be matched afresh, or, with none waiting, the entry is dropped so
+ * that later paths start over.
+ */
+static copy_job_t *settle_source_inode(copy_run_t *run, copy_job_t *job, int written) {
+    source_inode_t *entry = job->claim;
+    char *match_path = written && job->match.path ? strdup(job->match.path) : NULL;
+    copy_job_t *ready;
+
+    job->claim = NULL;
+    pthread_mutex_lock(&run->lock);
+    ready = entry->waiters;
+    if (written) {
+        entry->pending = 0;
+        entry->match.path = match_path;
+        entry->match.row = job->match.row;
+        entry->waiters = NULL;
+        for (copy_job_t *w = ready; w; w = w->next) {
+            follow_source_inode(entry, run->opts, w);
+        }
+    } else if (ready) {
+        char *dest = strdup(ready->dest);
+        if (dest) {
+            free(entry->dest);
+            entry->dest = dest;
+        }
+        entry->waiters = ready->next;
+        ready->next = NULL;
+        ready->claim = entry;
+    } else {
+        source_inode_t **found = find_source_inode(run, entry->dev, entry->ino);
+        *found = entry->next;
+        run->inode_count--;
+        free_source_inode(entry);
+    }
+    pthread_mutex_unlock(&run->lock);
+
+    return ready;
+}
+
+static void free_source_inodes(copy_run_t *run) {
+    for (size_t i = 0; i < run->inode_buckets; i++) {
+        source_inode_t *entry = run->inodes[i];
+        while (entry) {
+            source_inode_t *next = entry->next;
+            free_source_inode(entry);
+            entry = next;
+        }
+    }
+    free(run->inodes);
+}
+
+/* Gives a source that may be read while matching a stage to keep what is
+ * read, if it is small enough and the run's budget allows */
+static void reserve_source_stage(copy_run_t *run, copy_job_t *job) {
+    size_t size = (size_t)job->st.st_size;
+
+    if (job->st.st_size <= 0 || job->st.st_size > SOURCE_STAGE_MAX) {
+        return;
+    }
+    pthread_mutex_lock(&run->lock);
+    if (run->staged + size <= SOURCE_STAGE_BUDGET) {
+        run->staged += size;
+        source_stage_init(&job->stage, size);
+    }
+    pthread_mutex_unlock(&run->lock);
+}
+
+static void release_source_stage(copy_run_t *run, copy_job_t *job) {
+    size_t capacity = job->stage.capacity;
+
+    if (capacity == 0) {
+        return;
+    }
+    source_stage_free(&job->stage);
+    pthread_mutex_lock(&run->lock);
+    run->staged -= capacity;
+    pthread_mutex_unlock(&run->lock);
+}
+
+/* The job's stage, or NULL if it has none */
+static source_stage_t *stage_of(copy_job_t *job) {
+    return job->stage.capacity ? &job->stage : NULL;
+}
+
+static void add_stats(stats_t *total, const stats_t *delta) {
+    total->files_copied += delta->files_copied;
+    total->files_hard_linked += delta->files_hard_linked;
+    total->files_soft_linked += delta->files_soft_linked;
+    total->files_reflinked += delta->files_reflinked;
+    total->files_skipped += delta->files_skipped;
+    total->bytes_copied += delta->bytes_copied;
+    total->bytes_hard_linked += delta->bytes_hard_linked;
+    total->bytes_soft_linked += delta->bytes_soft_linked;
+    total->bytes_reflinked += delta->bytes_reflinked;
+}
+
+/* Refreshes the status line; the caller holds run->lock */
+static void print_progress(copy_run_t *run) {
+    char stats_buffer[256];
+
+    if (!run->opts->show_stats) {
+        return;
+    }
+    format_stats_line(run->stats, run->opts->human_readable, stats_buffer, sizeof(stats_buffer));
+    if (run->opts->verbose == 0) {
+        print_status_update("%s", stats_buffer);
+    } else {
+        print_stats_at_bottom("%s", stats_buffer);
+    }
+}
+
+/* Looks a stat'ed file up in the reference index */
+static void match_job(copy_run_t *run, copy_job_t *job) {
+    if (run->ref_files) {
+        job->live_seen = live_reference_count(run->ref_files);
+        reserve_source_stage(run, job);
+        if (find_matching_file(run->ref_files, job->src, job->src_fd, &job->st, stage_of(job),
+                               run->opts, &job->match) &&
+            job->top_level && run->opts->verbose) {
+            printf("Found matching reference file for %s: %s\n", job->src, job->match.path);
+        }
+        /* The stage is only kept for a copy, and only if anything was read */
+        if (job->match.path || job->stage.length == 0) {
+            release_source_stage(run, job);
+        }
+    }
+}
+
+/* Pipeline stage: looks the file up in the reference index, unless it is
+ * another path of a source inode that has been, or is being, looked up */
+static void *match_stage(void *item, void *ctx) {
+    copy_job_t *job = item;
+    copy_run_t *run = ctx;
+
+    /* The source is opened and stat'ed once here; matching and copying
+     * both work from the descriptor and this metadata. Should it not open
+     * (out of descriptors, say), it is handled by path instead. */
+    job->src_fd = open(job->src, O_RDONLY);
+    if ((job->src_fd >= 0 ? fstat(job->src_fd, &job->st) : stat(job->src, &job->st)) != 0) {
+        fprintf(stderr, "Error: Cannot stat source file %s\n", job->src);
+        return job;
+    }
+    job->have_stat = 1;
+    if (job->st.st_nlink > 1) {
+        switch (claim_source_inode(run, job)) {
+        case SOURCE_INODE_SEEN:
+            return job;
+        case SOURCE_INODE_WAITING:
+            /* The entry holds it; it goes on with the first path's copy */
+            return NULL;
+        default:
+            break;
+        }
+    }
+    match_job(run, job);
+    return job;
+}
+
+/* Links the file to its match, or copies it. Statistics are gathered per
+ * file and added to the run's totals under its lock. Returns 0 if written. */
+static int copy_job(copy_run_t *run, copy_job_t *job) {
+    const options_t *opts = run->opts;
+    stats_t delta = {0};
+    hash_ctx_t hash;
+    int hashing = opts->dedup_copies && run->ref_files;
+    const struct stat *src_st = job->have_stat ? &job->st : NULL;
+    int dest_dir_fd = job->dest_dir ? job->dest_dir->fd : AT_FDCWD;
+    int result;
+
+    /* Files found in a directory go into its open counterpart, which the
+     * walker created; only files named on the command line need a check */
+    if (!job->dest_dir && create_parent_directory(job->src, job->dest) != 0) {
+        fprintf(stderr, "%s: Cannot create directory structure for %s\n",
+                job->top_level ? "Error" : "Warning", job->dest);
+        if (job->top_level) {
+            pthread_mutex_lock(&run->lock);
+            run->failed = 1;
+            pthread_mutex_unlock(&run->lock);
+        }
+        release_source_stage(run, job);
+        return -1;
+    }
+
+    /* Copies finished while this file sat in the queue may match it now */
+    if (hashing && job->have_stat && !job->match.path && !job->link_to &&
+        live_reference_count(run->ref_files) != job->live_seen) {
+        find_live_match(run->ref_files, job->src, job->src_fd, &job->st, stage_of(job), opts, &job->match);
+    }
+    if (hashing) {
+        hash_init(&hash, opts->hash_algorithm);
+    }
+    if (job->link_to) {
+        /* Another path of this source inode was written already */
+        options_t link_opts = *opts;
+        link_opts.link_type = LINK_HARD;
+        result = copy_or_link_file(job->src, job->src_fd, src_st, dest_dir_fd, job->dest,
+                                   job->link_to, &link_opts, &delta, hashing ? &hash : NULL, NULL);
+    } else {
+        result = copy_or_link_file(job->src, job->src_fd, src_st, dest_dir_fd, job->dest,
+                                   job->match.path, opts, &delta, hashing ? &hash : NULL,
+                                   stage_of(job));
+    }
+    release_source_stage(run, job);
+    if (result != 0 && !job->top_level) {
+        fprintf(stderr, "Warning: Cannot copy %s to %s: %s\n",
+                job->src, job->dest, strerror(errno));
+    }
+    if (result == 0 && job->match.path && opts->link_type == LINK_HARD && opts->index_file) {
+        refresh_reference_ctime(run->ref_files, &job->match);
+    }
+    /* A fresh copy becomes a reference for the sources still to come */
+    if (result == 0 && hashing && delta.files_copied) {
+        unsigned char digest[HASH_MAX_DIGEST_LENGTH];
+        hash_final(&hash, digest);
+        if (add_live_reference(run->ref_files, job->dest, delta.bytes_copied, digest) != 0) {
+            fprintf(stderr, "Warning: Memory allocation failed, %s will not be linked to\n", job->dest);
+        }
+    }
+
+    pthread_mutex_lock(&run->lock);
+    if (result != 0) {
+        if (job->top_level) {
+            run->failed = 1;
+        }
+    } else {
+        add_stats(run->stats, &delta);
+        if (opts->verbose) {
+            if (job->link_to && delta.files_hard_linked) {
+                printf("%s -> %s (hard link to %s)\n", job->src, job->dest, job->link_to);
+            } else if (job->match.path) {
+                printf("%s -> %s (%s to %s)\n", job->src, job->dest,
+                       link_type_name(opts->link_type), job->match.path);
+            } else {
+                printf("%s -> %s (copied)\n", job->src, job->dest);
+            }
+        }
+        print_progress(run);
+    }
+    pthread_mutex_unlock(&run->lock);
+
+    return result;
+}
+
+/* Pipeline stage: writes the file, then any other paths of its source
+ * inode that were waiting for it to be written */
+static void *copy_stage(void *item, void *ctx) {
+    copy_run_t *run = ctx;
+    copy_job_t *queue = item;
+
+    while (queue) {
+        copy_job_t *job = queue;
+        int result;
+
+        queue = job->next;
+        job->next = NULL;
+        result = copy_job(run, job);
+        if (job->claim) {
+            copy_job_t *ready = settle_source_inode(run, job, result == 0);
+            if (ready && ready->claim) {
+                match_job(run, ready);
+            }
+            if (ready) {
+                copy_job_t *last = ready;
+                while (last->next) {
+                    last = last->next;
+                }
+                last->next = queue;
+                queue = ready;
+            }
+        }
+        free_copy_job(job);
+    }
+    return NULL;
+}
+
+/* Sends a regular file through the match and copy stages: queued for the
+ * worker threads when running a pipeline, processed at once otherwise. The
+ * job holds dest_dir, if not NULL, until it is done. */
+static int submit_file(copy_run_t *run, const char *src, const char *dest, dir_handle_t *dest_dir,
+                       int top_level) {
+    copy_job_t *job = calloc(1, sizeof(copy_job_t));
+
+    if (job) {
+        job->src = strdup(src);
+        job->dest = strdup(dest);
+    }
+    if (!job || !job->src || !job->dest) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free_copy_job(job);
+        return -1;
+    }
+    job->top_level = top_level;
+    job->src_fd = -1;
+    job->dest_dir = hold_dir_handle(dest_dir);
+
+    if (run->pipeline) {
+        pipeline_submit(run->pipeline, job);
+    } else {
+        copy_stage(match_stage(job, run), run);
+    }
+    return 0;
+}
+
+static void skip_file(copy_run_t *run, const char *dest) {
+    pthread_mutex_lock(&run->lock);
+    if (run->opts->verbose) {
+        printf("skipping '%s' (not overwriting)\n", dest);
+    }
+    run->stats->files_skipped++;
+    print_progress(run);
+    pthread_mutex_unlock(&run->lock);
+}
+
+static void apply_directory_attributes(const char *src, const char *dest, const options_t *opts) {
+    if (preserve_file_attributes(src, dest, &opts->preserve) != 0 && opts->verbose) {
+        fprintf(stderr, "Warning: Failed to preserve attributes for directory %s\n", dest);
+    }
+}
+
+/* Remembers a destination directory so its attributes can be applied once
+ * everything inside it has been written; writing its contents would
+ * otherwise reset its timestamps, and a read-only mode would block them */
+static void defer_directory_attributes(copy_run_t *run, const char *src, const char *dest) {
+    const options_t *opts = run->opts;
+    dir_job_t *dir;
+
+    if (!(opts->preserve.mode || opts->preserve.ownership || opts->preserve.timestamps)) {
+        return;
+    }
+    pthread_mutex_lock(&run->lock);
+    if (run->dir_count == run->dir_capacity) {
+        int new_capacity = run->dir_capacity ? run->dir_capacity * 2 : 64;
+        dir_job_t *new_dirs = realloc(run->dirs, new_capacity * sizeof(dir_job_t));
+        if (!new_dirs) {
+            pthread_mutex_unlock(&run->lock);
+            apply_directory_attributes(src, dest, opts);
+            return;
+        }
+        run->dirs = new_dirs;
+        run->dir_capacity = new_capacity;
+    }
+    dir = &run->dirs[run->dir_count];
+    dir->src = strdup(src);
+    dir->dest = strdup(dest);
+    if (!dir->src || !dir->dest) {
+        free(dir->src);
+        free(dir->dest);
+        pthread_mutex_unlock(&run->lock);
+        apply_directory_attributes(src, dest, opts);
+        return;
+    }
+    run->dir_count++;
+    pthread_mutex_unlock(&run->lock);
+}
+
+/* Applies deferred directory attributes, children before their parents.
+ * A directory is only recorded once its parent has been, so walking the
+ * list backwards visits children first even after a parallel walk. */
+static void apply_deferred_directories(copy_run_t *run) {
+    for (int i = run->dir_count - 1; i >= 0; i--) {
+        apply_directory_attributes(run->dirs[i].src, run->dirs[i].dest, run->opts);
+        free(run->dirs[i].src);
+        free(run->dirs[i].dest);
+    }
+    free(run->dirs);
+    run->dirs = NULL;
+    run->dir_count = run->dir_capacity = 0;
+}
+
+/* Formats "dir/name" into a heap buffer owned by one recursion level,
+ * growing it when a longer name comes along */
+static const char *format_entry_path(char **buf, size_t *cap, const char *dir, const char *name) {
+    size_t need = strlen(dir) + strlen(name) + 2;
+
+    if (need > *cap) {
+        char *new_buf = realloc(*buf, need);
+        if (!new_buf) {
+            return NULL;
+        }
+        *buf = new_buf;
+        *cap = need;
+    }
+    snprintf(*buf, *cap, "%s/%s", dir, name);
+    return *buf;
+}
+
+/* Asks whether dest may be overwritten. Prompts are taken one at a time,
+ * since several walkers may reach existing files at once. */
+static int overwrite_allowed(copy_run_t *run, const char *dest) {
+    int allowed;
+
+    if (!run->opts->interactive) {
+        return should_overwrite(dest, run->opts);
+    }
+    pthread_mutex_lock(&run->lock);
+    allowed = should_overwrite(dest, run->opts);
+    pthread_mutex_unlock(&run->lock);
+    return allowed;
+}
+
+/* Creates the destination directory called name inside dest_parent, or
+ * at dest_path if that is NULL, with the mode of the source directory
+ * open as src_fd, and opens it so the files written into it are created
+ * relative to it. Returns -1 if it cannot be created. If it cannot be
+ * opened, *dest_dir is NULL and its files go by path. */
+static int create_dest_dir(dir_handle_t *dest_parent, const char *name, const char *dest_path,
+                           int src_fd, dir_handle_t **dest_dir) {
+    int at_fd = dest_parent ? dest_parent->fd : AT_FDCWD;
+    const char *at_name = dest_parent ? name : dest_path;
     struct stat st;
-    char src_full[MAX_PATH];
-    char dest_full[MAX_PATH];
-    file_info_t *matching_file;
-    
-    src_dir = opendir(src_path);
+    int fd;
+
+    *dest_dir = NULL;
+    if (fstat(src_fd, &st) != 0) {
+        return -1;
+    }
+    if (mkdirat(at_fd, at_name, st.st_mode) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    fd = openat(at_fd, at_name, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return errno == ENOTDIR ? -1 : 0;
+    }
+    *dest_dir = new_dir_handle(fd);
+    if (!*dest_dir) {
+        close(fd);
+    }
+    return 0;
+}
+
+/* Opens the source directory called name inside parent_fd (whose full path
+ * is src_path) and creates its counterpart at dest_path, inside dest_parent
+ * when that is open, so the destination exists before anything is written
+ * into it. The walker holds *dest_dir until it has listed the directory. */
+static DIR *open_source_directory(copy_run_t *run, int parent_fd, const char *name,
+                                  const char *src_path, dir_handle_t *dest_parent,
+                                  const char *dest_path, dir_handle_t **dest_dir) {
+    DIR *src_dir;
+    int dir_fd;
+
+    dir_fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY);
+    src_dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
     if (!src_dir) {
         fprintf(stderr, "Error: Cannot open source directory %s: %s\n", 
                 src_path, strerror(errno));
-        return -1;
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        return NULL;
     }
     
-    if (create_directory_structure(src_path, dest_path) != 0) {
+    if (create_dest_dir(dest_parent, name, dest_path, dir_fd, dest_dir) != 0) {
         fprintf(stderr, "Error: Cannot create destination directory %s: %s\n", 
                 dest_path, strerror(errno));
         closedir(src_dir);
-        return -1;
+        return NULL;
     }
+    defer_directory_attributes(run, src_path, dest_path);
     
-    if (opts->preserve.mode || opts->preserve.ownership || opts->preserve.timestamps) {
-        if (preserve_file_attributes(src_path, dest_path, &opts->preserve) != 0 && opts->verbose) {
-            fprintf(stderr, "Warning: Failed to preserve attributes for directory %s\n", dest_path);
-        }
-    }
+    return src_dir;
+}
+
+/* Called for each subdirectory found while reading a source directory */
+typedef int (*visit_subdir_fn_t)(copy_run_t *run, int dir_fd, const char *name,
+                                 const char *src_path, dir_handle_t *dest_parent,
+                                 const char *dest_path, void *arg);
+
+/* Reads an open source directory, submitting its regular files and handing
+ * subdirectories to visit_subdir. Entries are classified by d_type where the
+ * filesystem provides it, and only symlinks or untyped entries are stat'ed,
+ * relative to the directory descriptor. */
+static int copy_directory_entries(copy_run_t *run, DIR *src_dir, const char *src_path,
+                                  dir_handle_t *dest_dir, const char *dest_path,
+                                  visit_subdir_fn_t visit_subdir, void *arg) {
+    const options_t *opts = run->opts;
+    int dir_fd = dirfd(src_dir);
+    struct dirent *entry;
+    entry_stat_t est;
+    char *src_buf = NULL, *dest_buf = NULL;
+    size_t src_cap = 0, dest_cap = 0;
+    const char *src_full, *dest_full;
+    int result = 0;
     
     while ((entry = readdir(src_dir)) != NULL) {
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
             continue;
         }
         
-        snprintf(src_full, sizeof(src_full), "%s/%s", src_path, entry->d_name);
-        snprintf(dest_full, sizeof(dest_full), "%s/%s", dest_path, entry->d_name);
+        src_full = format_entry_path(&src_buf, &src_cap, src_path, entry->d_name);
+        dest_full = format_entry_path(&dest_buf, &dest_cap, dest_path, entry->d_name);
+        if (!src_full || !dest_full) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            result = -1;
+            break;
+        }
         
-        if (stat(src_full, &st) != 0) {
-            fprintf(stderr, "Warning: Cannot stat %s: %s\n", src_full, strerror(errno));
-            continue;
+        est.mode = dirent_mode(entry);
+        if (est.mode == 0) {
+            if (stat_entry(dir_fd, entry->d_name, &est) != 0) {
+                fprintf(stderr, "Warning: Cannot stat %s: %s\n", src_full, strerror(errno));
+                continue;
+            }
         }
         
-        if (S_ISDIR(st.st_mode)) {
+        if (S_ISDIR(est.mode)) {
             if (opts->recursive) {
-                if (copy_directory_recursive(src_full, dest_full, ref_files, opts, stats) != 0) {
-                    closedir(src_dir);
-                    return -1;
-                }
-            }
-        } else if (S_ISREG(st.st_mode)) {
-            matching_file = NULL;
-            
-            if (!should_overwrite(dest_full, opts)) {
-                if (opts->verbose) {
-                    printf("skipping '%s' (not overwriting)\n", dest_full);
+                if (visit_subdir(run, dir_fd, entry->d_name, src_full, dest_dir, dest_full, arg) != 0) {
+                    result = -1;
+                    break;
                 }
-                stats->files_skipped++;
-                continue;
-            }
-            
-            if (ref_files) {
-                matching_file = find_matching_file(ref_files, src_full, opts);
-            }
-            
-            if (create_directory_structure(src_full, dest_full) != 0) {
-                fprintf(stderr, "Warning: Cannot create directory structure for %s\n", dest_full);
-                continue;
             }
-            
-            if (copy_or_link_file(src_full, dest_full, 
-                                 matching_file ? matching_file->path : NULL, 
-                                 opts, stats) != 0) {
-                fprintf(stderr, "Warning: Cannot copy %s to %s: %s\n", 
-                        src_full, dest_full, strerror(errno));
+        } else if (S_ISREG(est.mode)) {
+            if (!overwrite_allowed(run, dest_full)) {
+                skip_file(run, dest_full);
                 continue;
             }
             
-            if (opts->verbose) {
-                if (matching_file) {
-                    printf("%s -> %s (%s to %s)\n", src_full, dest_full,
-                           opts->link_type == LINK_HARD ? "hard link" : "soft link",
-                           matching_file->path);
-                } else {
-                    printf("%s -> %s (copied)\n", src_full, dest_full);
-                }
-            }
-            
-            if (opts->show_stats) {
-                char stats_buffer[256];
-                format_stats_line(stats, opts->human_readable, stats_buffer, sizeof(stats_buffer));
-                
-                if (opts->verbose == 0) {
-                    print_status_update("%s", stats_buffer);
-                } else {
-                    print_stats_at_bottom("%s", stats_buffer);
-                }
+            if (submit_file(run, src_full, dest_full, dest_dir, 0) != 0) {
+                result = -1;
+                break;
             }
         }
     }
     
+    free(src_buf);
+    free(dest_buf);
+    return result;
+}
+
+/* Copies the directory called name inside parent_fd depth first on the
+ * calling thread, opening each subdirectory relative to its parent */
+static int copy_directory_recursive(copy_run_t *run, int parent_fd, const char *name,
+                                   const char *src_path, dir_handle_t *dest_parent,
+                                   const char *dest_path, void *arg) {
+    dir_handle_t *dest_dir;
+    DIR *src_dir = open_source_directory(run, parent_fd, name, src_path, dest_parent, dest_path, &dest_dir);
+    int result;
+
+    if (!src_dir) {
+        return -1;
+    }
+    result = copy_directory_entries(run, src_dir, src_path, dest_dir, dest_path,
+                                    copy_directory_recursive, arg);
     closedir(src_dir);
+    release_dir_handle(dest_dir);
+    return result;
+}
+
+/* A source directory waiting in the work-stealing walk. Subdirectories
+ * hold their parents open, source and destination, and are opened
+ * relative to them as the sequential walk does; a root, or a task whose
+ * parent could not be kept open, goes by its full paths. */
+typedef struct {
+    char *src;
+    char *dest;
+    const char *name;           /* Last component of src */
+    dir_handle_t *src_parent;   /* Open directory src is in, or NULL */
+    dir_handle_t *dest_parent;  /* Open directory dest is in, or NULL */
+} walk_task_t;
+
+/* Where a walker pushes the subdirectories it finds, and the handle on the
+ * directory it is listing that they share, opened for the first of them */
+typedef struct {
+    work_pool_t *pool;
+    int worker;
+    dir_handle_t *src_dir;
+    int src_dir_failed;         /* The directory could not be kept open */
+} walk_target_t;
+
+static walk_task_t *new_walk_task(const char *src, const char *dest) {
+    walk_task_t *task = calloc(1, sizeof(walk_task_t));
+
+    if (task) {
+        task->src = strdup(src);
+        task->dest = strdup(dest);
+        if (!task->src || !task->dest) {
+            free(task->src);
+            free(task->dest);
+            free(task);
+            task = NULL;
+        }
+    }
+    return task;
+}
+
+static void free_walk_task(walk_task_t *task) {
+    release_dir_handle(task->src_parent);
+    release_dir_handle(task->dest_parent);
+    free(task->src);
+    free(task->dest);
+    free(task);
+}
+
+/* Queues a subdirectory for any walker, holding the directories it is in.
+ * Its siblings share one descriptor for the source directory, duplicated
+ * from the walker's own, which is closed once they are all done. */
+static int push_walk_task(copy_run_t *run, int dir_fd, const char *name, const char *src_path,
+                          dir_handle_t *dest_parent, const char *dest_path, void *arg) {
+    walk_target_t *target = arg;
+    walk_task_t *task = new_walk_task(src_path, dest_path);
+
+    (void)run;
+    if (!task) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    if (!target->src_dir && !target->src_dir_failed) {
+        int fd = dup(dir_fd);
+        target->src_dir = fd >= 0 ? new_dir_handle(fd) : NULL;
+        if (!target->src_dir) {
+            target->src_dir_failed = 1;
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+    if (target->src_dir) {
+        task->name = task->src + strlen(task->src) - strlen(name);
+        task->src_parent = hold_dir_handle(target->src_dir);
+        task->dest_parent = hold_dir_handle(dest_parent);
+    }
+    work_pool_push(target->pool, target->worker, task);
+    return 0;
+}
+
+/* Work pool callback: copies one source directory's files and hands its
+ * subdirectories back to the pool, where idle walkers can steal them. A
+ * directory that cannot be read fails the run, but the rest of the tree
+ * is still copied. */
+static void walk_source_dir(work_pool_t *pool, int worker, void *item, void *ctx) {
+    copy_run_t *run = ctx;
+    walk_task_t *task = item;
+    walk_target_t target = { pool, worker, NULL, 0 };
+    dir_handle_t *dest_dir;
+    DIR *src_dir;
+    int result = -1;
+
+    if (task->src_parent) {
+        src_dir = open_source_directory(run, task->src_parent->fd, task->name, task->src,
+                                        task->dest_parent, task->dest, &dest_dir);
+    } else {
+        src_dir = open_source_directory(run, AT_FDCWD, task->src, task->src, NULL, task->dest, &dest_dir);
+    }
+    if (src_dir) {
+        result = copy_directory_entries(run, src_dir, task->src, dest_dir, task->dest,
+                                        push_walk_task, &target);
+        closedir(src_dir);
+        release_dir_handle(dest_dir);
+        release_dir_handle(target.src_dir);
+    }
+    if (result != 0) {
+        pthread_mutex_lock(&run->lock);
+        run->failed = 1;
+        pthread_mutex_unlock(&run->lock);
+    }
+    free_walk_task(task);
+}
+
+/* Files queued for copying hold their sources open, besides the references
+ * open in the matchers; lifting the soft descriptor limit to the hard one
+ * keeps a full queue from running out */
+static void raise_descriptor_limit(void) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/* Finds the device files are written to: that of dest itself, or of the
+ * directory it will be created in. Returns -1 if neither can be stat'ed. */
+static int destination_device(const char *dest, dev_t *dev) {
+    struct stat st;
+    char parent[MAX_PATH];
+    const char *slash;
+
+    if (stat(dest, &st) != 0) {
+        slash = strrchr(dest, '/');
+        if (!slash) {
+            strcpy(parent, ".");
+        } else if (slash == dest) {
+            strcpy(parent, "/");
+        } else {
+            snprintf(parent, sizeof(parent), "%.*s", (int)(slash - dest), dest);
+        }
+        if (stat(parent, &st) != 0) {
+            return -1;
+        }
+    }
+    *dev = st.st_dev;
     return 0;
 }
 
 int copy_directory(const options_t *opts, stats_t *stats) {
     struct stat dest_st;
     sorted_file_info_t *ref_files = NULL;
+    copy_run_t run;
+    void **roots;
+    int root_count = 0;
     int overall_result = 0;
     int dest_is_dir = 0;
     
@@ -474,7 +1586,7 @@ int copy_directory(const options_t *opts, stats_t *stats) {
             }
         } else {
             // Get the number of reference files from the sorted structure
-            int ref_file_count = ref_files->count;
+            int ref_file_count = ref_files->files.count;
 
             if (opts->verbose) {
                 printf("Found %d reference files across all directories\n", ref_file_count);
@@ -482,6 +1594,59 @@ int copy_directory(const options_t *opts, stats_t *stats) {
         }
     }
     
+    roots = malloc(sizeof(void *) * (opts->source_count ? opts->source_count : 1));
+    if (!roots) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free_sorted_file_info(ref_files);
+        return -1;
+    }
+    
+    /* Copies are added to the index as they are made, so it is needed
+     * even without reference directories */
+    if (!ref_files && opts->dedup_copies) {
+        ref_files = create_reference_index(opts);
+        if (!ref_files) {
+            fprintf(stderr, "Warning: Memory allocation failed, copies will not be deduplicated\n");
+        }
+    }
+    
+    /* Hard links and clones can only be made within the destination's
+     * filesystem, so references on other devices are never compared.
+     * Destinations spanning several mounts link only on the first. */
+    if (ref_files && (opts->link_type == LINK_HARD || opts->link_type == LINK_REFLINK) &&
+        destination_device(opts->dest_dir, &ref_files->link_device) == 0) {
+        ref_files->link_device_only = 1;
+        if (opts->verbose) {
+            int elsewhere = 0;
+            for (int i = 0; i < ref_files->files.count; i++) {
+                elsewhere += ref_files->files.devs[i] != ref_files->link_device;
+            }
+            if (elsewhere > 0) {
+                printf("Skipping %d reference files on a different filesystem from the destination\n", elsewhere);
+            }
+        }
+    }
+    
+    memset(&run, 0, sizeof(run));
+    run.ref_files = ref_files;
+    run.opts = opts;
+    run.stats = stats;
+    pthread_mutex_init(&run.lock, NULL);
+    
+    /* With several workers, the traversal below only finds files; matching
+     * and copying overlap with it and with each other */
+    if (opts->match_threads > 1 || opts->copy_threads > 1) {
+        pipeline_stage_t stages[2] = {
+            {match_stage, opts->match_threads},
+            {copy_stage, opts->copy_threads}
+        };
+        raise_descriptor_limit();
+        run.pipeline = pipeline_start(stages, 2, PIPELINE_QUEUE_SIZE, &run);
+        if (!run.pipeline) {
+            fprintf(stderr, "Warning: Cannot start worker threads, processing files one at a time\n");
+        }
+    }
+    
     /* Process each source */
     for (int i = 0; i < opts->source_count; i++) {
         struct stat src_st;
@@ -508,64 +1673,54 @@ int copy_directory(const options_t *opts, stats_t *stats) {
         
         /* Copy source to destination */
         if (S_ISDIR(src_st.st_mode)) {
-            if (copy_directory_recursive(src_path, dest_path, ref_files, opts, stats) != 0) {
+            walk_task_t *task = opts->walk_threads > 1 ? new_walk_task(src_path, dest_path) : NULL;
+            if (task) {
+                roots[root_count++] = task;
+            } else if (copy_directory_recursive(&run, AT_FDCWD, src_path, src_path, NULL, dest_path, NULL) != 0) {
                 overall_result = -1;
             }
         } else {
-            file_info_t *matching_file = NULL;
-            
-            if (!should_overwrite(dest_path, opts)) {
-                if (opts->verbose) {
-                    printf("skipping '%s' (not overwriting)\n", dest_path);
-                }
-                stats->files_skipped++;
+            if (!overwrite_allowed(&run, dest_path)) {
+                skip_file(&run, dest_path);
                 continue;
             }
             
-            if (ref_files) {
-                matching_file = find_matching_file(ref_files, src_path, opts);
-                if (opts->verbose && matching_file) {
-                    printf("Found matching reference file for %s: %s\n", src_path, matching_file->path);
-                }
-            }
-            
-            if (create_directory_structure(src_path, dest_path) != 0) {
-                fprintf(stderr, "Error: Cannot create directory structure for %s\n", dest_path);
+            if (submit_file(&run, src_path, dest_path, NULL, 1) != 0) {
                 overall_result = -1;
-                continue;
             }
-            
-            if (copy_or_link_file(src_path, dest_path,
-                                 matching_file ? matching_file->path : NULL,
-                                 opts, stats) != 0) {
+        }
+    }
+    
+    /* Walk the source trees together, sharing directories between walkers
+     * so that one huge subtree does not leave the others idle */
+    if (root_count > 0 && work_pool_run(opts->walk_threads, roots, root_count, walk_source_dir, &run) != 0) {
+        for (int i = 0; i < root_count; i++) {
+            walk_task_t *task = roots[i];
+            if (copy_directory_recursive(&run, AT_FDCWD, task->src, task->src, NULL, task->dest, NULL) != 0) {
                 overall_result = -1;
-                continue;
-            }
-            
-            if (opts->verbose) {
-                if (matching_file) {
-                    printf("%s -> %s (%s to %s)\n", src_path, dest_path,
-                           opts->link_type == LINK_HARD ? "hard link" : "soft link",
-                           matching_file->path);
-                } else {
-                    printf("%s -> %s (copied)\n", src_path, dest_path);
-                }
-            }
-            
-            if (opts->show_stats) {
-                char stats_buffer[256];
-                format_stats_line(stats, opts->human_readable, stats_buffer, sizeof(stats_buffer));
-                
-                if (opts->verbose == 0) {
-                    print_status_update("%s", stats_buffer);
-                } else {
-                    print_stats_at_bottom("%s", stats_buffer);
-                }
             }
+            free_walk_task(task);
         }
     }
+    free(roots);
+    
+    /* Wait for the workers to drain the queues before touching directories
+     * they may still be writing into, or the index they may still be updating */
+    if (run.pipeline) {
+        pipeline_finish(run.pipeline);
+    }
+    apply_deferred_directories(&run);
+    if (run.failed) {
+        overall_result = -1;
+    }
+    free_source_inodes(&run);
+    pthread_mutex_destroy(&run.lock);
     
     if (ref_files) {
+        /* Persist digests computed during this run for the next one */
+        if (opts->index_file) {
+            save_reference_index(opts->index_file, ref_files);
+        }
         free_sorted_file_info(ref_files);
     }
     
@@ -0,0 +1,615 @@
+/*
+ * cpdd/index.c - Persistent reference index
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The index file is a header, one record per reference directory, then one
+ * record per reference file. All integers are little-endian so an index can
+ * be moved between hosts.
+ *
+ *   header: "CPDDIDX1" | u32 version | u32 hash algorithm | u32 digest length |
+ *           u64 file count | u64 directory count
+ *   dir:    u64 dev | u64 ino | i64 mtime sec | u32 mtime nsec |
+ *           i64 ctime sec | u32 ctime nsec | u32 path length | path
+ *   file:   u64 size | u64 dev | u64 ino | i64 mtime sec | u32 mtime nsec |
+ *           i64 ctime sec | u32 ctime nsec | u32 directory | u32 flags |
+ *           u32 name length | u64 fingerprint | digest | name
+ *
+ * A file's path is its directory's path, a slash and its name.
+ */
+
+#include "cpdd.h"
+#include <stdint.h>
+#include <pthread.h>
+
+#define INDEX_MAGIC "CPDDIDX1"
+#define INDEX_VERSION 5
+#define INDEX_HEADER_SIZE 36
+#define INDEX_DIR_RECORD_SIZE 44
+#define INDEX_FILE_RECORD_SIZE 68
+#define INDEX_MAX_PATH (1 << 20)
+
+/* File record flags */
+#define INDEX_HAS_DIGEST 0x1
+#define INDEX_HAS_FINGERPRINT 0x2
+
+/* Open-addressing table mapping a path to an array index */
+typedef struct {
+    const char **keys;
+    int *values;
+    size_t mask;
+} path_table_t;
+
+/* Open-addressing table mapping a directory and name to a file's row */
+typedef struct {
+    int *rows;              /* -1 marks an empty slot */
+    size_t mask;
+} name_table_t;
+
+/* A directory loaded from a saved index */
+typedef struct {
+    dir_info_t info;
+    int first_file;         /* Row of the first file recorded in it, or -1 */
+    int first_child;        /* First subdirectory, or -1 */
+    int next_sibling;       /* Next directory with the same parent, or -1 */
+    int claimed;            /* Files have been handed to the scan */
+} saved_dir_t;
+
+struct saved_index {
+    saved_dir_t *dirs;
+    int dir_count;
+    file_table_t files;     /* Every saved file, for digest lookups */
+    int *next_file;         /* Next row in the same directory, or -1 */
+    path_table_t dir_table;
+    name_table_t file_table;
+    pthread_mutex_t lock;   /* Protects claimed */
+};
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static void put_u64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/* Encodes the metadata shared by directory and file records */
+static void put_metadata(unsigned char *p, dev_t dev, ino_t ino,
+                         const struct timespec *mtime, const struct timespec *ctime) {
+    put_u64(p, (uint64_t)dev);
+    put_u64(p + 8, (uint64_t)ino);
+    put_u64(p + 16, (uint64_t)(int64_t)mtime->tv_sec);
+    put_u32(p + 24, (uint32_t)mtime->tv_nsec);
+    put_u64(p + 28, (uint64_t)(int64_t)ctime->tv_sec);
+    put_u32(p + 36, (uint32_t)ctime->tv_nsec);
+}
+
+static void get_metadata(const unsigned char *p, dev_t *dev, ino_t *ino,
+                         struct timespec *mtime, struct timespec *ctime) {
+    *dev = (dev_t)get_u64(p);
+    *ino = (ino_t)get_u64(p + 8);
+    mtime->tv_sec = (time_t)(int64_t)get_u64(p + 16);
+    mtime->tv_nsec = (long)get_u32(p + 24);
+    ctime->tv_sec = (time_t)(int64_t)get_u64(p + 28);
+    ctime->tv_nsec = (long)get_u32(p + 36);
+}
+
+static int timespec_equal(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static uint64_t hash_path(const char *path, size_t len) {
+    uint64_t h = 14695981039346656037ULL; /* FNV-1a */
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int path_table_init(path_table_t *table, int count) {
+    size_t capacity = 16;
+
+    while (capacity < (size_t)count * 2) {
+        capacity *= 2;
+    }
+    table->keys = calloc(capacity, sizeof(const char *));
+    table->values = malloc(capacity * sizeof(int));
+    if (!table->keys || !table->values) {
+        free(table->keys);
+        free(table->values);
+        table->keys = NULL;
+        table->values = NULL;
+        return -1;
+    }
+    table->mask = capacity - 1;
+    return 0;
+}
+
+static void path_table_insert(path_table_t *table, const char *path, int value) {
+    size_t slot = hash_path(path, strlen(path)) & table->mask;
+
+    while (table->keys[slot]) {
+        slot = (slot + 1) & table->mask;
+    }
+    table->keys[slot] = path;
+    table->values[slot] = value;
+}
+
+/* Looks up the first len bytes of path; returns the stored value or -1 */
+static int path_table_find(const path_table_t *table, const char *path, size_t len) {
+    size_t slot = hash_path(path, len) & table->mask;
+
+    while (table->keys[slot]) {
+        if (strncmp(table->keys[slot], path, len) == 0 && table->keys[slot][len] == '\0') {
+            return table->values[slot];
+        }
+        slot = (slot + 1) & table->mask;
+    }
+    return -1;
+}
+
+static void path_table_free(path_table_t *table) {
+    free(table->keys);
+    free(table->values);
+}
+
+static size_t hash_dir_name(int dir, const char *name) {
+    return (size_t)(hash_path(name, strlen(name)) ^ ((uint64_t)dir * 0x9E3779B97F4A7C15ULL));
+}
+
+static int name_table_init(name_table_t *table, int count) {
+    size_t capacity = 16;
+
+    while (capacity < (size_t)count * 2) {
+        capacity *= 2;
+    }
+    table->rows = malloc(capacity * sizeof(int));
+    if (!table->rows) {
+        return -1;
+    }
+    memset(table->rows, 0xFF, capacity * sizeof(int));
+    table->mask = capacity - 1;
+    return 0;
+}
+
+static void name_table_insert(name_table_t *table, const file_table_t *files, int row) {
+    size_t slot = hash_dir_name(files->dir_ids[row], files->names[row]) & table->mask;
+
+    while (table->rows[slot] >= 0) {
+        slot = (slot + 1) & table->mask;
+    }
+    table->rows[slot] = row;
+}
+
+/* Returns the row of the file named name in directory dir, or -1 */
+static int name_table_find(const name_table_t *table, const file_table_t *files, int dir, const char *name) {
+    size_t slot = hash_dir_name(dir, name) & table->mask;
+
+    while (table->rows[slot] >= 0) {
+        int row = table->rows[slot];
+        if (files->dir_ids[row] == dir && strcmp(files->names[row], name) == 0) {
+            return row;
+        }
+        slot = (slot + 1) & table->mask;
+    }
+    return -1;
+}
+
+/* Reads a u32 path length followed by the path into a new string */
+static char *read_path(FILE *fp, uint32_t path_len) {
+    char *path;
+
+    if (path_len == 0 || path_len > INDEX_MAX_PATH) {
+        return NULL;
+    }
+    path = malloc(path_len + 1);
+    if (!path) {
+        return NULL;
+    }
+    if (fread(path, 1, path_len, fp) != path_len) {
+        free(path);
+        return NULL;
+    }
+    path[path_len] = '\0';
+    return path;
+}
+
+void free_saved_index(saved_index_t *index) {
+    if (!index) {
+        return;
+    }
+    for (int i = 0; i < index->dir_count; i++) {
+        free(index->dirs[i].info.path);
+    }
+    path_table_free(&index->dir_table);
+    free(index->file_table.rows);
+    pthread_mutex_destroy(&index->lock);
+    free(index->dirs);
+    file_table_free(&index->files);
+    free(index->next_file);
+    free(index);
+}
+
+/*
+ * Loads an index saved by a previous run. Returns NULL if the file does not
+ * exist (normal on the first run) or cannot be used; the scan then simply
+ * starts from scratch.
+ */
+saved_index_t *load_saved_index(const char *index_file, const options_t *opts) {
+    FILE *fp;
+    unsigned char header[INDEX_HEADER_SIZE];
+    unsigned char record[INDEX_FILE_RECORD_SIZE];
+    unsigned char digest[HASH_MAX_DIGEST_LENGTH];
+    saved_index_t *index;
+    char *name;
+    uint64_t file_count, dir_count;
+    uint32_t digest_length;
+    int digests_usable;
+    int ok = 1;
+
+    fp = fopen(index_file, "rb");
+    if (!fp) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Warning: Cannot open index %s: %s\n", index_file, strerror(errno));
+        }
+        return NULL;
+    }
+
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+        memcmp(header, INDEX_MAGIC, 8) != 0 ||
+        get_u32(header + 8) != INDEX_VERSION ||
+        (digest_length = get_u32(header + 16)) > HASH_MAX_DIGEST_LENGTH) {
+        fprintf(stderr, "Warning: Ignoring unrecognised index file %s\n", index_file);
+        fclose(fp);
+        return NULL;
+    }
+    file_count = get_u64(header + 20);
+    dir_count = get_u64(header + 28);
+
+    /* Digests made with a different --hash are useless for comparison, but
+     * the directory and file metadata still spares the rescan */
+    digests_usable = get_u32(header + 12) == (uint32_t)opts->hash_algorithm &&
+                     digest_length == hash_digest_length(opts->hash_algorithm);
+    if (!digests_usable && opts->verbose) {
+        printf("Index %s was built with a different hash; its digests will be recomputed\n",
+               index_file);
+    }
+    if (file_count > INT32_MAX || dir_count > INT32_MAX) {
+        fprintf(stderr, "Warning: Ignoring unrecognised index file %s\n", index_file);
+        fclose(fp);
+        return NULL;
+    }
+
+    index = calloc(1, sizeof(saved_index_t));
+    if (!index) {
+        fclose(fp);
+        return NULL;
+    }
+    pthread_mutex_init(&index->lock, NULL);
+    file_table_init(&index->files, hash_digest_length(opts->hash_algorithm), 1);
+    index->dirs = calloc(dir_count ? dir_count : 1, sizeof(saved_dir_t));
+    index->next_file = malloc(sizeof(int) * (file_count ? file_count : 1));
+    name = malloc(INDEX_MAX_PATH + 1);
+    if (!index->dirs || !index->next_file || !name ||
+        path_table_init(&index->dir_table, (int)dir_count) != 0 ||
+        name_table_init(&index->file_table, (int)file_count) != 0) {
+        free_saved_index(index);
+        free(name);
+        fclose(fp);
+        return NULL;
+    }
+
+    for (uint64_t i = 0; ok && i < dir_count; i++) {
+        saved_dir_t *dir = &index->dirs[index->dir_count];
+
+        if (fread(record, 1, INDEX_DIR_RECORD_SIZE, fp) != INDEX_DIR_RECORD_SIZE ||
+            !(dir->info.path = read_path(fp, get_u32(record + 40)))) {
+            ok = 0;
+            break;
+        }
+        get_metadata(record, &dir->info.dev, &dir->info.ino, &dir->info.mtime, &dir->info.ctime);
+        dir->first_file = -1;
+        dir->first_child = -1;
+        dir->next_sibling = -1;
+        path_table_insert(&index->dir_table, dir->info.path, index->dir_count);
+        index->dir_count++;
+    }
+
+    /* Link each directory to its parent, when the parent was recorded too */
+    for (int i = 0; ok && i < index->dir_count; i++) {
+        const char *slash = strrchr(index->dirs[i].info.path, '/');
+        int parent = slash ? path_table_find(&index->dir_table, index->dirs[i].info.path,
+                                             (size_t)(slash - index->dirs[i].info.path)) : -1;
+        if (parent >= 0 && parent != i) {
+            index->dirs[i].next_sibling = index->dirs[parent].first_child;
+            index->dirs[parent].first_child = i;
+        }
+    }
+
+    for (uint64_t i = 0; ok && i < file_count; i++) {
+        entry_stat_t est;
+        uint32_t dir_index;
+        uint32_t flags;
+        uint32_t name_len;
+        int row;
+
+        if (fread(record, 1, INDEX_FILE_RECORD_SIZE, fp) != INDEX_FILE_RECORD_SIZE ||
+            fread(digest, 1, digest_length, fp) != digest_length ||
+            (name_len = get_u32(record + 56)) == 0 || name_len > INDEX_MAX_PATH ||
+            fread(name, 1, name_len, fp) != name_len) {
+            ok = 0;
+            break;
+        }
+        name[name_len] = '\0';
+
+        /* Every saved file belongs to a saved directory; skip any that don't */
+        dir_index = get_u32(record + 48);
+        if (dir_index >= (uint32_t)index->dir_count) {
+            continue;
+        }
+
+        est.size = (off_t)get_u64(record);
+        get_metadata(record + 8, &est.dev, &est.ino, &est.mtime, &est.ctime);
+        row = file_table_add(&index->files, (int)dir_index, name, &est);
+        if (row < 0) {
+            ok = 0;
+            break;
+        }
+        flags = get_u32(record + 52);
+        if (digests_usable && (flags & INDEX_HAS_DIGEST)) {
+            index->files.flags[row] |= FILE_HAS_DIGEST;
+            memcpy(index->files.digests + (size_t)row * index->files.digest_length, digest, digest_length);
+        }
+        if (flags & INDEX_HAS_FINGERPRINT) {
+            index->files.flags[row] |= FILE_HAS_FINGERPRINT;
+            index->files.fingerprints[row] = get_u64(record + 60);
+        }
+
+        /* Files are handed to the scan a directory at a time */
+        index->next_file[row] = index->dirs[dir_index].first_file;
+        index->dirs[dir_index].first_file = row;
+        name_table_insert(&index->file_table, &index->files, row);
+    }
+    free(name);
+
+    if (!ok) {
+        fprintf(stderr, "Warning: Ignoring truncated or corrupt index %s\n", index_file);
+        free_saved_index(index);
+        fclose(fp);
+        return NULL;
+    }
+
+    if (opts->verbose) {
+        printf("Loaded index %s: %d directories, %d files\n",
+               index_file, index->dir_count, index->files.count);
+    }
+
+    fclose(fp);
+    return index;
+}
+
+/*
+ * Checks a directory against the saved index. If its device, inode, mtime
+ * and ctime are unchanged, its entries cannot have changed either, so the
+ * recorded files are copied into files and the recorded subdirectories are
+ * passed to visit_subdir, with no readdir or per-file stat. Returns 1 if the
+ * directory was reused, 0 if it must be read.
+ */
+int saved_index_reuse_dir(saved_index_t *index, const dir_info_t *dir, file_table_t *files, int dir_id,
+                          void (*visit_subdir)(const char *path, void *arg), void *arg) {
+    int i = path_table_find(&index->dir_table, dir->path, strlen(dir->path));
+    saved_dir_t *saved;
+
+    if (i < 0) {
+        return 0;
+    }
+    saved = &index->dirs[i];
+    if (saved->info.dev != dir->dev || saved->info.ino != dir->ino ||
+        !timespec_equal(&saved->info.mtime, &dir->mtime) ||
+        !timespec_equal(&saved->info.ctime, &dir->ctime)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&index->lock);
+    if (saved->claimed) {
+        pthread_mutex_unlock(&index->lock);
+        return 0;
+    }
+    saved->claimed = 1;
+    pthread_mutex_unlock(&index->lock);
+
+    for (int row = saved->first_file; row >= 0; row = index->next_file[row]) {
+        file_table_copy_row(files, &index->files, row, dir_id);
+    }
+
+    for (int child = saved->first_child; child >= 0; child = index->dirs[child].next_sibling) {
+        visit_subdir(index->dirs[child].info.path, arg);
+    }
+
+    return 1;
+}
+
+/* Returns the saved index's number for the directory at path, or -1 */
+int saved_index_find_dir(const saved_index_t *index, const char *path) {
+    return path_table_find(&index->dir_table, path, strlen(path));
+}
+
+/*
+ * Copies a saved digest and fingerprint into a freshly scanned row of files,
+ * found in the directory the saved index numbers saved_dir, if the file's
+ * size, device, inode, mtime and ctime all match what was recorded.
+ */
+void saved_index_lookup_digest(const saved_index_t *index, int saved_dir, file_table_t *files, int row) {
+    const file_table_t *saved = &index->files;
+    int i = name_table_find(&index->file_table, saved, saved_dir, files->names[row]);
+
+    if (i < 0 || !files->times) {
+        return;
+    }
+    if (saved->sizes[i] != files->sizes[row] || saved->devs[i] != files->devs[row] ||
+        saved->inos[i] != files->inos[row] ||
+        !timespec_equal(&saved->times[i].mtime, &files->times[row].mtime) ||
+        !timespec_equal(&saved->times[i].ctime, &files->times[row].ctime)) {
+        return;
+    }
+    if (saved->flags[i] & FILE_HAS_DIGEST) {
+        memcpy(files->digests + (size_t)row * files->digest_length,
+               saved->digests + (size_t)i * saved->digest_length, files->digest_length);
+        files->flags[row] |= FILE_HAS_DIGEST;
+    }
+    if (saved->flags[i] & FILE_HAS_FINGERPRINT) {
+        files->fingerprints[row] = saved->fingerprints[i];
+        files->flags[row] |= FILE_HAS_FINGERPRINT;
+    }
+}
+
+/*
+ * Hard linking to a reference bumps its ctime, which would otherwise make
+ * the next run discard the reference's digest. Called after cpdd links to a
+ * reference; the new ctime is only taken when nothing else has changed.
+ */
+void refresh_reference_ctime(sorted_file_info_t *ref_files, const reference_t *ref) {
+    file_table_t *files = &ref_files->files;
+    struct stat st;
+
+    if (ref->row < 0 || !files->times || stat(ref->path, &st) != 0) {
+        return;
+    }
+    lock_reference_row(ref->row);
+    if (st.st_size == files->sizes[ref->row] && st.st_dev == files->devs[ref->row] &&
+        st.st_ino == files->inos[ref->row] &&
+        timespec_equal(&STAT_MTIME(&st), &files->times[ref->row].mtime)) {
+        files->times[ref->row].ctime = STAT_CTIME(&st);
+    }
+    unlock_reference_row(ref->row);
+}
+
+/*
+ * Writes every reference directory and file, with any digest computed
+ * during this run, to the index. The index is written to a temporary file
+ * and renamed into place so an interrupted run never leaves a truncated
+ * index behind.
+ */
+int save_reference_index(const char *index_file, const sorted_file_info_t *ref_files) {
+    static const struct timespec no_time;
+    const file_table_t *files = &ref_files->files;
+    FILE *fp;
+    unsigned char header[INDEX_HEADER_SIZE];
+    unsigned char record[INDEX_FILE_RECORD_SIZE];
+    char *tmp_path;
+    size_t len = strlen(index_file);
+    uint32_t digest_length = (uint32_t)hash_digest_length(ref_files->algorithm);
+    int result = 0;
+
+    tmp_path = malloc(len + 5);
+    if (!tmp_path) {
+        return -1;
+    }
+    snprintf(tmp_path, len + 5, "%s.tmp", index_file);
+
+    fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Warning: Cannot write index %s: %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return -1;
+    }
+
+    memcpy(header, INDEX_MAGIC, 8);
+    put_u32(header + 8, INDEX_VERSION);
+    put_u32(header + 12, (uint32_t)ref_files->algorithm);
+    put_u32(header + 16, digest_length);
+    put_u64(header + 20, (uint64_t)ref_files->files.count);
+    put_u64(header + 28, (uint64_t)ref_files->dir_count);
+    if (fwrite(header, 1, sizeof(header), fp) != sizeof(header)) {
+        result = -1;
+    }
+
+    for (int i = 0; result == 0 && i < ref_files->dir_count; i++) {
+        const dir_info_t *dir = &ref_files->dirs[i];
+        uint32_t path_len = (uint32_t)strlen(dir->path);
+
+        put_metadata(record, dir->dev, dir->ino, &dir->mtime, &dir->ctime);
+        put_u32(record + 40, path_len);
+        if (fwrite(record, 1, INDEX_DIR_RECORD_SIZE, fp) != INDEX_DIR_RECORD_SIZE ||
+            fwrite(dir->path, 1, path_len, fp) != path_len) {
+            result = -1;
+        }
+    }
+
+    for (int i = 0; result == 0 && i < files->count; i++) {
+        const char *name = files->names[i];
+        uint32_t name_len = (uint32_t)strlen(name);
+        int has_fingerprint = (files->flags[i] & FILE_HAS_FINGERPRINT) != 0;
+
+        put_u64(record, (uint64_t)files->sizes[i]);
+        put_metadata(record + 8, files->devs[i], files->inos[i],
+                     files->times ? &files->times[i].mtime : &no_time,
+                     files->times ? &files->times[i].ctime : &no_time);
+        put_u32(record + 48, (uint32_t)files->dir_ids[i]);
+        put_u32(record + 52, ((files->flags[i] & FILE_HAS_DIGEST) ? INDEX_HAS_DIGEST : 0) |
+                             (has_fingerprint ? INDEX_HAS_FINGERPRINT : 0));
+        put_u32(record + 56, name_len);
+        put_u64(record + 60, has_fingerprint ? files->fingerprints[i] : 0);
+
+        if (fwrite(record, 1, INDEX_FILE_RECORD_SIZE, fp) != INDEX_FILE_RECORD_SIZE ||
+            fwrite(files->digests + (size_t)i * files->digest_length, 1, digest_length, fp) != digest_length ||
+            fwrite(name, 1, name_len, fp) != name_len) {
+            result = -1;
+        }
+    }
+
+    if (fclose(fp) != 0) {
+        result = -1;
+    }
+    if (result == 0 && rename(tmp_path, index_file) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        fprintf(stderr, "Warning: Failed to save index %s: %s\n", index_file, strerror(errno));
+        unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    return result;
+}
@@ -24,354 +24,1042 @@
  
 
 #include "cpdd.h"
-#include "md5.h"
-
-/* Determines if two files are bytewise identical. */
-int files_identical(const char *file1, const char *file2) {
-    FILE *f1, *f2;
-    unsigned char buffer1[BUFFER_SIZE], buffer2[BUFFER_SIZE];
-    size_t bytes1, bytes2;
-    int result = 1;
-    
-    f1 = fopen(file1, "rb");
-    f2 = fopen(file2, "rb");
-    
-    if (!f1 || !f2) {
-        if (f1) fclose(f1);
-        if (f2) fclose(f2);
-        return 0;
+#include <pthread.h>
+#include <stdint.h>
+
+/* Matcher threads share the reference index, and fill in its fingerprints
+ * and digests as they go. A stripe of locks, chosen by file, guards those
+ * fields without costing a mutex per reference file. */
+static pthread_mutex_t reference_locks[REFERENCE_LOCK_STRIPES];
+static pthread_once_t reference_locks_once = PTHREAD_ONCE_INIT;
+
+static void init_reference_locks(void) {
+    for (int i = 0; i < REFERENCE_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&reference_locks[i], NULL);
     }
-    
-    do {
-        bytes1 = fread(buffer1, 1, BUFFER_SIZE, f1);
-        bytes2 = fread(buffer2, 1, BUFFER_SIZE, f2);
-        
-        if (bytes1 != bytes2 || memcmp(buffer1, buffer2, bytes1) != 0) {
-            result = 0;
-            break;
-        }
-    } while (bytes1 > 0);
-    
-    fclose(f1);
-    fclose(f2);
-    
-    return result;
 }
 
-/* Efficiently determines if two files are identical.
- * 1. Checks if sizes match (should always be true when called)
- * 2. If both have MD5, compare hashes first, then byte compare if they match
- * 3. If neither needs MD5 (reference file size is unique), just do byte compare
- * 4. If at least one needs MD5, read both files in chunks, updating MD5 as needed,
- *    and comparing bytes until a mismatch is found or EOF is reached.
- * 5. Finalize MD5 for files that need it for futuer comparisons.
- */
-int files_match(file_info_t *ref_file, file_info_t *src_file) {
-    /* Files should always have the same size when this function is called */
-    if (ref_file->size != src_file->size) {
-        fprintf(stderr, "Internal error: files_match called with different sized files\n");
+static pthread_mutex_t *lock_for(uintptr_t key) {
+    pthread_once(&reference_locks_once, init_reference_locks);
+    return &reference_locks[key % REFERENCE_LOCK_STRIPES];
+}
+
+/* Rows of the index are locked by row, files copied during the run by address */
+static pthread_mutex_t *reference_lock(const file_info_t *ref_file) {
+    return lock_for(ref_file->table ? (uintptr_t)ref_file->row
+                                    : (uintptr_t)ref_file / sizeof(file_info_t));
+}
+
+static void lock_reference(const file_info_t *ref_file) {
+    pthread_mutex_lock(reference_lock(ref_file));
+}
+
+static void unlock_reference(const file_info_t *ref_file) {
+    pthread_mutex_unlock(reference_lock(ref_file));
+}
+
+/* Serializes access to a row's digest, fingerprint and metadata */
+void lock_reference_row(int row) {
+    pthread_mutex_lock(lock_for((uintptr_t)row));
+}
+
+void unlock_reference_row(int row) {
+    pthread_mutex_unlock(lock_for((uintptr_t)row));
+}
+
+/* Brings a record loaded from the index up to date with what other
+ * matchers have since learned about its row. The caller holds its lock. */
+static void load_reference(file_info_t *ref_file) {
+    const file_table_t *table = ref_file->table;
+    int row = ref_file->row;
+
+    if (!table) {
+        return;
+    }
+    ref_file->has_digest = (table->flags[row] & FILE_HAS_DIGEST) != 0;
+    if (ref_file->has_digest) {
+        memcpy(ref_file->digest, table->digests + (size_t)row * table->digest_length,
+               table->digest_length);
+    }
+    ref_file->has_fingerprint = (table->flags[row] & FILE_HAS_FINGERPRINT) != 0;
+    ref_file->fingerprint = table->fingerprints[row];
+    ref_file->partial = table->partials ? table->partials[row] : NULL;
+}
+
+/* Publishes a record's digest, fingerprint and deferred hash state to its
+ * row of the index. The caller holds its lock. */
+static void store_reference(const file_info_t *ref_file) {
+    file_table_t *table = ref_file->table;
+    int row = ref_file->row;
+
+    if (!table) {
+        return;
+    }
+    table->flags[row] = (unsigned char)((ref_file->has_digest ? FILE_HAS_DIGEST : 0) |
+                                        (ref_file->has_fingerprint ? FILE_HAS_FINGERPRINT : 0));
+    if (ref_file->has_digest) {
+        memcpy(table->digests + (size_t)row * table->digest_length, ref_file->digest,
+               table->digest_length);
+    }
+    table->fingerprints[row] = ref_file->fingerprint;
+    if (table->partials) {
+        table->partials[row] = ref_file->partial;
+    }
+}
+
+/* Opens a file being matched, unless the caller holds it open already */
+static int open_record(const file_info_t *file) {
+    return file->fd >= 0 ? file->fd : open(file->path, O_RDONLY);
+}
+
+static void close_record(const file_info_t *file, int fd) {
+    if (fd != file->fd) {
+        close(fd);
+    }
+}
+
+/* Hashes a few blocks spread across the file: the first and last blocks,
+ * where headers and trailers live, and evenly spaced samples in between.
+ * Same-sized files that differ anywhere in those blocks are told apart
+ * without reading them in full. The result is cached in the file_info_t. */
+static int compute_fingerprint(file_info_t *file) {
+    unsigned char buffer[FINGERPRINT_BLOCK_SIZE];
+    XXH3_CTX ctx;
+    int fd;
+
+    if (file->has_fingerprint) {
         return 0;
     }
-    
-    /* If both files have MD5, compare hashes first */
-    if (ref_file->has_md5 && src_file->has_md5) {
-        if (memcmp(ref_file->md5, src_file->md5, MD5_DIGEST_LENGTH) != 0) {
-            return 0;
+
+    fd = open_record(file);
+    if (fd < 0) {
+        return -1;
+    }
+
+    XXH3_Init(&ctx);
+    for (int i = 0; i <= FINGERPRINT_SAMPLES + 1; i++) {
+        off_t offset;
+        ssize_t bytes;
+
+        if (i == FINGERPRINT_SAMPLES + 1) {
+            offset = file->size - FINGERPRINT_BLOCK_SIZE;
+        } else {
+            /* Interior samples are block aligned to avoid straddling pages */
+            offset = (file->size / (FINGERPRINT_SAMPLES + 1)) * i;
+            offset -= offset % FINGERPRINT_BLOCK_SIZE;
+        }
+        bytes = pread(fd, buffer, FINGERPRINT_BLOCK_SIZE, offset);
+        if (bytes < 0) {
+            close_record(file, fd);
+            return -1;
         }
-        /* MD5 matches, do byte comparison to be certain */
-        return files_identical(ref_file->path, src_file->path);
+        XXH3_Update(&ctx, buffer, (size_t)bytes);
     }
-    
-    /* If neither file needs MD5 (both unique sizes), just do byte comparison */
-    if (!ref_file->needs_md5 && !src_file->needs_md5) {
-        return files_identical(ref_file->path, src_file->path);
+    close_record(file, fd);
+
+    XXH3_Final(buffer, &ctx);
+    file->fingerprint = 0;
+    for (int i = 0; i < XXH3_DIGEST_LENGTH; i++) {
+        file->fingerprint = (file->fingerprint << 8) | buffer[i];
     }
-    
-    /* At least one file needs MD5 calculation - do it while comparing bytes */
-    FILE *ref_fp = fopen(ref_file->path, "rb");
-    FILE *src_fp = fopen(src_file->path, "rb");
-    if (!ref_fp || !src_fp) {
-        if (ref_fp) fclose(ref_fp);
-        if (src_fp) fclose(src_fp);
-        return 0;
+    file->has_fingerprint = 1;
+
+    return 0;
+}
+
+/* Computes the digest of a source in full. Bytes are read through its
+ * stage, if it has one, so that those already read are not read again and
+ * those read now are kept for the copy. */
+static int hash_source(file_info_t *src_file, hash_algorithm_t algorithm) {
+    unsigned char *buffer = malloc(COMPARE_BLOCK_SIZE);
+    hash_ctx_t ctx;
+    off_t offset = 0;
+    ssize_t bytes;
+    int fd;
+
+    fd = buffer ? open_record(src_file) : -1;
+    if (fd < 0) {
+        free(buffer);
+        return -1;
     }
+    hash_init(&ctx, algorithm);
+    while ((bytes = source_stage_read(src_file->stage, fd, buffer, COMPARE_BLOCK_SIZE, offset)) > 0) {
+        hash_update(&ctx, buffer, (size_t)bytes);
+        offset += bytes;
+    }
+    close_record(src_file, fd);
+    free(buffer);
+    if (bytes < 0) {
+        return -1;
+    }
+    hash_final(&ctx, src_file->digest);
+    return 0;
+}
+
+/* Cheap checks that can rule a same-sized reference out without reading
+ * either file in full: sampled-block fingerprints, then digests. Returns 1
+ * if the files certainly differ (or cannot be read), 0 if they may match.
+ * The reference is locked only while its own fields are read or published,
+ * so other matchers are not held up while either file is read. */
+static int candidate_ruled_out(file_info_t *ref_file, file_info_t *src_file, hash_algorithm_t algorithm) {
+    unsigned char ref_digest[HASH_MAX_DIGEST_LENGTH];
+    int ref_has_digest;
+    int use_fingerprint;
+    uint64_t ref_fingerprint = 0;
     
-    MD5_CTX ref_ctx, src_ctx;
-    int calc_ref_md5 = ref_file->needs_md5 && !ref_file->has_md5;
-    int calc_src_md5 = src_file->needs_md5 && !src_file->has_md5;
-    
-    if (calc_ref_md5) MD5_Init(&ref_ctx);
-    if (calc_src_md5) MD5_Init(&src_ctx);
-    
-    unsigned char ref_buffer[BUFFER_SIZE], src_buffer[BUFFER_SIZE];
-    size_t ref_bytes, src_bytes;
-    int files_match = 1;
+    lock_reference(ref_file);
+    load_reference(ref_file);
+    unlock_reference(ref_file);
+    ref_has_digest = ref_file->has_digest;
+    if (ref_has_digest) {
+        memcpy(ref_digest, ref_file->digest, HASH_MAX_DIGEST_LENGTH);
+    }
     
-    do {
-        ref_bytes = fread(ref_buffer, 1, BUFFER_SIZE, ref_fp);
-        src_bytes = fread(src_buffer, 1, BUFFER_SIZE, src_fp);
-        
-        /* Update MD5 for files that need it */
-        if (calc_ref_md5 && ref_bytes > 0) {
-            MD5_Update(&ref_ctx, ref_buffer, ref_bytes);
-        }
-        if (calc_src_md5 && src_bytes > 0) {
-            MD5_Update(&src_ctx, src_buffer, src_bytes);
+    /* Fingerprints cost a few blocks of reads per file and rule out most
+     * same-sized files, which would otherwise be hashed in full. Files in
+     * a unique size are byte compared, which stops at the first difference
+     * anyway, and small files are cheaper to read outright. */
+    use_fingerprint = (ref_file->needs_digest || src_file->needs_digest) &&
+                      !(ref_has_digest && src_file->has_digest) &&
+                      ref_file->size >= FINGERPRINT_MIN_SIZE;
+    if (use_fingerprint && !ref_file->has_fingerprint) {
+        /* Computed unlocked into this record; should another matcher get
+         * there first, both have read the same blocks and either result
+         * will do. The row is reloaded so its other fields are kept. */
+        if (compute_fingerprint(ref_file) != 0) {
+            return 1;
         }
-        
-        /* Compare bytes, until a mismatch has been found (then just generate MD5) */
-        if (files_match) {
-            if (ref_bytes != src_bytes || memcmp(ref_buffer, src_buffer, ref_bytes) != 0) {
-                files_match = 0;
-                // Don't break here - continue to read to end for MD5 calculation
-            }
+        ref_fingerprint = ref_file->fingerprint;
+        lock_reference(ref_file);
+        load_reference(ref_file);
+        if (!ref_file->has_fingerprint) {
+            ref_file->fingerprint = ref_fingerprint;
+            ref_file->has_fingerprint = 1;
+            store_reference(ref_file);
         }
-    } while (ref_bytes > 0);
+        unlock_reference(ref_file);
+    }
+    ref_fingerprint = ref_file->fingerprint;
     
-    /* Finalize MD5 for files that needed it */
-    if (calc_ref_md5) {
-        MD5_Final(ref_file->md5, &ref_ctx);
-        ref_file->has_md5 = 1;
+    if (use_fingerprint) {
+        if (compute_fingerprint(src_file) != 0 || ref_fingerprint != src_file->fingerprint) {
+            return 1;
+        }
     }
-    if (calc_src_md5) {
-        MD5_Final(src_file->md5, &src_ctx);
-        src_file->has_md5 = 1;
+    
+    /* A digest already known for the reference (e.g. loaded from --index)
+     * lets the source be hashed once and then checked against every
+     * same-sized candidate without reading the references at all */
+    if (ref_has_digest && !src_file->has_digest && ref_file->needs_digest) {
+        if (hash_source(src_file, algorithm) != 0) {
+            return 1;
+        }
+        src_file->has_digest = 1;
     }
     
-    fclose(ref_fp);
-    fclose(src_fp);
+    /* If both files have digests, compare them first */
+    if (ref_has_digest && src_file->has_digest &&
+        memcmp(ref_digest, src_file->digest, hash_digest_length(algorithm)) != 0) {
+        return 1;
+    }
     
-    return files_match;
+    return 0;
+}
+
+/* A reference taking part in a multi-way comparison */
+typedef struct {
+    file_info_t *file;
+    int fd;
+    int live;           /* Identical to the source so far */
+    int hashing;        /* Digest is being computed as the file is read */
+    off_t offset;       /* Bytes read so far */
+    off_t hashed;       /* Bytes fed to ctx so far */
+    hash_ctx_t ctx;
+} candidate_t;
+
+/* Takes a copy of the reference's hash state, if it needs a digest, so the
+ * candidate can be hashed without holding its lock */
+static void start_candidate_hash(candidate_t *c, hash_algorithm_t algorithm) {
+    file_info_t *file = c->file;
+
+    lock_reference(file);
+    load_reference(file);
+    c->hashing = file->needs_digest && !file->has_digest;
+    if (c->hashing && file->partial) {
+        c->ctx = file->partial->ctx;
+        c->hashed = file->partial->hashed;
+    }
+    unlock_reference(file);
+    if (c->hashing && c->hashed == 0) {
+        hash_init(&c->ctx, algorithm);
+    }
+}
+
+/* Publishes a candidate's digest, unless another matcher hashing the same
+ * reference got there first, and drops the deferred state it replaces */
+static void finish_candidate_hash(candidate_t *c) {
+    file_info_t *file = c->file;
+    unsigned char digest[HASH_MAX_DIGEST_LENGTH];
+
+    c->hashing = 0;
+    hash_final(&c->ctx, digest);
+    lock_reference(file);
+    load_reference(file);
+    if (!file->has_digest) {
+        memcpy(file->digest, digest, HASH_MAX_DIGEST_LENGTH);
+        file->has_digest = 1;
+        free(file->partial);
+        file->partial = NULL;
+        store_reference(file);
+    }
+    unlock_reference(file);
+}
+
+/* Stops hashing a candidate part way through, keeping the hash state with
+ * the reference so a later lookup can carry on from the same offset
+ * instead of starting over. The state is only kept if it gets further
+ * than what the reference holds by now. */
+static void defer_candidate_hash(candidate_t *c) {
+    file_info_t *file = c->file;
+
+    c->hashing = 0;
+    lock_reference(file);
+    load_reference(file);
+    if (!file->has_digest && c->hashed > (file->partial ? file->partial->hashed : 0)) {
+        if (!file->partial && !(file->table && !file->table->partials)) {
+            file->partial = malloc(sizeof(partial_hash_t));
+        }
+        if (file->partial) {
+            file->partial->ctx = c->ctx;
+            file->partial->hashed = c->hashed;
+            store_reference(file);
+        }
+    }
+    unlock_reference(file);
 }
 
 /*
- * Helper function to recursively collect file paths and sizes portably across operating systems.
+ * Compares the source against several same-sized references in a single
+ * pass: the source is read once, block by block, and each block is checked
+ * against every candidate still identical to it. Candidates that need a
+ * digest are hashed as they are read, resuming any hash state a previous
+ * lookup deferred. After a mismatch a candidate is normally read on to EOF
+ * so its digest can be finalized for later lookups; with --defer-hash it is
+ * dropped at once unless little of it is left, and its hash state is kept.
+ * References are locked only to take their hash state and to publish what
+ * was hashed, so concurrent lookups never wait on each other's reads; two
+ * lookups hashing one reference both may, and the later one's result is
+ * dropped. Source
+ * blocks come from the stage where it has them and are staged as read.
+ * Returns the first candidate, in order, identical to the source, or NULL.
  */
-static void collect_file_info(const char *ref_dir, const options_t *opts, int *count, file_info_t **head) {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat st;
-    char full_path[MAX_PATH];
-
-    dir = opendir(ref_dir);
-    if (!dir) {
-        return;
+static file_info_t *compare_candidates(file_info_t **files, int count, file_info_t *src,
+                                       const options_t *opts) {
+    const char *src_path = src->path;
+    source_stage_t *stage = src->stage;
+    candidate_t *candidates = calloc(count, sizeof(candidate_t));
+    io_request_t *requests;
+    unsigned char *buffers;
+    unsigned char *src_buffer;
+    io_ring_t *ring = io_ring_thread(opts);
+    file_info_t *match = NULL;
+    off_t src_offset = 0;
+    int src_eof = 0;            /* Past the source's end, src_bytes is 0 */
+    int src_fd = -1;
+    int active = 0;
+
+    /* Nothing to hash: a plain two-file comparison can map both files,
+     * unless the source is to be staged for its copy */
+    int nothing_to_hash = 0;
+    if (count == 1 && !stage) {
+        lock_reference(files[0]);
+        load_reference(files[0]);
+        nothing_to_hash = !files[0]->needs_digest || files[0]->has_digest;
+        unlock_reference(files[0]);
     }
-    
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    if (nothing_to_hash) {
+        off_t difference;
+        int ref_fd = open(files[0]->path, O_RDONLY);
+        int result = -1;
+        src_fd = ref_fd >= 0 ? open_record(src) : -1;
+        if (src_fd >= 0) {
+            result = opts->mmap_compare ? compare_fds_mapped(ref_fd, src_fd, &difference)
+                                        : compare_fds(ref_fd, src_fd, &difference);
+            close_record(src, src_fd);
         }
-        
-        snprintf(full_path, sizeof(full_path), "%s/%s", ref_dir, entry->d_name);
-        
-        if (stat(full_path, &st) != 0) {
+        if (ref_fd >= 0) {
+            close(ref_fd);
+        }
+        free(candidates);
+        if (result == 0 && opts->verbose == 3) {
+            printf("%s differs from %s at byte %lld\n", src_path, files[0]->path, (long long)difference);
+        }
+        return result == 1 ? files[0] : NULL;
+    }
+
+    buffers = malloc((size_t)(count + 1) * COMPARE_BLOCK_SIZE);
+    requests = malloc((size_t)(count + 1) * sizeof(io_request_t));
+    if (!candidates || !buffers || !requests) {
+        fprintf(stderr, "Error: Memory allocation failed comparing %s\n", src_path);
+        free(candidates);
+        free(buffers);
+        free(requests);
+        return NULL;
+    }
+    src_buffer = buffers + (size_t)count * COMPARE_BLOCK_SIZE;
+
+    src_fd = open_record(src);
+    if (src_fd < 0) {
+        free(candidates);
+        free(buffers);
+        free(requests);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; i++) {
+        candidate_t *c = &candidates[i];
+        c->file = files[i];
+        c->fd = open(c->file->path, O_RDONLY);
+        if (c->fd < 0) {
             continue;
         }
-        
-        if (S_ISDIR(st.st_mode)) {
-            collect_file_info(full_path, opts, count, head);
-        } else if (S_ISREG(st.st_mode)) {
-            file_info_t *new_file = malloc(sizeof(file_info_t));
-            if (!new_file) {
+        c->live = 1;
+        start_candidate_hash(c, opts->hash_algorithm);
+        active++;
+    }
+
+    while (active > 0) {
+        ssize_t src_bytes = 0;
+        int request_count = 0;
+        int src_staged = stage && src_offset < (off_t)stage->length;
+        int src_needed = stage && (size_t)src_offset < stage->capacity;
+        int src_queued = 0;
+
+        for (int i = 0; !src_needed && i < count; i++) {
+            src_needed = candidates[i].fd >= 0 && candidates[i].live;
+        }
+        src_needed = src_needed && !src_eof;
+
+        /* Read the next block of the source and of every candidate still
+         * being read together, so an io_uring backend has them all in
+         * flight; a block of the source already staged is not read again.
+         * Once every candidate has differed and only reference hashes are
+         * being finished, the source is read no further than its stage
+         * can keep for the copy. */
+        if (src_needed && src_staged) {
+            src_bytes = source_stage_read(stage, src_fd, src_buffer, COMPARE_BLOCK_SIZE, src_offset);
+        } else if (src_needed) {
+            requests[0].fd = src_fd;
+            requests[0].buffer = src_buffer;
+            requests[0].length = COMPARE_BLOCK_SIZE;
+            requests[0].offset = src_offset;
+            request_count = 1;
+            src_queued = 1;
+        }
+        for (int i = 0; i < count; i++) {
+            candidate_t *c = &candidates[i];
+            if (c->fd >= 0 && (c->live || c->hashing)) {
+                requests[request_count].fd = c->fd;
+                requests[request_count].buffer = buffers + (size_t)i * COMPARE_BLOCK_SIZE;
+                requests[request_count].length = COMPARE_BLOCK_SIZE;
+                requests[request_count].offset = c->offset;
+                request_count++;
+            }
+        }
+        read_requests(ring, requests, request_count);
+        if (src_queued) {
+            src_bytes = requests[0].result;
+            if (src_bytes > 0) {
+                source_stage_add(stage, src_buffer, (size_t)src_bytes, src_offset);
+            }
+        }
+        if (src_bytes > 0) {
+            src_offset += src_bytes;
+        } else if (src_needed && src_bytes == 0) {
+            src_eof = 1;
+        }
+
+        active = 0;
+        for (int i = 0, r = src_queued; i < count; i++) {
+            candidate_t *c = &candidates[i];
+            unsigned char *buffer = buffers + (size_t)i * COMPARE_BLOCK_SIZE;
+            ssize_t bytes;
+
+            if (c->fd < 0 || (!c->live && !c->hashing)) {
                 continue;
             }
-            // Display the file that is being added
-            if (opts->verbose == 3) {
-                // Cast off_t to long long to avoid cross-platform format specifier issues
-                printf("Adding reference file: %s (size: %lld bytes)\n", full_path, (long long)st.st_size);
+
+            bytes = requests[r++].result;
+            if (bytes < 0) {
+                c->live = 0;
+                c->hashing = 0;
+                continue;
             }
 
-            new_file->path = strdup(full_path);
-            new_file->size = st.st_size;
+            /* Only bytes beyond a resumed hash state are new to the hash */
+            if (c->hashing && c->offset + bytes > c->hashed) {
+                off_t skip = c->hashed - c->offset;
+                hash_update(&c->ctx, buffer + skip, (size_t)(bytes - skip));
+                c->hashed = c->offset + bytes;
+            }
+            c->offset += bytes;
+
+            if (c->live && (src_bytes < 0 || bytes != src_bytes ||
+                            compare_buffers(buffer, src_buffer, (size_t)bytes) != (size_t)bytes)) {
+                c->live = 0;
+                if (c->hashing && opts->defer_hash &&
+                    c->file->size - c->hashed > DEFER_HASH_MIN_REMAINING) {
+                    defer_candidate_hash(c);
+                }
+            }
 
-            /* MD5 will be calculated lazily during comparison */
-            memset(new_file->md5, 0, MD5_DIGEST_LENGTH);
-            new_file->needs_md5 = 0; /* Will be set later */
-            new_file->has_md5 = 0;   /* No MD5 calculated yet */
-            
-            new_file->next = *head;
-            *head = new_file;
-            (*count)++;
+            if (bytes == 0) {
+                /* EOF: a candidate still live here has matched the whole source */
+                if (c->hashing) {
+                    finish_candidate_hash(c);
+                }
+            } else if (c->live || c->hashing) {
+                active++;
+            }
         }
     }
-    
-    closedir(dir);
-    if (opts->verbose == 1) {
-        print_status_update("\rScanned %d reference files in", *count, ref_dir);
-        fflush(stdout);
+
+    for (int i = 0; i < count; i++) {
+        if (candidates[i].live && !match) {
+            match = candidates[i].file;
+        }
+        if (candidates[i].fd >= 0) {
+            close(candidates[i].fd);
+        }
     }
+    close_record(src, src_fd);
+    free(candidates);
+    free(buffers);
+    free(requests);
+
+    return match;
 }
 
 /*
  * Sorted array functions for file info objects
  */
 
-static sorted_file_info_t *sorted_file_info_init(int initial_capacity) {
+/* Wraps a table of files, already sorted, in a new index */
+static sorted_file_info_t *sorted_file_info_init(const file_table_t *files, hash_algorithm_t algorithm) {
     sorted_file_info_t *list = malloc(sizeof(sorted_file_info_t));
     if (!list) return NULL;
-    list->files = malloc(sizeof(file_info_t *) * initial_capacity);
-    if (!list->files) {
-        free(list);
-        return NULL;
-    }
-    list->count = 0;
-    list->capacity = initial_capacity;
+    list->files = *files;
+    list->dirs = NULL;
+    list->dir_count = 0;
+    list->algorithm = algorithm;
+    list->size_index = NULL;
+    list->size_index_mask = 0;
+    list->size_directory = NULL;
+    list->size_directory_count = 0;
+    list->live = NULL;
+    list->live_buckets = 0;
+    list->live_count = 0;
+    pthread_rwlock_init(&list->live_lock, NULL);
+    list->link_device = 0;
+    list->link_device_only = 0;
     return list;
 }
 
-static int compare_file_info_size(const void *a, const void *b) {
-    file_info_t *file_a = *(file_info_t **)a;
-    file_info_t *file_b = *(file_info_t **)b;
-    return (file_a->size > file_b->size) - (file_a->size < file_b->size);
+/* Returns an empty index, for runs that only deduplicate their own copies */
+sorted_file_info_t *create_reference_index(const options_t *opts) {
+    file_table_t files;
+
+    file_table_init(&files, hash_digest_length(opts->hash_algorithm), 0);
+    return sorted_file_info_init(&files, opts->hash_algorithm);
 }
 
+/* Returns the full path of a row of the index, newly allocated */
+char *reference_path(const sorted_file_info_t *ref_files, int row) {
+    return join_path(ref_files->dirs[ref_files->files.dir_ids[row]].path, ref_files->files.names[row]);
+}
+
+/* Spreads file sizes, which cluster at round numbers, over a table index */
+size_t size_hash(off_t size) {
+    uint64_t h = (uint64_t)size * UINT64_C(0x9E3779B97F4A7C15);
+    return (size_t)(h ^ (h >> 29));
+}
+
+/*
+ * Builds the table from file size to the run of files of that size in the
+ * sorted array. Slots are 16 bytes and probed linearly, so a lookup touches
+ * one or two cache lines instead of the log2(count) a binary search over
+ * the sizes visits. The table is kept at most half full.
+ * Returns -1 if it cannot be allocated; lookups then binary search.
+ */
+int build_size_index(sorted_file_info_t *ref_files) {
+    const off_t *sizes = ref_files->files.sizes;
+    int count = ref_files->files.count;
+    size_t distinct = 0;
+    size_t slots = 16;
+
+    for (int i = 0; i < count; i++) {
+        if (i == 0 || sizes[i] != sizes[i - 1]) {
+            distinct++;
+        }
+    }
+    while (slots < distinct * 2) {
+        slots *= 2;
+    }
+
+    free(ref_files->size_index);
+    ref_files->size_index = calloc(slots, sizeof(size_slot_t));
+    if (!ref_files->size_index) {
+        ref_files->size_index_mask = 0;
+        return -1;
+    }
+    ref_files->size_index_mask = slots - 1;
+
+    for (int i = 0; i < count; ) {
+        off_t size = sizes[i];
+        int first = i;
+        size_t slot = size_hash(size) & ref_files->size_index_mask;
+
+        while (i < count && sizes[i] == size) {
+            i++;
+        }
+        while (ref_files->size_index[slot].count != 0) {
+            slot = (slot + 1) & ref_files->size_index_mask;
+        }
+        ref_files->size_index[slot].size = size;
+        ref_files->size_index[slot].first = first;
+        ref_files->size_index[slot].count = i - first;
+    }
 
-static int sorted_file_info_add(sorted_file_info_t *list, file_info_t *file) {
-    /* Resize if needed */
-    if (list->count >= list->capacity) {
-        list->capacity *= 2;
-        file_info_t **new_files = realloc(list->files, sizeof(file_info_t *) * list->capacity);
-        if (!new_files) {
-            fprintf(stderr, "Warning: Memory allocation failed, some files may not be processed\n");
-            return -1; /* Failed to resize */
+    return 0;
+}
+
+/*
+ * Builds the directory of a table spilled to disk, whose sizes are too
+ * many to be hashed in memory: the first size of every
+ * SIZE_DIRECTORY_STRIDE rows, 8 bytes per stride. A lookup searches it
+ * without touching the table, then binary searches only the stretch of the
+ * sizes column it points to, a few pages. Returns -1 if it cannot be
+ * allocated; lookups then binary search the whole column.
+ */
+int build_size_directory(sorted_file_info_t *ref_files) {
+    int count = ref_files->files.count;
+    int entries = (count + SIZE_DIRECTORY_STRIDE - 1) / SIZE_DIRECTORY_STRIDE;
+
+    free(ref_files->size_directory);
+    ref_files->size_directory_count = 0;
+    ref_files->size_directory = malloc(sizeof(off_t) * (entries ? entries : 1));
+    if (!ref_files->size_directory) {
+        return -1;
+    }
+    for (int i = 0; i < entries; i++) {
+        ref_files->size_directory[i] = ref_files->files.sizes[(size_t)i * SIZE_DIRECTORY_STRIDE];
+    }
+    ref_files->size_directory_count = entries;
+    return 0;
+}
+
+/* Finds the run of files of the given size by binary search over the sorted
+ * array, narrowed first through the size directory if there is one.
+ * Returns the number of files, storing the first one's index. */
+int search_size_run(const sorted_file_info_t *ref_files, off_t size, int *first) {
+    const off_t *sizes = ref_files->files.sizes;
+    int left = 0, right = ref_files->files.count - 1;
+    int first_match = -1;
+    int end;
+    
+    if (ref_files->size_directory) {
+        /* The run starts in the last stride whose first size is smaller,
+         * or at the start of the next */
+        int low = 0, high = ref_files->size_directory_count;
+        while (low < high) {
+            int mid = low + (high - low) / 2;
+            if (ref_files->size_directory[mid] < size) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if (low > 0) {
+            left = (low - 1) * SIZE_DIRECTORY_STRIDE;
+        }
+        if (low < ref_files->size_directory_count) {
+            right = low * SIZE_DIRECTORY_STRIDE;
+        }
+    }
+    
+    while (left <= right) {
+        int mid = left + (right - left) / 2;
+        if (sizes[mid] == size) {
+            first_match = mid;
+            right = mid - 1; /* Continue searching left for first occurrence */
+        } else if (sizes[mid] < size) {
+            left = mid + 1;
+        } else {
+            right = mid - 1;
         }
-        list->files = new_files;
+    }
+    if (first_match == -1) {
+        return 0;
     }
     
-    /* Just add - don't sort yet */
-    list->files[list->count++] = file;
+    end = first_match;
+    while (end < ref_files->files.count && sizes[end] == size) {
+        end++;
+    }
+    *first = first_match;
+    return end - first_match;
+}
+
+/* Finds the run of files of the given size through the size table, or by
+ * binary search if there is none. Returns the number of files, storing the
+ * first one's index. */
+int lookup_size_run(const sorted_file_info_t *ref_files, off_t size, int *first) {
+    size_t slot;
+
+    if (!ref_files->size_index) {
+        return search_size_run(ref_files, size, first);
+    }
+    slot = size_hash(size) & ref_files->size_index_mask;
+    while (ref_files->size_index[slot].count != 0) {
+        if (ref_files->size_index[slot].size == size) {
+            *first = ref_files->size_index[slot].first;
+            return ref_files->size_index[slot].count;
+        }
+        slot = (slot + 1) & ref_files->size_index_mask;
+    }
     return 0;
 }
 
+/* Bucket of the live table for a file size; buckets is a power of two */
+static size_t live_bucket(off_t size, size_t buckets) {
+    return size_hash(size) & (buckets - 1);
+}
 
 /*
- * Recursively scan reference directory and build sorted array of file metadata.
- * Uses lazy MD5 calculation optimization: first pass collects file sizes and marks
- * files that need MD5 (those with duplicate sizes), but doesn't calculate MD5 yet.
- * MD5 is calculated lazily during the first comparison attempt.
- * Returns sorted_file_info_t structure with array of file_info_t pointers, or NULL on error.
+ * Adds a file copied during this run to the index, so that later sources
+ * with the same content are linked to it rather than copied again. Its
+ * digest was computed while it was copied, so it is never read to be
+ * hashed. The sorted array is left alone; copies go into a table of
+ * buckets keyed by size, which can grow while matchers are reading it.
+ */
+int add_live_reference(sorted_file_info_t *ref_files, const char *path, off_t size,
+                       const unsigned char *digest) {
+    file_info_t *file = calloc(1, sizeof(file_info_t));
+    size_t bucket;
+
+    if (!file) {
+        return -1;
+    }
+    file->path = strdup(path);
+    if (!file->path) {
+        free(file);
+        return -1;
+    }
+    file->size = size;
+    file->row = -1;
+    file->fd = -1;
+    memcpy(file->digest, digest, hash_digest_length(ref_files->algorithm));
+    file->needs_digest = 1;
+    file->has_digest = 1;
+
+    pthread_rwlock_wrlock(&ref_files->live_lock);
+    if (ref_files->live_count >= ref_files->live_buckets) {
+        /* Keep chains short: double the table and redistribute */
+        size_t new_buckets = ref_files->live_buckets ? ref_files->live_buckets * 2 : 1024;
+        file_info_t **new_live = calloc(new_buckets, sizeof(file_info_t *));
+        if (new_live) {
+            for (size_t i = 0; i < ref_files->live_buckets; i++) {
+                file_info_t *f = ref_files->live[i];
+                while (f) {
+                    file_info_t *next = f->next;
+                    size_t b = live_bucket(f->size, new_buckets);
+                    f->next = new_live[b];
+                    new_live[b] = f;
+                    f = next;
+                }
+            }
+            free(ref_files->live);
+            ref_files->live = new_live;
+            ref_files->live_buckets = new_buckets;
+        } else if (ref_files->live_buckets == 0) {
+            pthread_rwlock_unlock(&ref_files->live_lock);
+            free(file->path);
+            free(file);
+            return -1;
+        }
+    }
+    bucket = live_bucket(size, ref_files->live_buckets);
+    file->next = ref_files->live[bucket];
+    ref_files->live[bucket] = file;
+    ref_files->live_count++;
+    pthread_rwlock_unlock(&ref_files->live_lock);
+
+    return 0;
+}
+
+/*
+ * Scans the reference directories and builds the index of their files,
+ * held column by column and sorted by size. Uses lazy hashing: only sizes
+ * are gathered here, and digests are calculated during the first
+ * comparison that needs them. Every file sharing its size with another
+ * reference needs one to tell them apart: exactly the files in a run of
+ * more than one. With --prune-references, only files of a size some
+ * source file has are indexed, so runs are counted, and digests needed,
+ * within that set alone. Returns NULL if there are no files or on error.
  */
 sorted_file_info_t *scan_reference_directory(const options_t *opts) {
-    file_info_t *head = NULL;
-    file_info_t *current;
+    file_table_t files;
     sorted_file_info_t *sorted_files;
+    saved_index_t *saved = NULL;
+    size_filter_t *sizes = NULL;
+    dir_info_t *dirs;
+    int dir_count;
+    int result;
     
-    /* First pass: collect all files from all reference directories */
-    int total_files = 0;
+    /* Load the previous run's index so unchanged directories need not be read */
+    if (opts->index_file) {
+        saved = load_saved_index(opts->index_file, opts);
+    }
     
-    for (int i = 0; i < opts->ref_dir_count; i++) {
-        collect_file_info(opts->ref_dirs[i], opts, &total_files, &head);
+    /* Only references the size of some source file can match one, so the
+     * sources' sizes are gathered first, from metadata alone */
+    if (opts->prune_references) {
+        sizes = collect_source_sizes(opts);
     }
     
-    if (!head) {
-        return NULL;
+    result = collect_reference_files(opts, saved, sizes, &files, &dirs, &dir_count);
+    free_saved_index(saved);
+    free_size_filter(sizes);
+    if (result != 0) {
+        fprintf(stderr, "Warning: Memory allocation failed, some files may not be processed\n");
+    }
+    
+    /* Sort once after all files are found; a table merged from disk
+     * already is */
+    if (files.count > 0 && !files.mapping && file_table_sort(&files, dirs) != 0) {
+        fprintf(stderr, "Error: Memory allocation failed sorting the reference index\n");
+        file_table_free(&files);
     }
     
-    /* Initialize sorted array for file info objects */
-    sorted_files = sorted_file_info_init(total_files);
+    sorted_files = files.count > 0 ? sorted_file_info_init(&files, opts->hash_algorithm) : NULL;
     if (!sorted_files) {
-        free_file_list(head);
+        file_table_free(&files);
+        free_dir_info(dirs, dir_count);
         return NULL;
     }
+    sorted_files->dirs = dirs;
+    sorted_files->dir_count = dir_count;
     
-    /* Add all files to array */
-    current = head;
-    while (current) {
-        file_info_t *next = current->next;
-        current->next = NULL; /* Break the linked list connection */
-        if (sorted_file_info_add(sorted_files, current) != 0) {
-            /* Memory allocation failed - free remaining files and continue with what we have */
-            while (current) {
-                file_info_t *temp = current->next;
-                free(current->path);
-                free(current);
-                current = temp;
-            }
-            break;
-        }
-        current = next;
+    /* Hash states are kept per file only when they may be deferred; a
+     * table merged from disk has room for them already */
+    if (opts->defer_hash && !sorted_files->files.partials) {
+        sorted_files->files.partials = calloc(sorted_files->files.count, sizeof(partial_hash_t *));
     }
-    /* Don't free anything - the file_info_t objects are now owned by sorted_files */
-
-    /* Sort once after all files are added */
-    qsort(sorted_files->files, sorted_files->count, sizeof(file_info_t *), compare_file_info_size);
-
-    /* Mark files that need MD5 by checking for duplicate sizes in sorted array */
-    for (int i = 0; i < sorted_files->count; i++) {
-        file_info_t *file = sorted_files->files[i];
-        file->needs_md5 = 0; /* Default to not needing MD5 */
-        
-        /* Check if this file has the same size as the previous or next file */
-        if (i > 0 && file->size == sorted_files->files[i - 1]->size) {
-            file->needs_md5 = 1;
-            /* Also mark the previous file if not already marked */
-            if (!sorted_files->files[i - 1]->needs_md5) {
-                sorted_files->files[i - 1]->needs_md5 = 1;
-            }
-        } else if (i + 1 < sorted_files->count && file->size == sorted_files->files[i + 1]->size) {
-            file->needs_md5 = 1;
-        }
+    
+    /* Lookups binary search the array if the table cannot be allocated.
+     * A table spilled to disk gets only a sparse directory of its sizes,
+     * so the memory kept does not grow with the number of sizes. */
+    if (sorted_files->files.mapping) {
+        build_size_directory(sorted_files);
+    } else {
+        build_size_index(sorted_files);
     }
     
     return sorted_files;
 }
 
-file_info_t *find_matching_file(sorted_file_info_t *ref_files, const char *src_file, const options_t *opts) {
-    struct stat st;
+/* Number of files copied so far in this run that have been added to the
+ * index; when it has not moved, a second lookup cannot find anything new */
+size_t live_reference_count(sorted_file_info_t *ref_files) {
+    size_t count;
 
-    if (stat(src_file, &st) != 0) {
-        fprintf(stderr, "Error: Cannot stat source file %s\n", src_file);
-        return NULL;
+    pthread_rwlock_rdlock(&ref_files->live_lock);
+    count = ref_files->live_count;
+    pthread_rwlock_unlock(&ref_files->live_lock);
+    return count;
+}
+
+/* Spreads (device, inode) pairs over a table index */
+static size_t inode_hash(dev_t dev, ino_t ino) {
+    uint64_t h = ((uint64_t)ino ^ ((uint64_t)dev << 32)) * UINT64_C(0x9E3779B97F4A7C15);
+    return (size_t)(h ^ (h >> 29));
+}
+
+/* Records records[index] in an open-addressing set of the inodes in a run,
+ * unless an earlier record has the same inode. Returns 1 if one has. */
+static int inode_seen(int *slots, size_t mask, const file_info_t *records, int index) {
+    const file_info_t *record = &records[index];
+    size_t slot = inode_hash(record->dev, record->ino) & mask;
+
+    while (slots[slot] >= 0) {
+        const file_info_t *other = &records[slots[slot]];
+        if (other->dev == record->dev && other->ino == record->ino) {
+            return 1;
+        }
+        slot = (slot + 1) & mask;
     }
+    slots[slot] = index;
+    return 0;
+}
 
+/* Looks src_file, described by src_st and read through src_fd (or its
+ * path if -1), up among the reference files (when with_references is set)
+ * and the files copied earlier in the run. What is read of the source
+ * goes into stage, if not NULL. Returns 1 and describes the identical file
+ * in *result if there is one, 0 otherwise. */
+static int find_match(sorted_file_info_t *ref_files, const char *src_file, int src_fd,
+                      const struct stat *src_st, source_stage_t *stage, const options_t *opts,
+                      int with_references, reference_t *result) {
     /* Create file_info_t structure for source file */
     file_info_t src_info;
+    memset(&src_info, 0, sizeof(src_info));
     src_info.path = (char *)src_file; /* Cast away const - we won't modify it */
-    src_info.size = st.st_size;
-    memset(src_info.md5, 0, MD5_DIGEST_LENGTH);
-    src_info.needs_md5 = 0; /* Will be set based on reference files */
-    src_info.has_md5 = 0;
-    src_info.next = NULL;
-
-    /* Binary search for the first file with matching size */
-    int left = 0, right = ref_files->count - 1;
-    int first_match = -1;
+    src_info.size = src_st->st_size;
+    src_info.dev = src_st->st_dev;
+    src_info.ino = src_st->st_ino;
+    src_info.row = -1;
+    src_info.stage = stage;
+    src_info.fd = src_fd;
+
+    /* The run of same-sized files in the sorted references, if any */
+    int first_match = 0;
+    int run = 0;
+    if (with_references) {
+        run = lookup_size_run(ref_files, src_st->st_size, &first_match);
+    }
+    int total = run;
     
-    while (left <= right) {
-        int mid = left + (right - left) / 2;
-        if (ref_files->files[mid]->size == st.st_size) {
-            first_match = mid;
-            right = mid - 1; /* Continue searching left for first occurrence */
-        } else if (ref_files->files[mid]->size < st.st_size) {
-            left = mid + 1;
-        } else {
-            right = mid - 1;
+    /* Files copied earlier in this run are candidates too. Their records
+     * are never freed before the run ends, so they can be used after the
+     * table is unlocked. */
+    pthread_rwlock_rdlock(&ref_files->live_lock);
+    size_t bucket = ref_files->live_buckets ? live_bucket(src_st->st_size, ref_files->live_buckets) : 0;
+    if (ref_files->live_buckets) {
+        for (file_info_t *f = ref_files->live[bucket]; f; f = f->next) {
+            total += f->size == src_st->st_size;
         }
     }
     
     /* No files with matching size found */
-    if (first_match == -1) {
-        return NULL;
+    if (total == 0) {
+        pthread_rwlock_unlock(&ref_files->live_lock);
+        return 0;
     }
     
-    /* Check all files with the same size starting from first_match */
-    for (int i = first_match; i < ref_files->count && ref_files->files[i]->size == st.st_size; i++) {
-        file_info_t *current = ref_files->files[i];
+    /* Rows of the index are matched through working records, which take
+     * their digests and fingerprints from the row under its lock. Only
+     * here, for files of the right size, are their full paths put
+     * together. Rows that cannot be linked from the destination's device
+     * are passed over, rows that are hard links to one file are a single
+     * candidate, and a row that is the source's own inode is a match
+     * without reading either. */
+    file_info_t **candidates = malloc(sizeof(file_info_t *) * total);
+    file_info_t *records = calloc(run ? run : 1, sizeof(file_info_t));
+    file_info_t *same = NULL;
+    size_t slot_count = 1;
+    while (slot_count < (size_t)run * 2) {
+        slot_count <<= 1;
+    }
+    /* Without the set, links are merely compared more than once */
+    int *slots = run > 1 ? malloc(slot_count * sizeof(int)) : NULL;
+    if (slots) {
+        memset(slots, -1, slot_count * sizeof(int));
+    }
+    int kept = 0;
+    int failed = !candidates || !records;
+    for (int i = 0; !failed && !same && i < run; i++) {
+        file_info_t *record = &records[kept];
+        int row = first_match + i;
+        record->dev = ref_files->files.devs[row];
+        record->ino = ref_files->files.inos[row];
+        if (ref_files->link_device_only && record->dev != ref_files->link_device) {
+            continue;
+        }
+        if (slots && inode_seen(slots, slot_count - 1, records, kept)) {
+            continue;
+        }
+        record->path = reference_path(ref_files, row);
+        failed = !record->path;
+        record->size = ref_files->files.sizes[row];
+        record->table = &ref_files->files;
+        record->row = row;
+        record->fd = -1;
+        candidates[kept++] = record;
+        if (record->dev == src_st->st_dev && record->ino == src_st->st_ino) {
+            same = record;
+        }
+    }
+    free(slots);
+    for (int i = 0; i < kept; i++) {
+        records[i].needs_digest = kept > 1;
+    }
+    int n = kept;
+    if (!failed && !same && ref_files->live_buckets) {
+        for (file_info_t *f = ref_files->live[bucket]; f; f = f->next) {
+            if (f->size == src_st->st_size) {
+                candidates[n++] = f;
+            }
+        }
+    }
+    total = n;
+    pthread_rwlock_unlock(&ref_files->live_lock);
+    if (failed) {
+        fprintf(stderr, "Error: Memory allocation failed comparing %s\n", src_file);
+        total = 0;
+    } else if (same) {
+        total = 0;
+    }
+    
+    /* Narrow the same-sized files down with fingerprints and known digests */
+    int candidate_count = 0;
+    for (int i = 0; i < total; i++) {
+        file_info_t *current = candidates[i];
         
-        /* Set source file needs_md5 based on reference file */
-        src_info.needs_md5 = current->needs_md5;
+        /* Set source file needs_digest based on reference file */
+        src_info.needs_digest = current->needs_digest;
         
-        /* Use our new files_match function */
-        if (files_match(current, &src_info)) {
-            if (opts->verbose) {
-                printf("Match found: %s matches %s\n", src_file, current->path);
-            }
-            return current;
+        if (!candidate_ruled_out(current, &src_info, opts->hash_algorithm)) {
+            candidates[candidate_count++] = current;
         }
     }
+    
+    /* Compare the remaining candidates against the source in one pass,
+     * in batches to bound the open descriptors */
+    file_info_t *match = same;
+    for (int i = 0; !match && i < candidate_count; i += MAX_OPEN_CANDIDATES) {
+        int batch = candidate_count - i < MAX_OPEN_CANDIDATES ? candidate_count - i : MAX_OPEN_CANDIDATES;
+        match = compare_candidates(candidates + i, batch, &src_info, opts);
+    }
+    
+    if (match) {
+        if (opts->verbose) {
+            printf("Match found: %s matches %s\n", src_file, match->path);
+        }
+        result->path = match->table ? match->path : strdup(match->path);
+        result->row = match->table ? match->row : -1;
+    }
+    for (int i = 0; records && i < kept; i++) {
+        if (!match || records[i].path != match->path) {
+            free(records[i].path);
+        }
+    }
+    free(candidates);
+    free(records);
+    
+    return match != NULL && result->path != NULL;
+}
 
-    return NULL;
+int find_matching_file(sorted_file_info_t *ref_files, const char *src_file, int src_fd,
+                       const struct stat *src_st, source_stage_t *stage, const options_t *opts,
+                       reference_t *match) {
+    return find_match(ref_files, src_file, src_fd, src_st, stage, opts, 1, match);
+}
+
+/* Looks src_file up among the files copied so far in the run only */
+int find_live_match(sorted_file_info_t *ref_files, const char *src_file, int src_fd,
+                    const struct stat *src_st, source_stage_t *stage, const options_t *opts,
+                    reference_t *match) {
+    return find_match(ref_files, src_file, src_fd, src_st, stage, opts, 0, match);
 }
 
 void free_file_list(file_info_t *list) {
@@ -381,6 +1069,7 @@ void free_file_list(file_info_t *list) {
     while (current) {
         next = current->next;
         free(current->path);
+        free(current->partial);
         free(current);
         current = next;
     }
@@ -389,15 +1078,26 @@ void free_file_list(file_info_t *list) {
 void free_sorted_file_info(sorted_file_info_t *sorted_files) {
     if (!sorted_files) return;
     
-    /* Free all file_info_t objects */
-    for (int i = 0; i < sorted_files->count; i++) {
-        if (sorted_files->files[i]) {
-            free(sorted_files->files[i]->path);
-            free(sorted_files->files[i]);
-        }
+    /* The reference files go in a few calls, whatever their number */
+    file_table_free(&sorted_files->files);
+    
+    free_dir_info(sorted_files->dirs, sorted_files->dir_count);
+    free(sorted_files->size_index);
+    free(sorted_files->size_directory);
+    
+    /* And the files copied during the run */
+    for (size_t i = 0; i < sorted_files->live_buckets; i++) {
+        free_file_list(sorted_files->live[i]);
     }
+    free(sorted_files->live);
+    pthread_rwlock_destroy(&sorted_files->live_lock);
     
-    /* Free the array of pointers and the structure itself */
-    free(sorted_files->files);
     free(sorted_files);
 }
+
+void free_dir_info(dir_info_t *dirs, int dir_count) {
+    for (int i = 0; i < dir_count; i++) {
+        free(dirs[i].path);
+    }
+    free(dirs);
+}
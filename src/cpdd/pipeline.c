@@ -0,0 +1,247 @@
+/*
+ * cpdd/pipeline.c - Threaded stages connected by bounded queues
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "cpdd.h"
+#include <pthread.h>
+
+/* Bounded queue feeding one stage. Producers block while it is full, so a
+ * slow stage holds back the ones before it instead of letting work pile up
+ * in memory. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    void **items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    int producers;          /* Threads still able to push; 0 closes the queue */
+} stage_queue_t;
+
+typedef struct {
+    pipeline_t *pipeline;
+    int stage;
+} stage_arg_t;
+
+struct pipeline {
+    pipeline_stage_t *stages;
+    stage_queue_t *queues;  /* queues[i] feeds stages[i] */
+    int stage_count;
+    pthread_t *threads;
+    stage_arg_t *args;
+    int thread_count;
+    void *ctx;
+};
+
+static int queue_init(stage_queue_t *q, size_t capacity, int producers) {
+    q->items = malloc(capacity * sizeof(void *));
+    if (!q->items) {
+        return -1;
+    }
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->producers = producers;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+static void queue_destroy(stage_queue_t *q) {
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+}
+
+static void queue_push(stage_queue_t *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Takes the next item, waiting for one if the queue is empty. Returns NULL
+ * once the queue is empty and every producer has finished. */
+static void *queue_pop(stage_queue_t *q) {
+    void *item = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && q->producers > 0) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return item;
+}
+
+/* Called by each producer as it finishes; the last one wakes every
+ * consumer so they can drain the queue and exit */
+static void queue_producer_done(stage_queue_t *q) {
+    pthread_mutex_lock(&q->lock);
+    if (--q->producers == 0) {
+        pthread_cond_broadcast(&q->not_empty);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *stage_main(void *arg) {
+    stage_arg_t *sa = arg;
+    pipeline_t *p = sa->pipeline;
+    int last = sa->stage == p->stage_count - 1;
+    void *item;
+
+    while ((item = queue_pop(&p->queues[sa->stage])) != NULL) {
+        item = p->stages[sa->stage].fn(item, p->ctx);
+        if (item && !last) {
+            queue_push(&p->queues[sa->stage + 1], item);
+        }
+    }
+    if (!last) {
+        queue_producer_done(&p->queues[sa->stage + 1]);
+    }
+    return NULL;
+}
+
+/* Joins every started thread. The input must already be closed. */
+static void pipeline_join(pipeline_t *p) {
+    for (int i = 0; i < p->thread_count; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+}
+
+static void pipeline_free(pipeline_t *p) {
+    for (int i = 0; i < p->stage_count; i++) {
+        if (p->queues[i].items) {
+            queue_destroy(&p->queues[i]);
+        }
+    }
+    free(p->queues);
+    free(p->stages);
+    free(p->threads);
+    free(p->args);
+    free(p);
+}
+
+/*
+ * Starts the given stages, each on its own pool of threads, connected by
+ * queues holding at most queue_capacity items. Items submitted to the
+ * pipeline go through every stage in order; a stage returning NULL drops
+ * the item. Returns NULL if the threads could not be started, in which case
+ * the caller should process items itself.
+ */
+pipeline_t *pipeline_start(const pipeline_stage_t *stages, int stage_count,
+                           size_t queue_capacity, void *ctx) {
+    pipeline_t *p = calloc(1, sizeof(pipeline_t));
+    int total = 0;
+
+    if (!p) {
+        return NULL;
+    }
+    for (int i = 0; i < stage_count; i++) {
+        total += stages[i].threads;
+    }
+    p->stage_count = stage_count;
+    p->ctx = ctx;
+    p->stages = malloc(stage_count * sizeof(pipeline_stage_t));
+    p->queues = calloc(stage_count, sizeof(stage_queue_t));
+    p->threads = malloc(total * sizeof(pthread_t));
+    p->args = malloc(total * sizeof(stage_arg_t));
+    if (!p->stages || !p->queues || !p->threads || !p->args) {
+        pipeline_free(p);
+        return NULL;
+    }
+    memcpy(p->stages, stages, stage_count * sizeof(pipeline_stage_t));
+
+    /* The submitter feeds the first queue; every thread of a stage feeds the next */
+    for (int i = 0; i < stage_count; i++) {
+        if (queue_init(&p->queues[i], queue_capacity, i == 0 ? 1 : stages[i - 1].threads) != 0) {
+            pipeline_free(p);
+            return NULL;
+        }
+    }
+
+    for (int i = 0; i < stage_count; i++) {
+        int started = 0;
+
+        for (int t = 0; t < stages[i].threads; t++) {
+            stage_arg_t *sa = &p->args[p->thread_count];
+            sa->pipeline = p;
+            sa->stage = i;
+            if (pthread_create(&p->threads[p->thread_count], NULL, stage_main, sa) != 0) {
+                break;
+            }
+            p->thread_count++;
+            started++;
+        }
+
+        /* Threads that failed to start will never close the next queue */
+        if (i + 1 < stage_count) {
+            for (int t = started; t < stages[i].threads; t++) {
+                queue_producer_done(&p->queues[i + 1]);
+            }
+        }
+
+        if (started == 0) {
+            /* Nothing would ever drain this stage: wind down what is running */
+            for (int j = i + 1; j < stage_count; j++) {
+                pthread_mutex_lock(&p->queues[j].lock);
+                p->queues[j].producers = 0;
+                pthread_cond_broadcast(&p->queues[j].not_empty);
+                pthread_mutex_unlock(&p->queues[j].lock);
+            }
+            queue_producer_done(&p->queues[0]);
+            pipeline_join(p);
+            pipeline_free(p);
+            return NULL;
+        }
+    }
+
+    return p;
+}
+
+/* Hands an item to the first stage, waiting while its queue is full.
+ * May be called from several threads at once. */
+void pipeline_submit(pipeline_t *p, void *item) {
+    queue_push(&p->queues[0], item);
+}
+
+/* Waits for every submitted item to pass through all stages, then stops
+ * the threads and frees the pipeline */
+void pipeline_finish(pipeline_t *p) {
+    queue_producer_done(&p->queues[0]);
+    pipeline_join(p);
+    pipeline_free(p);
+}
@@ -0,0 +1,646 @@
+/*
+ * cpdd/scan.c - Directory traversal and reference scanning
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* statx() and the dirent d_type constants are extensions beyond POSIX */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#elif defined(__APPLE__)
+#define _DARWIN_C_SOURCE
+#endif
+
+#include "cpdd.h"
+#include <pthread.h>
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
+
+/* Files a worker adds between checks of its list against its share of
+ * --max-index-memory */
+#define SPILL_CHECK_INTERVAL 4096
+
+/* Files and directories collected by a single scan worker */
+typedef struct {
+    file_table_t files;
+    dir_info_t *dirs;
+    int dir_count;
+    int dir_capacity;
+} scan_list_t;
+
+/* Set of file sizes: open addressing, kept at most half full. Sizes are
+ * never negative, so -1 marks an empty slot. */
+struct size_filter {
+    off_t *slots;
+    size_t mask;
+    size_t count;
+};
+
+/* State shared by the workers listing the sizes of source files */
+typedef struct {
+    const options_t *opts;
+    size_filter_t *filters;     /* One per worker, merged at the end */
+    int *failed;                /* Per worker: a size could not be added */
+} size_walk_t;
+
+/* State shared by all scan workers */
+typedef struct {
+    const options_t *opts;
+    const size_filter_t *sizes; /* Sizes of the source files, or NULL to keep all */
+    scan_list_t *lists;         /* One list per worker, merged at the end */
+    saved_index_t *saved;       /* Index from a previous run, or NULL */
+    time_t scan_start;          /* When the scan began */
+    pthread_mutex_t progress_lock;
+    int total_files;            /* Running total for progress output */
+    int reused_dirs;            /* Directories taken unchanged from the index */
+    int pruned_files;           /* Files left out for want of a source of their size */
+    spill_set_t *spill;         /* Where lists outgrowing list_memory go, or NULL */
+    size_t list_memory;         /* Each worker's share of --max-index-memory */
+} scan_state_t;
+
+/* Where a worker pushes subdirectories found in the saved index */
+typedef struct {
+    work_pool_t *pool;
+    int worker;
+} subdir_target_t;
+
+/*
+ * Returns the file type of a directory entry from d_type, without a stat.
+ * Returns 0 when the filesystem does not report a type, or for symbolic
+ * links, which must be stat'ed to find out what they point at.
+ */
+mode_t dirent_mode(const struct dirent *entry) {
+#ifdef DT_DIR
+    switch (entry->d_type) {
+        case DT_DIR:  return S_IFDIR;
+        case DT_REG:  return S_IFREG;
+        case DT_FIFO: return S_IFIFO;
+        case DT_CHR:  return S_IFCHR;
+        case DT_BLK:  return S_IFBLK;
+        case DT_SOCK: return S_IFSOCK;
+        default:      return 0;
+    }
+#else
+    (void)entry;
+    return 0;
+#endif
+}
+
+/*
+ * Stats name relative to dirfd, following symbolic links. On Linux this uses
+ * statx() to request only the fields the walkers and reference index need.
+ */
+int stat_entry(int dirfd, const char *name, entry_stat_t *est) {
+    struct stat st;
+
+#if defined(__linux__) && defined(STATX_SIZE)
+    struct statx stx;
+
+    if (statx(dirfd, name, 0, STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_INO |
+              STATX_MTIME | STATX_CTIME, &stx) == 0) {
+        est->mode = stx.stx_mode;
+        est->size = (off_t)stx.stx_size;
+        est->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        est->ino = (ino_t)stx.stx_ino;
+        est->mtime.tv_sec = stx.stx_mtime.tv_sec;
+        est->mtime.tv_nsec = stx.stx_mtime.tv_nsec;
+        est->ctime.tv_sec = stx.stx_ctime.tv_sec;
+        est->ctime.tv_nsec = stx.stx_ctime.tv_nsec;
+        return 0;
+    }
+    if (errno != ENOSYS) {
+        return -1;
+    }
+#endif
+
+    if (fstatat(dirfd, name, &st, 0) != 0) {
+        return -1;
+    }
+    est->mode = st.st_mode;
+    est->size = st.st_size;
+    est->dev = st.st_dev;
+    est->ino = st.st_ino;
+    est->mtime = STAT_MTIME(&st);
+    est->ctime = STAT_CTIME(&st);
+    return 0;
+}
+
+/* Returns a newly allocated "dir/name" */
+char *join_path(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+
+    if (path) {
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, name_len + 1);
+    }
+    return path;
+}
+
+static int size_filter_init(size_filter_t *filter, size_t slots) {
+    filter->slots = malloc(sizeof(off_t) * slots);
+    if (!filter->slots) {
+        return -1;
+    }
+    for (size_t i = 0; i < slots; i++) {
+        filter->slots[i] = -1;
+    }
+    filter->mask = slots - 1;
+    filter->count = 0;
+    return 0;
+}
+
+/* Adds size to the set, doubling it when half full. Returns -1 if out of
+ * memory. */
+static int size_filter_add(size_filter_t *filter, off_t size) {
+    size_t slot;
+
+    if ((filter->count + 1) * 2 > filter->mask + 1) {
+        size_filter_t grown;
+
+        if (size_filter_init(&grown, (filter->mask + 1) * 2) != 0) {
+            return -1;
+        }
+        for (size_t i = 0; i <= filter->mask; i++) {
+            if (filter->slots[i] >= 0) {
+                size_filter_add(&grown, filter->slots[i]);
+            }
+        }
+        free(filter->slots);
+        *filter = grown;
+    }
+    slot = size_hash(size) & filter->mask;
+    while (filter->slots[slot] >= 0) {
+        if (filter->slots[slot] == size) {
+            return 0;
+        }
+        slot = (slot + 1) & filter->mask;
+    }
+    filter->slots[slot] = size;
+    filter->count++;
+    return 0;
+}
+
+/* Whether some source file has the given size */
+int size_filter_contains(const size_filter_t *filter, off_t size) {
+    size_t slot = size_hash(size) & filter->mask;
+
+    while (filter->slots[slot] >= 0) {
+        if (filter->slots[slot] == size) {
+            return 1;
+        }
+        slot = (slot + 1) & filter->mask;
+    }
+    return 0;
+}
+
+void free_size_filter(size_filter_t *filter) {
+    if (filter) {
+        free(filter->slots);
+        free(filter);
+    }
+}
+
+/* Lists one source directory, adding the size of each regular file to the
+ * worker's set. Entries are told apart as the copy walk tells them apart,
+ * so the sizes are those of the files it will find. */
+static void size_source_dir(work_pool_t *pool, int worker, void *item, void *ctx) {
+    size_walk_t *walk = ctx;
+    char *path = item;
+    struct dirent *entry;
+    entry_stat_t est;
+    DIR *dir;
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+
+    dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+    if (!dir) {
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        free(path);
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        est.mode = dirent_mode(entry);
+        if (est.mode == 0 || est.mode == S_IFREG) {
+            if (stat_entry(dir_fd, entry->d_name, &est) != 0) {
+                continue;
+            }
+        }
+        if (S_ISDIR(est.mode) && walk->opts->recursive) {
+            char *subdir = join_path(path, entry->d_name);
+            if (subdir) {
+                work_pool_push(pool, worker, subdir);
+            } else {
+                walk->failed[worker] = 1;
+            }
+        } else if (S_ISREG(est.mode) && size_filter_add(&walk->filters[worker], est.size) != 0) {
+            walk->failed[worker] = 1;
+        }
+    }
+    closedir(dir);
+    free(path);
+}
+
+/*
+ * Finds the size of every file the sources name, walking them as the copy
+ * will (directories given as sources are always listed, their
+ * subdirectories only with -R), with --walk-threads workers. Only a stat
+ * per file is needed, no reads. Returns NULL if the set cannot be built
+ * in full, in which case nothing should be pruned.
+ */
+size_filter_t *collect_source_sizes(const options_t *opts) {
+    int nthreads = opts->walk_threads > 0 ? opts->walk_threads : 1;
+    size_filter_t *sizes = malloc(sizeof(size_filter_t));
+    void **roots = malloc(sizeof(void *) * (opts->source_count ? opts->source_count : 1));
+    size_walk_t walk;
+    int root_count = 0;
+    int failed = 0;
+
+    walk.opts = opts;
+    walk.filters = calloc(nthreads, sizeof(size_filter_t));
+    walk.failed = calloc(nthreads, sizeof(int));
+    if (!sizes || !roots || !walk.filters || !walk.failed || size_filter_init(sizes, 64) != 0) {
+        failed = 1;
+    }
+    for (int i = 0; !failed && i < nthreads; i++) {
+        failed = size_filter_init(&walk.filters[i], 64) != 0;
+    }
+
+    for (int i = 0; !failed && i < opts->source_count; i++) {
+        struct stat st;
+
+        if (stat(opts->sources[i], &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            char *root = strdup(opts->sources[i]);
+            failed = !root;
+            if (root) {
+                roots[root_count++] = root;
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            failed = size_filter_add(sizes, st.st_size) != 0;
+        }
+    }
+
+    if (!failed && root_count > 0 && work_pool_run(nthreads, roots, root_count, size_source_dir, &walk) != 0) {
+        failed = 1;
+        for (int i = 0; i < root_count; i++) {
+            free(roots[i]);
+        }
+    }
+    for (int i = 0; walk.filters && i < nthreads; i++) {
+        failed |= walk.failed[i];
+        for (size_t j = 0; !failed && walk.filters[i].slots && j <= walk.filters[i].mask; j++) {
+            if (walk.filters[i].slots[j] >= 0) {
+                failed = size_filter_add(sizes, walk.filters[i].slots[j]) != 0;
+            }
+        }
+        free(walk.filters[i].slots);
+    }
+    free(walk.filters);
+    free(walk.failed);
+    free(roots);
+
+    if (failed) {
+        fprintf(stderr, "Warning: Memory allocation failed, reference files will not be pruned\n");
+        if (sizes) {
+            free(sizes->slots);
+            free(sizes);
+        }
+        return NULL;
+    }
+    if (opts->verbose) {
+        printf("Found %zu distinct sizes among the source files\n", sizes->count);
+    }
+    return sizes;
+}
+
+/*
+ * Records a scanned directory in the worker's list, taking ownership of path.
+ * Directories changed within the last couple of seconds may change again
+ * without their timestamps moving, so their ctime is recorded as zero to
+ * make sure the next incremental refresh reads them again.
+ */
+static dir_info_t *scan_list_add_dir(scan_list_t *list, char *path, const struct stat *st, time_t scan_start) {
+    dir_info_t *dir;
+
+    if (list->dir_count == list->dir_capacity) {
+        int new_capacity = list->dir_capacity ? list->dir_capacity * 2 : 64;
+        dir_info_t *new_dirs = realloc(list->dirs, sizeof(dir_info_t) * new_capacity);
+        if (!new_dirs) {
+            return NULL;
+        }
+        list->dirs = new_dirs;
+        list->dir_capacity = new_capacity;
+    }
+
+    dir = &list->dirs[list->dir_count++];
+    dir->path = path;
+    dir->dev = st->st_dev;
+    dir->ino = st->st_ino;
+    dir->mtime = STAT_MTIME(st);
+    dir->ctime = STAT_CTIME(st);
+    if (dir->mtime.tv_sec >= scan_start - 1 || dir->ctime.tv_sec >= scan_start - 1) {
+        dir->ctime.tv_sec = 0;
+        dir->ctime.tv_nsec = 0;
+    }
+    return dir;
+}
+
+/* With --max-index-memory, moves a worker's files to a sorted run on disk
+ * once they take up its share of the limit */
+static void spill_if_full(scan_state_t *state, scan_list_t *list, int worker) {
+    if (state->spill && file_table_memory(&list->files) >= state->list_memory) {
+        spill_table(state->spill, &list->files, list->dirs, worker);
+    }
+}
+
+static void push_saved_subdir(const char *path, void *arg) {
+    subdir_target_t *target = arg;
+    char *subdir = strdup(path);
+
+    if (subdir) {
+        work_pool_push(target->pool, target->worker, subdir);
+    }
+}
+
+/*
+ * Reads a single reference directory, adding its regular files to the
+ * worker's list and handing subdirectories back to the pool. Entries are
+ * stat'ed relative to the directory descriptor, and not at all when d_type
+ * already identifies a subdirectory. When a saved index shows the directory
+ * is unchanged, its recorded entries are used without reading it at all.
+ */
+static void scan_reference_dir(work_pool_t *pool, int worker, void *item, void *ctx) {
+    scan_state_t *state = ctx;
+    scan_list_t *list = &state->lists[worker];
+    const options_t *opts = state->opts;
+    char *ref_dir = item;
+    DIR *dir;
+    int dir_fd;
+    struct stat dir_st;
+    dir_info_t *dir_info;
+    struct dirent *entry;
+    entry_stat_t est;
+    int dir_id;
+    int saved_dir = -1;
+    int added = 0;
+    int pruned = 0;
+
+    dir_fd = open(ref_dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        free(ref_dir);
+        return;
+    }
+    if (fstat(dir_fd, &dir_st) != 0) {
+        close(dir_fd);
+        free(ref_dir);
+        return;
+    }
+
+    /* The directory record owns ref_dir from here on */
+    dir_info = scan_list_add_dir(list, ref_dir, &dir_st, state->scan_start);
+    if (!dir_info) {
+        close(dir_fd);
+        free(ref_dir);
+        return;
+    }
+
+    dir_id = list->dir_count - 1;
+
+    if (state->saved && !opts->full_rescan) {
+        subdir_target_t target = { pool, worker };
+        int before = list->files.count;
+
+        if (saved_index_reuse_dir(state->saved, dir_info, &list->files, dir_id, push_saved_subdir, &target)) {
+            close(dir_fd);
+            spill_if_full(state, list, worker);
+            pthread_mutex_lock(&state->progress_lock);
+            state->total_files += list->files.count - before;
+            state->reused_dirs++;
+            pthread_mutex_unlock(&state->progress_lock);
+            return;
+        }
+    }
+
+    dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return;
+    }
+    if (state->saved) {
+        saved_dir = saved_index_find_dir(state->saved, ref_dir);
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        est.mode = dirent_mode(entry);
+        if (est.mode == 0 || est.mode == S_IFREG) {
+            if (stat_entry(dir_fd, entry->d_name, &est) != 0) {
+                continue;
+            }
+        }
+
+        if (S_ISDIR(est.mode)) {
+            char *subdir = join_path(ref_dir, entry->d_name);
+            if (subdir) {
+                work_pool_push(pool, worker, subdir);
+            }
+        } else if (S_ISREG(est.mode)) {
+            int row;
+
+            /* Only a file the size of some source file can ever match */
+            if (state->sizes && !size_filter_contains(state->sizes, est.size)) {
+                pruned++;
+                continue;
+            }
+            /* The digest will be calculated lazily during comparison */
+            row = file_table_add(&list->files, dir_id, entry->d_name, &est);
+            if (row < 0) {
+                continue;
+            }
+            // Display the file that is being added
+            if (opts->verbose == 3) {
+                // Cast off_t to long long to avoid cross-platform format specifier issues
+                printf("Adding reference file: %s/%s (size: %lld bytes)\n", ref_dir, entry->d_name, (long long)est.size);
+            }
+
+            if (saved_dir >= 0) {
+                saved_index_lookup_digest(state->saved, saved_dir, &list->files, row);
+            }
+            added++;
+            /* Huge directories are not left to overrun the limit */
+            if (added % SPILL_CHECK_INTERVAL == 0) {
+                spill_if_full(state, list, worker);
+            }
+        }
+    }
+
+    closedir(dir);
+    spill_if_full(state, list, worker);
+
+    pthread_mutex_lock(&state->progress_lock);
+    state->total_files += added;
+    state->pruned_files += pruned;
+    if (opts->verbose == 1) {
+        print_status_update("\rScanned %d reference files", state->total_files);
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&state->progress_lock);
+}
+
+/*
+ * Walks every reference directory and fills files, which it initializes,
+ * with the regular files found, storing the directories visited in *dirs.
+ * With --scan-threads greater than one, directories are spread over a
+ * work-stealing pool; the set of files found is the same either way, only
+ * the order differs. If saved is not NULL, unchanged directories are taken
+ * from it and unchanged files keep their digests. If sizes is not NULL,
+ * only files of a size in it are kept. With --max-index-memory,
+ * workers spill their files to sorted runs on disk as they go; if any did,
+ * files is the merge of all the runs, already sorted and mapped from disk.
+ * Returns -1 if out of memory.
+ */
+int collect_reference_files(const options_t *opts, saved_index_t *saved, const size_filter_t *sizes,
+                            file_table_t *files, dir_info_t **dirs, int *dir_count) {
+    scan_state_t state;
+    int nthreads = opts->scan_threads > 0 ? opts->scan_threads : 1;
+    size_t digest_length = hash_digest_length(opts->hash_algorithm);
+    void **roots;
+    int *dir_offsets;
+    int root_count = 0;
+    int total_dirs = 0;
+    int spilled;
+    int result = 0;
+
+    /* Times are only needed to save the index */
+    file_table_init(files, digest_length, opts->index_file != NULL);
+    *dirs = NULL;
+    *dir_count = 0;
+
+    roots = malloc(sizeof(void *) * (opts->ref_dir_count ? opts->ref_dir_count : 1));
+    dir_offsets = malloc(sizeof(int) * nthreads);
+    state.lists = calloc(nthreads, sizeof(scan_list_t));
+    if (!roots || !dir_offsets || !state.lists) {
+        free(roots);
+        free(dir_offsets);
+        free(state.lists);
+        return -1;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        file_table_init(&state.lists[i].files, digest_length, opts->index_file != NULL);
+    }
+    state.opts = opts;
+    state.sizes = sizes;
+    state.saved = saved;
+    state.scan_start = time(NULL);
+    state.total_files = 0;
+    state.reused_dirs = 0;
+    state.pruned_files = 0;
+    state.spill = opts->max_index_memory ? spill_set_create(digest_length, opts->index_file != NULL) : NULL;
+    state.list_memory = opts->max_index_memory / (size_t)nthreads;
+    pthread_mutex_init(&state.progress_lock, NULL);
+
+    for (int i = 0; i < opts->ref_dir_count; i++) {
+        char *root = strdup(opts->ref_dirs[i]);
+        if (root) {
+            roots[root_count++] = root;
+        }
+    }
+
+    if (work_pool_run(nthreads, roots, root_count, scan_reference_dir, &state) != 0) {
+        for (int i = 0; i < root_count; i++) {
+            free(roots[i]);
+        }
+    }
+
+    /* Gather the per-worker directories and tables into one; the files'
+     * names are moved, not copied, and their directory ids renumbered.
+     * Once any worker has spilled, the rest of every table is spilled
+     * too, and the runs merged by directory path once all are known. */
+    for (int i = 0; i < nthreads; i++) {
+        total_dirs += state.lists[i].dir_count;
+    }
+    spilled = state.spill && spill_run_count(state.spill) > 0;
+    *dirs = malloc(sizeof(dir_info_t) * (total_dirs ? total_dirs : 1));
+    if (!*dirs) {
+        result = -1;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        scan_list_t *list = &state.lists[i];
+
+        if (*dirs && spilled) {
+            /* Rows already spilled need the directories even if these fail */
+            if (spill_table(state.spill, &list->files, list->dirs, i) != 0) {
+                result = -1;
+            }
+            file_table_free(&list->files);
+        } else if (!*dirs || file_table_merge(files, &list->files, *dir_count) != 0) {
+            /* The worker's files are lost with its directories */
+            for (int j = 0; j < list->dir_count; j++) {
+                free(list->dirs[j].path);
+            }
+            file_table_free(&list->files);
+            list->dir_count = 0;
+            result = -1;
+        }
+        dir_offsets[i] = *dir_count;
+        if (*dirs) {
+            memcpy(*dirs + *dir_count, list->dirs, sizeof(dir_info_t) * list->dir_count);
+            *dir_count += list->dir_count;
+        }
+        free(list->dirs);
+    }
+    if (*dirs && spilled) {
+        if (opts->verbose) {
+            printf("Merging %d sorted runs of reference files from disk\n", spill_run_count(state.spill));
+        }
+        if (spill_merge(state.spill, *dirs, dir_offsets, opts->defer_hash, files) != 0) {
+            result = -1;
+        }
+    }
+
+    if (saved && opts->verbose) {
+        printf("Reused %d of %d reference directories from index\n", state.reused_dirs, total_dirs);
+    }
+    if (sizes && opts->verbose) {
+        printf("Left out %d reference files of sizes no source file has\n", state.pruned_files);
+    }
+
+    spill_set_free(state.spill);
+    pthread_mutex_destroy(&state.progress_lock);
+    free(state.lists);
+    free(dir_offsets);
+    free(roots);
+
+    return result;
+}
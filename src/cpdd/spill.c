@@ -0,0 +1,584 @@
+/*
+ * cpdd/spill.c - Reference index spilled to disk and merged
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * With --max-index-memory, scan workers whose files outgrow their share of
+ * the limit sort them and write them out as a run, a stretch of one
+ * temporary file, and start afresh. At the end the runs are merged into a
+ * second temporary file laid out as the columns of a file_table_t, which is
+ * mapped rather than read: the index then lives in the page cache, and only
+ * the pages lookups touch are brought in. Both files are unlinked as soon
+ * as they are created, so nothing is left behind however the run ends.
+ *
+ *   run row: spill_record_t | digest | name, NUL terminated
+ *
+ * The files never outlive the process, so rows are in its native layout.
+ */
+
+#include "cpdd.h"
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+/* Fixed part of a row in a run */
+typedef struct {
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    uint64_t fingerprint;
+    file_times_t times;
+    int list;                   /* Worker list that spilled the row */
+    int dir_id;                 /* Directory, numbered within that list */
+    uint32_t name_length;       /* Including the NUL */
+    unsigned char flags;
+} spill_record_t;
+
+/* A sorted run within the spill file */
+typedef struct {
+    off_t offset;
+    off_t length;
+} spill_run_t;
+
+struct spill_set {
+    int fd;                     /* Unlinked file holding every run */
+    off_t end;                  /* Bytes of it claimed by runs */
+    spill_run_t *runs;
+    int run_count;
+    int run_capacity;
+    size_t rows;                /* Rows in all runs */
+    size_t name_bytes;          /* Bytes of their names, with NULs */
+    size_t digest_length;
+    int with_times;
+    int failed;                 /* Some rows could not be spilled */
+    pthread_mutex_t lock;       /* Protects everything above but fd */
+};
+
+/* Buffered writes to one stretch of a file */
+typedef struct {
+    int fd;
+    off_t offset;
+    unsigned char *buffer;
+    size_t used;
+} run_writer_t;
+
+/* A run being merged: its rows are read a buffer at a time */
+typedef struct {
+    off_t offset;               /* Next byte of the run to read */
+    off_t end;
+    unsigned char *buffer;
+    size_t capacity;
+    size_t start;               /* Unconsumed bytes are buffer[start, filled) */
+    size_t filled;
+    spill_record_t record;      /* Current row */
+    const unsigned char *digest;
+    const char *name;
+    const char *dir;            /* Path of its directory */
+} run_cursor_t;
+
+/* Creates a file in $TMPDIR, or /tmp, and unlinks it at once. Returns its
+ * descriptor, or -1. */
+static int open_spill_file(void) {
+    const char *tmpdir = getenv("TMPDIR");
+    char *path = join_path(tmpdir && *tmpdir ? tmpdir : "/tmp", "cpdd-index-XXXXXX");
+    int fd;
+
+    if (!path) {
+        errno = ENOMEM;
+        return -1;
+    }
+    fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+    }
+    free(path);
+    return fd;
+}
+
+/* Writes all of data at offset */
+static int pwrite_all(int fd, const void *data, size_t length, off_t offset) {
+    const unsigned char *p = data;
+
+    while (length > 0) {
+        ssize_t written = pwrite(fd, p, length, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        length -= (size_t)written;
+        offset += written;
+    }
+    return 0;
+}
+
+static int writer_flush(run_writer_t *writer) {
+    if (pwrite_all(writer->fd, writer->buffer, writer->used, writer->offset) != 0) {
+        return -1;
+    }
+    writer->offset += (off_t)writer->used;
+    writer->used = 0;
+    return 0;
+}
+
+static int writer_put(run_writer_t *writer, const void *data, size_t length) {
+    const unsigned char *p = data;
+
+    while (length > 0) {
+        size_t chunk = SPILL_BUFFER_SIZE - writer->used;
+
+        if (chunk > length) {
+            chunk = length;
+        }
+        memcpy(writer->buffer + writer->used, p, chunk);
+        writer->used += chunk;
+        p += chunk;
+        length -= chunk;
+        if (writer->used == SPILL_BUFFER_SIZE && writer_flush(writer) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Creates an empty set of runs of rows with the given digest length, and
+ * times if with_times is set. Returns NULL if the file cannot be created. */
+spill_set_t *spill_set_create(size_t digest_length, int with_times) {
+    spill_set_t *set = calloc(1, sizeof(spill_set_t));
+
+    if (!set) {
+        return NULL;
+    }
+    set->fd = open_spill_file();
+    if (set->fd < 0) {
+        fprintf(stderr, "Warning: Cannot create a file to spill the reference index: %s\n",
+                strerror(errno));
+        free(set);
+        return NULL;
+    }
+    set->digest_length = digest_length;
+    set->with_times = with_times;
+    pthread_mutex_init(&set->lock, NULL);
+    return set;
+}
+
+void spill_set_free(spill_set_t *set) {
+    if (!set) {
+        return;
+    }
+    close(set->fd);
+    free(set->runs);
+    pthread_mutex_destroy(&set->lock);
+    free(set);
+}
+
+/* Number of runs spilled so far */
+int spill_run_count(spill_set_t *set) {
+    int count;
+
+    pthread_mutex_lock(&set->lock);
+    count = set->run_count;
+    pthread_mutex_unlock(&set->lock);
+    return count;
+}
+
+/* Claims length bytes of the file for a run, returning their offset */
+static off_t claim_space(spill_set_t *set, off_t length) {
+    off_t offset;
+
+    pthread_mutex_lock(&set->lock);
+    offset = set->end;
+    set->end += length;
+    pthread_mutex_unlock(&set->lock);
+    return offset;
+}
+
+/* Records a run once it has been written in full */
+static int add_run(spill_set_t *set, off_t offset, off_t length, int rows, size_t name_bytes) {
+    int result = 0;
+
+    pthread_mutex_lock(&set->lock);
+    if (set->run_count == set->run_capacity) {
+        int capacity = set->run_capacity ? set->run_capacity * 2 : 16;
+        spill_run_t *runs = realloc(set->runs, sizeof(spill_run_t) * capacity);
+        if (runs) {
+            set->runs = runs;
+            set->run_capacity = capacity;
+        }
+    }
+    if (set->run_count < set->run_capacity) {
+        set->runs[set->run_count].offset = offset;
+        set->runs[set->run_count].length = length;
+        set->run_count++;
+        set->rows += (size_t)rows;
+        set->name_bytes += name_bytes;
+    } else {
+        result = -1;
+    }
+    pthread_mutex_unlock(&set->lock);
+    return result;
+}
+
+/*
+ * Sorts table, whose directories are dirs, and writes it to the set as a
+ * run on behalf of worker list list, then empties the table for more rows.
+ * Space is claimed under the lock and written outside it, so workers spill
+ * side by side. Returns -1 if the rows could not be spilled; they are lost.
+ */
+int spill_table(spill_set_t *set, file_table_t *table, const dir_info_t *dirs, int list) {
+    size_t record_size = sizeof(spill_record_t) + set->digest_length;
+    size_t name_bytes = 0;
+    run_writer_t writer;
+    spill_record_t record;
+    off_t length;
+    int count = table->count;
+    int result = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+    writer.buffer = malloc(SPILL_BUFFER_SIZE);
+    if (!writer.buffer || file_table_sort(table, dirs) != 0) {
+        result = -1;
+    }
+
+    for (int i = 0; result == 0 && i < count; i++) {
+        name_bytes += strlen(table->names[i]) + 1;
+    }
+    length = (off_t)(record_size * (size_t)count + name_bytes);
+    writer.fd = set->fd;
+    writer.offset = result == 0 ? claim_space(set, length) : 0;
+    writer.used = 0;
+
+    /* Padding is zeroed so that every byte written is defined */
+    memset(&record, 0, sizeof(record));
+    for (int i = 0; result == 0 && i < count; i++) {
+        record.size = table->sizes[i];
+        record.dev = table->devs[i];
+        record.ino = table->inos[i];
+        record.fingerprint = table->fingerprints[i];
+        if (table->times) {
+            record.times = table->times[i];
+        }
+        record.list = list;
+        record.dir_id = table->dir_ids[i];
+        record.name_length = (uint32_t)strlen(table->names[i]) + 1;
+        record.flags = table->flags[i];
+        if (writer_put(&writer, &record, sizeof(record)) != 0 ||
+            writer_put(&writer, table->digests + (size_t)i * table->digest_length,
+                       set->digest_length) != 0 ||
+            writer_put(&writer, table->names[i], record.name_length) != 0) {
+            result = -1;
+        }
+    }
+    if (result == 0 && writer_flush(&writer) != 0) {
+        result = -1;
+    }
+    if (result == 0) {
+        result = add_run(set, writer.offset - length, length, count, name_bytes);
+    }
+    if (result != 0) {
+        fprintf(stderr, "Warning: Cannot spill %d reference files to disk: %s\n", count, strerror(errno));
+        pthread_mutex_lock(&set->lock);
+        set->failed = 1;
+        pthread_mutex_unlock(&set->lock);
+    }
+
+    free(writer.buffer);
+    file_table_free(table);
+    file_table_init(table, set->digest_length, set->with_times);
+    return result;
+}
+
+/* Makes the next length bytes of the run contiguous in the buffer. Returns
+ * 0, or -1 on a read error or a run cut short. */
+static int cursor_fill(run_cursor_t *cursor, int fd, size_t length) {
+    if (cursor->filled - cursor->start >= length) {
+        return 0;
+    }
+    memmove(cursor->buffer, cursor->buffer + cursor->start, cursor->filled - cursor->start);
+    cursor->filled -= cursor->start;
+    cursor->start = 0;
+    if (length > cursor->capacity) {
+        unsigned char *grown = realloc(cursor->buffer, length);
+        if (!grown) {
+            return -1;
+        }
+        cursor->buffer = grown;
+        cursor->capacity = length;
+    }
+    while (cursor->filled < length) {
+        size_t want = cursor->capacity - cursor->filled;
+        ssize_t got;
+
+        if ((off_t)want > cursor->end - cursor->offset) {
+            want = (size_t)(cursor->end - cursor->offset);
+        }
+        if (want == 0) {
+            errno = EIO;
+            return -1;
+        }
+        got = pread(fd, cursor->buffer + cursor->filled, want, cursor->offset);
+        if (got <= 0) {
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        cursor->filled += (size_t)got;
+        cursor->offset += got;
+    }
+    return 0;
+}
+
+/* Moves a cursor to the next row of its run. Returns 1 if there is one, 0
+ * at the end of the run, -1 on error. */
+static int cursor_next(run_cursor_t *cursor, const spill_set_t *set, const dir_info_t *dirs,
+                       const int *dir_offsets) {
+    size_t record_size = sizeof(spill_record_t) + set->digest_length;
+    const unsigned char *p;
+
+    if (cursor->start == cursor->filled && cursor->offset == cursor->end) {
+        return 0;
+    }
+    if (cursor_fill(cursor, set->fd, record_size) != 0) {
+        return -1;
+    }
+    memcpy(&cursor->record, cursor->buffer + cursor->start, sizeof(spill_record_t));
+    if (cursor->record.name_length == 0 ||
+        cursor_fill(cursor, set->fd, record_size + cursor->record.name_length) != 0) {
+        return -1;
+    }
+    p = cursor->buffer + cursor->start;
+    cursor->digest = p + sizeof(spill_record_t);
+    cursor->name = (const char *)p + record_size;
+    cursor->dir = dirs[dir_offsets[cursor->record.list] + cursor->record.dir_id].path;
+    cursor->start += record_size + cursor->record.name_length;
+    return 1;
+}
+
+/* Orders rows as file_table_sort does: by size, then directory and name */
+static int cursor_before(const run_cursor_t *a, const run_cursor_t *b) {
+    int result;
+
+    if (a->record.size != b->record.size) {
+        return a->record.size < b->record.size;
+    }
+    if (a->dir != b->dir && (result = strcmp(a->dir, b->dir)) != 0) {
+        return result < 0;
+    }
+    return strcmp(a->name, b->name) < 0;
+}
+
+/* Restores the heap order below position i of a heap of count cursors */
+static void heap_sift_down(run_cursor_t **heap, int count, int i) {
+    for (;;) {
+        int least = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        run_cursor_t *swap;
+
+        if (left < count && cursor_before(heap[left], heap[least])) {
+            least = left;
+        }
+        if (right < count && cursor_before(heap[right], heap[least])) {
+            least = right;
+        }
+        if (least == i) {
+            return;
+        }
+        swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+/* Places a column of bytes bytes at *length, rounded up for alignment,
+ * and returns its offset */
+static size_t place_column(size_t *length, size_t bytes) {
+    size_t offset = (*length + 15) & ~(size_t)15;
+
+    *length = offset + bytes;
+    return offset;
+}
+
+/* Maps a file of length bytes, laid out for rows rows, as the columns of
+ * table. Returns -1 if it cannot be created or mapped. */
+static int map_merged_table(const spill_set_t *set, size_t rows, int with_partials,
+                            file_table_t *table, char **names) {
+    size_t length = 0;
+    size_t sizes = place_column(&length, sizeof(off_t) * rows);
+    size_t name_ptrs = place_column(&length, sizeof(char *) * rows);
+    size_t dir_ids = place_column(&length, sizeof(int) * rows);
+    size_t flags = place_column(&length, rows);
+    size_t digests = place_column(&length, set->digest_length * rows);
+    size_t fingerprints = place_column(&length, sizeof(uint64_t) * rows);
+    size_t devs = place_column(&length, sizeof(dev_t) * rows);
+    size_t inos = place_column(&length, sizeof(ino_t) * rows);
+    size_t times = place_column(&length, set->with_times ? sizeof(file_times_t) * rows : 0);
+    size_t partials = place_column(&length, with_partials ? sizeof(partial_hash_t *) * rows : 0);
+    size_t name_data = place_column(&length, set->name_bytes);
+    unsigned char *base;
+    int fd = open_spill_file();
+    int error;
+
+    if (fd < 0) {
+        return -1;
+    }
+    /* Space is allocated up front where the platform can: running out of
+     * it while writing to the mapping would raise SIGBUS, not an error */
+#ifdef __APPLE__
+    error = ftruncate(fd, (off_t)length) == 0 ? 0 : errno;
+#else
+    error = posix_fallocate(fd, 0, (off_t)length);
+#endif
+    if (error != 0) {
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+
+    table->mapping = base;
+    table->mapping_length = length;
+    table->sizes = (off_t *)(base + sizes);
+    table->names = (char **)(base + name_ptrs);
+    table->dir_ids = (int *)(base + dir_ids);
+    table->flags = base + flags;
+    table->digests = base + digests;
+    table->fingerprints = (uint64_t *)(base + fingerprints);
+    table->devs = (dev_t *)(base + devs);
+    table->inos = (ino_t *)(base + inos);
+    table->times = set->with_times ? (file_times_t *)(base + times) : NULL;
+    table->partials = with_partials ? (partial_hash_t **)(base + partials) : NULL;
+    table->capacity = (int)rows;
+    table->digest_length = set->digest_length;
+    *names = (char *)(base + name_data);
+    return 0;
+}
+
+/*
+ * Merges every run of the set into merged, which must be empty and is
+ * replaced by a table mapped from a temporary file, sorted as
+ * file_table_sort sorts. dirs holds the directories of all worker lists,
+ * those of list i starting at dir_offsets[i]. With with_partials, the
+ * table has room for deferred digests. Returns -1 if the runs cannot be
+ * merged, leaving merged empty, or if some rows were lost while spilling.
+ */
+int spill_merge(spill_set_t *set, const dir_info_t *dirs, const int *dir_offsets, int with_partials,
+                file_table_t *merged) {
+    run_cursor_t *cursors = calloc(set->run_count ? set->run_count : 1, sizeof(run_cursor_t));
+    run_cursor_t **heap = malloc(sizeof(run_cursor_t *) * (set->run_count ? set->run_count : 1));
+    file_table_t table;
+    char *names = NULL;
+    int heap_count = 0;
+    int row = 0;
+    int result = 0;
+
+    memset(&table, 0, sizeof(table));
+    table.digest_length = set->digest_length;
+    if (!cursors || !heap || set->rows > INT_MAX ||
+        (set->rows > 0 && map_merged_table(set, set->rows, with_partials, &table, &names) != 0)) {
+        result = -1;
+    }
+
+    for (int i = 0; result == 0 && i < set->run_count; i++) {
+        run_cursor_t *cursor = &cursors[i];
+        int status;
+
+        cursor->offset = set->runs[i].offset;
+        cursor->end = set->runs[i].offset + set->runs[i].length;
+        cursor->capacity = SPILL_BUFFER_SIZE;
+        cursor->buffer = malloc(cursor->capacity);
+        status = cursor->buffer ? cursor_next(cursor, set, dirs, dir_offsets) : -1;
+        if (status < 0) {
+            result = -1;
+        } else if (status > 0) {
+            heap[heap_count++] = cursor;
+        }
+    }
+    for (int i = heap_count / 2 - 1; result == 0 && i >= 0; i--) {
+        heap_sift_down(heap, heap_count, i);
+    }
+
+    /* Each row goes straight from its run's buffer into the mapping */
+    while (result == 0 && heap_count > 0) {
+        run_cursor_t *least = heap[0];
+        const spill_record_t *record = &least->record;
+        int status;
+
+        if (row == (int)set->rows) {
+            result = -1;
+            break;
+        }
+        table.sizes[row] = record->size;
+        table.dir_ids[row] = dir_offsets[record->list] + record->dir_id;
+        table.flags[row] = record->flags;
+        memcpy(table.digests + (size_t)row * table.digest_length, least->digest, table.digest_length);
+        table.fingerprints[row] = record->fingerprint;
+        table.devs[row] = record->dev;
+        table.inos[row] = record->ino;
+        if (table.times) {
+            table.times[row] = record->times;
+        }
+        memcpy(names, least->name, record->name_length);
+        table.names[row] = names;
+        names += record->name_length;
+        row++;
+
+        status = cursor_next(least, set, dirs, dir_offsets);
+        if (status < 0) {
+            result = -1;
+        } else if (status == 0) {
+            heap[0] = heap[--heap_count];
+        }
+        heap_sift_down(heap, heap_count, 0);
+    }
+    table.count = row;
+
+    if (result != 0) {
+        fprintf(stderr, "Warning: Cannot merge the reference index spilled to disk: %s\n", strerror(errno));
+        if (table.mapping) {
+            munmap(table.mapping, table.mapping_length);
+        }
+    } else {
+        file_table_free(merged);
+        *merged = table;
+    }
+    for (int i = 0; cursors && i < set->run_count; i++) {
+        free(cursors[i].buffer);
+    }
+    free(cursors);
+    free(heap);
+    return result == 0 && !set->failed ? 0 : -1;
+}
@@ -0,0 +1,359 @@
+/*
+ * cpdd/table.c - Column-wise tables of reference files
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "cpdd.h"
+#include <stdint.h>
+#include <sys/mman.h>
+
+/* Names are packed into blocks of this size; a longer name gets a block
+ * of its own */
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+
+struct arena_block {
+    arena_block_t *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+/* Returns len bytes from the arena, or NULL if out of memory */
+static char *arena_alloc(string_arena_t *arena, size_t len) {
+    arena_block_t *block = arena->blocks;
+    char *p;
+
+    if (!block || block->size - block->used < len) {
+        size_t size = len > ARENA_BLOCK_SIZE / 4 ? len : ARENA_BLOCK_SIZE;
+
+        block = malloc(sizeof(arena_block_t) + size);
+        if (!block) {
+            return NULL;
+        }
+        block->used = 0;
+        block->size = size;
+        if (size == len && arena->blocks) {
+            /* Keep filling the current block after a dedicated one */
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+    p = block->data + block->used;
+    block->used += len;
+    return p;
+}
+
+/* Returns a copy of name stored in the arena */
+static char *arena_strdup(string_arena_t *arena, const char *name) {
+    size_t len = strlen(name) + 1;
+    char *copy = arena_alloc(arena, len);
+
+    if (copy) {
+        memcpy(copy, name, len);
+    }
+    return copy;
+}
+
+/* Moves every string in from into arena */
+static void arena_adopt(string_arena_t *arena, string_arena_t *from) {
+    arena_block_t *last = from->blocks;
+
+    if (!last) {
+        return;
+    }
+    while (last->next) {
+        last = last->next;
+    }
+    /* Blocks after the first are never allocated from again */
+    if (arena->blocks) {
+        last->next = arena->blocks->next;
+        arena->blocks->next = from->blocks;
+    } else {
+        arena->blocks = from->blocks;
+    }
+    from->blocks = NULL;
+}
+
+static void arena_free(string_arena_t *arena) {
+    arena_block_t *block = arena->blocks;
+
+    while (block) {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
+
+/* Creates an empty table; modification and status change times are only
+ * stored if with_times is set */
+void file_table_init(file_table_t *table, size_t digest_length, int with_times) {
+    memset(table, 0, sizeof(file_table_t));
+    table->digest_length = digest_length;
+    table->times = with_times ? malloc(sizeof(file_times_t)) : NULL;
+}
+
+/* Resizes one column, leaving it untouched on failure */
+static int grow_column(void **column, size_t elem_size, int capacity) {
+    void *grown = realloc(*column, elem_size * (size_t)capacity);
+
+    if (!grown) {
+        return -1;
+    }
+    *column = grown;
+    return 0;
+}
+
+/* Makes room for at least needed rows */
+static int file_table_reserve(file_table_t *table, int needed) {
+    int capacity = table->capacity ? table->capacity : 1024;
+
+    if (needed <= table->capacity) {
+        return 0;
+    }
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    if (grow_column((void **)&table->sizes, sizeof(off_t), capacity) != 0 ||
+        grow_column((void **)&table->names, sizeof(char *), capacity) != 0 ||
+        grow_column((void **)&table->dir_ids, sizeof(int), capacity) != 0 ||
+        grow_column((void **)&table->flags, 1, capacity) != 0 ||
+        grow_column((void **)&table->digests, table->digest_length ? table->digest_length : 1, capacity) != 0 ||
+        grow_column((void **)&table->fingerprints, sizeof(uint64_t), capacity) != 0 ||
+        grow_column((void **)&table->devs, sizeof(dev_t), capacity) != 0 ||
+        grow_column((void **)&table->inos, sizeof(ino_t), capacity) != 0 ||
+        (table->times && grow_column((void **)&table->times, sizeof(file_times_t), capacity) != 0)) {
+        return -1;
+    }
+    table->capacity = capacity;
+    return 0;
+}
+
+/* Appends a file, named name in directory dir_id, with no digest or
+ * fingerprint yet. Returns its row, or -1 if out of memory. */
+int file_table_add(file_table_t *table, int dir_id, const char *name, const entry_stat_t *est) {
+    int row = table->count;
+    char *copy;
+
+    if (file_table_reserve(table, row + 1) != 0 ||
+        !(copy = arena_strdup(&table->arena, name))) {
+        return -1;
+    }
+    table->sizes[row] = est->size;
+    table->names[row] = copy;
+    table->dir_ids[row] = dir_id;
+    table->flags[row] = 0;
+    memset(table->digests + (size_t)row * table->digest_length, 0, table->digest_length);
+    table->fingerprints[row] = 0;
+    table->devs[row] = est->dev;
+    table->inos[row] = est->ino;
+    if (table->times) {
+        table->times[row].mtime = est->mtime;
+        table->times[row].ctime = est->ctime;
+    }
+    table->count++;
+    return row;
+}
+
+/* Appends a copy of a row of another table with the same digest length,
+ * placing it in directory dir_id */
+int file_table_copy_row(file_table_t *table, const file_table_t *from, int row, int dir_id) {
+    entry_stat_t est;
+    int copy;
+
+    est.size = from->sizes[row];
+    est.dev = from->devs[row];
+    est.ino = from->inos[row];
+    if (from->times) {
+        est.mtime = from->times[row].mtime;
+        est.ctime = from->times[row].ctime;
+    } else {
+        memset(&est.mtime, 0, sizeof(est.mtime));
+        memset(&est.ctime, 0, sizeof(est.ctime));
+    }
+    copy = file_table_add(table, dir_id, from->names[row], &est);
+    if (copy < 0) {
+        return -1;
+    }
+    table->flags[copy] = from->flags[row] & (FILE_HAS_DIGEST | FILE_HAS_FINGERPRINT);
+    memcpy(table->digests + (size_t)copy * table->digest_length,
+           from->digests + (size_t)row * from->digest_length, table->digest_length);
+    table->fingerprints[copy] = from->fingerprints[row];
+    return copy;
+}
+
+/* Moves every row of from onto the end of table and frees from. The rows'
+ * directory ids are shifted by dir_offset. */
+int file_table_merge(file_table_t *table, file_table_t *from, int dir_offset) {
+    int base = table->count;
+    int n = from->count;
+
+    if (file_table_reserve(table, base + n) != 0) {
+        return -1;
+    }
+    memcpy(table->sizes + base, from->sizes, sizeof(off_t) * n);
+    memcpy(table->names + base, from->names, sizeof(char *) * n);
+    for (int i = 0; i < n; i++) {
+        table->dir_ids[base + i] = from->dir_ids[i] + dir_offset;
+    }
+    memcpy(table->flags + base, from->flags, n);
+    memcpy(table->digests + (size_t)base * table->digest_length, from->digests,
+           (size_t)n * table->digest_length);
+    memcpy(table->fingerprints + base, from->fingerprints, sizeof(uint64_t) * n);
+    memcpy(table->devs + base, from->devs, sizeof(dev_t) * n);
+    memcpy(table->inos + base, from->inos, sizeof(ino_t) * n);
+    if (table->times && from->times) {
+        memcpy(table->times + base, from->times, sizeof(file_times_t) * n);
+    } else if (table->times) {
+        memset(table->times + base, 0, sizeof(file_times_t) * n);
+    }
+    table->count += n;
+    arena_adopt(&table->arena, &from->arena);
+    file_table_free(from);
+    return 0;
+}
+
+/* Sort key for one row */
+typedef struct {
+    off_t size;
+    const char *dir;
+    const char *name;
+    int row;
+} sort_key_t;
+
+/* Orders by size, then directory and name, so the sorted index is the same
+ * regardless of the order in which (possibly parallel) directory scans
+ * found the files */
+static int compare_sort_keys(const void *a, const void *b) {
+    const sort_key_t *key_a = a;
+    const sort_key_t *key_b = b;
+    int result;
+
+    if (key_a->size != key_b->size) {
+        return (key_a->size > key_b->size) - (key_a->size < key_b->size);
+    }
+    if (key_a->dir != key_b->dir && (result = strcmp(key_a->dir, key_b->dir)) != 0) {
+        return result;
+    }
+    return strcmp(key_a->name, key_b->name);
+}
+
+/* Rearranges a column into the order of keys */
+static int permute_column(void **column, size_t elem_size, const sort_key_t *keys, int count) {
+    unsigned char *sorted = malloc(elem_size * (size_t)(count ? count : 1));
+    const unsigned char *old = *column;
+
+    if (!sorted) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        memcpy(sorted + elem_size * (size_t)i, old + elem_size * (size_t)keys[i].row, elem_size);
+    }
+    free(*column);
+    *column = sorted;
+    return 0;
+}
+
+/*
+ * Sorts the rows by size, then path; dirs gives the paths of the rows'
+ * directories. Only small keys are sorted; each column is then gathered
+ * into its new order in turn. Returns -1 if out of memory, after which the
+ * table is only fit to be freed.
+ */
+int file_table_sort(file_table_t *table, const dir_info_t *dirs) {
+    sort_key_t *keys = malloc(sizeof(sort_key_t) * (size_t)(table->count ? table->count : 1));
+    int result = 0;
+
+    if (!keys) {
+        return -1;
+    }
+    for (int i = 0; i < table->count; i++) {
+        keys[i].size = table->sizes[i];
+        keys[i].dir = dirs[table->dir_ids[i]].path;
+        keys[i].name = table->names[i];
+        keys[i].row = i;
+    }
+    qsort(keys, table->count, sizeof(sort_key_t), compare_sort_keys);
+
+    if (permute_column((void **)&table->sizes, sizeof(off_t), keys, table->count) != 0 ||
+        permute_column((void **)&table->names, sizeof(char *), keys, table->count) != 0 ||
+        permute_column((void **)&table->dir_ids, sizeof(int), keys, table->count) != 0 ||
+        permute_column((void **)&table->flags, 1, keys, table->count) != 0 ||
+        permute_column((void **)&table->digests, table->digest_length, keys, table->count) != 0 ||
+        permute_column((void **)&table->fingerprints, sizeof(uint64_t), keys, table->count) != 0 ||
+        permute_column((void **)&table->devs, sizeof(dev_t), keys, table->count) != 0 ||
+        permute_column((void **)&table->inos, sizeof(ino_t), keys, table->count) != 0 ||
+        (table->times && permute_column((void **)&table->times, sizeof(file_times_t), keys, table->count) != 0)) {
+        result = -1;
+    }
+    if (result == 0) {
+        table->capacity = table->count;
+    }
+    free(keys);
+    return result;
+}
+
+/* Bytes held by the table, for reporting */
+size_t file_table_memory(const file_table_t *table) {
+    size_t row_size = sizeof(off_t) + sizeof(char *) + sizeof(int) + 1 + table->digest_length +
+                      sizeof(uint64_t) + sizeof(dev_t) + sizeof(ino_t) +
+                      (table->times ? sizeof(file_times_t) : 0) +
+                      (table->partials ? sizeof(partial_hash_t *) : 0);
+    /* Mapped columns are in the page cache, not held */
+    size_t bytes = table->mapping ? 0 : row_size * (size_t)table->capacity;
+
+    for (const arena_block_t *block = table->arena.blocks; block; block = block->next) {
+        bytes += sizeof(arena_block_t) + block->size;
+    }
+    return bytes;
+}
+
+/* Frees the table: a fixed number of calls, plus one per arena block and
+ * per deferred digest. A table merged from disk is unmapped instead. */
+void file_table_free(file_table_t *table) {
+    if (table->partials) {
+        for (int i = 0; i < table->count; i++) {
+            free(table->partials[i]);
+        }
+    }
+    if (table->mapping) {
+        munmap(table->mapping, table->mapping_length);
+        arena_free(&table->arena);
+        memset(table, 0, sizeof(file_table_t));
+        return;
+    }
+    free(table->partials);
+    free(table->sizes);
+    free(table->names);
+    free(table->dir_ids);
+    free(table->flags);
+    free(table->digests);
+    free(table->fingerprints);
+    free(table->devs);
+    free(table->inos);
+    free(table->times);
+    arena_free(&table->arena);
+    memset(table, 0, sizeof(file_table_t));
+}
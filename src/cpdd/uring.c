@@ -0,0 +1,594 @@
+/*
+ * cpdd/uring.c - io_uring I/O backend
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/* MAP_POPULATE and the io_uring syscall numbers are Linux extensions */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include "cpdd.h"
+#include <pthread.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring driven through the raw system calls, so no liburing
+ * dependency is needed. Each thread that uses it owns one ring; nothing
+ * here is shared between threads.
+ */
+struct io_ring {
+    int fd;
+    unsigned entries;               /* Submission queue size */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    size_t sqes_size;
+    unsigned queued;                /* Prepared but not yet submitted */
+    unsigned char *buffers;         /* buffer_count * IO_RING_BUFFER_SIZE */
+    unsigned buffer_count;
+    int fixed;                      /* Buffers are registered with the kernel */
+    int broken;                     /* Requests may be left in flight; never reuse */
+};
+
+/* Copy state of one buffer */
+typedef struct {
+    off_t offset;       /* File offset of the buffer's first byte */
+    size_t length;      /* Bytes requested */
+    size_t filled;      /* Bytes read so far */
+    size_t written;     /* Bytes written so far */
+    int writing;        /* Read complete, write in flight */
+    int busy;
+} copy_slot_t;
+
+static int ring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int ring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Checks the kernel supports plain reads and writes (Linux 5.6 and later) */
+static int ring_supports_rw(int fd) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int supported = 0;
+
+    if (!probe) {
+        return 0;
+    }
+    if (ring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        probe->last_op >= IORING_OP_WRITE &&
+        (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+        (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)) {
+        supported = 1;
+    }
+    free(probe);
+    return supported;
+}
+
+static void io_ring_destroy(io_ring_t *ring) {
+    if (!ring) {
+        return;
+    }
+    if (ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_map && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map && ring->sq_map != MAP_FAILED) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring->buffers);
+    free(ring);
+}
+
+/*
+ * Creates a ring with queue_depth submission entries and buffer_count
+ * copy buffers. The buffers are registered with the kernel when the
+ * locked-memory limit allows it. Returns NULL if io_uring is unavailable.
+ */
+static io_ring_t *io_ring_create(unsigned queue_depth, unsigned buffer_count) {
+    struct io_uring_params params;
+    io_ring_t *ring = calloc(1, sizeof(io_ring_t));
+
+    if (!ring) {
+        return NULL;
+    }
+    ring->fd = -1;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = ring_setup(queue_depth, &params);
+    if (ring->fd < 0 || !ring_supports_rw(ring->fd)) {
+        if (ring->fd >= 0) {
+            errno = EOPNOTSUPP;
+        }
+        io_ring_destroy(ring);
+        return NULL;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = ring->sq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        io_ring_destroy(ring);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            io_ring_destroy(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        io_ring_destroy(ring);
+        return NULL;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_map + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_map + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_map + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_map + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_map + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_map + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map + params.cq_off.cqes);
+
+    /* Never keep more copy buffers in flight than the queue can hold */
+    ring->buffer_count = buffer_count < ring->entries ? buffer_count : ring->entries;
+    ring->buffers = malloc((size_t)ring->buffer_count * IO_RING_BUFFER_SIZE);
+    if (!ring->buffers) {
+        io_ring_destroy(ring);
+        return NULL;
+    }
+    struct iovec *iovecs = malloc(ring->buffer_count * sizeof(struct iovec));
+    if (iovecs) {
+        for (unsigned i = 0; i < ring->buffer_count; i++) {
+            iovecs[i].iov_base = ring->buffers + (size_t)i * IO_RING_BUFFER_SIZE;
+            iovecs[i].iov_len = IO_RING_BUFFER_SIZE;
+        }
+        ring->fixed = ring_register(ring->fd, IORING_REGISTER_BUFFERS, iovecs, ring->buffer_count) == 0;
+        free(iovecs);
+    }
+
+    return ring;
+}
+
+/* Queues one read or write. The caller guarantees a free submission slot. */
+static void ring_queue(io_ring_t *ring, int opcode, int fd, void *buffer, size_t length,
+                       off_t offset, int buffer_index, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)offset;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (uint32_t)length;
+    if (buffer_index >= 0) {
+        sqe->buf_index = (uint16_t)buffer_index;
+    }
+    sqe->user_data = user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+}
+
+/* Submits queued requests and waits for at least one completion */
+static int ring_submit_and_wait(io_ring_t *ring) {
+    for (;;) {
+        int ret = ring_enter(ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS);
+        if (ret >= 0) {
+            ring->queued -= (unsigned)ret;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/* Returns the next completion, or NULL if none is ready */
+static struct io_uring_cqe *ring_peek(io_ring_t *ring) {
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+static void ring_advance(io_ring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Cleans up after a failed submission, with inflight requests either
+ * queued or submitted. Those still queued are withdrawn, and those the
+ * kernel has are waited for and their completions discarded, so nothing
+ * is left writing into the caller's buffers or completing into the next
+ * caller's requests. If the kernel cannot be waited on, the ring is marked
+ * broken and the thread stops using it.
+ */
+static void ring_abandon(io_ring_t *ring, unsigned inflight) {
+    /* Without SQPOLL the kernel only takes entries during ring_enter, so
+     * the unsubmitted tail can simply be taken back */
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail - ring->queued, __ATOMIC_RELEASE);
+    inflight -= ring->queued;
+    ring->queued = 0;
+
+    while (inflight > 0) {
+        while (inflight > 0 && ring_peek(ring) != NULL) {
+            ring_advance(ring);
+            inflight--;
+        }
+        if (inflight > 0 && ring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            ring->broken = 1;
+            return;
+        }
+    }
+}
+
+/*
+ * Reads every request in full (or to EOF) with up to one submission queue
+ * of reads in flight at once. On return each result holds the bytes read,
+ * or -1 if that read failed. Returns -1 only if the ring itself failed;
+ * unless it is then broken, no read is left in flight.
+ */
+static int ring_read(io_ring_t *ring, io_request_t *requests, int count) {
+    unsigned inflight = 0;
+    int next = 0;
+
+    for (int i = 0; i < count; i++) {
+        requests[i].result = 0;
+    }
+
+    while (next < count || inflight > 0) {
+        struct io_uring_cqe *cqe;
+
+        while (next < count && inflight < ring->entries) {
+            io_request_t *req = &requests[next];
+            ring_queue(ring, IORING_OP_READ, req->fd, req->buffer, req->length, req->offset, -1,
+                       (uint64_t)next);
+            inflight++;
+            next++;
+        }
+        if (ring_submit_and_wait(ring) != 0) {
+            ring_abandon(ring, inflight);
+            return -1;
+        }
+
+        while ((cqe = ring_peek(ring)) != NULL) {
+            io_request_t *req = &requests[cqe->user_data];
+            int res = cqe->res;
+
+            ring_advance(ring);
+            if (res < 0) {
+                req->result = -1;
+            } else if (res > 0 && (size_t)(req->result + res) < req->length) {
+                /* Short read: queue the remainder in the slot just freed */
+                req->result += res;
+                ring_queue(ring, IORING_OP_READ, req->fd, (char *)req->buffer + req->result,
+                           req->length - (size_t)req->result, req->offset + req->result, -1,
+                           cqe->user_data);
+                continue;
+            } else {
+                req->result += res;
+            }
+            inflight--;
+        }
+    }
+
+    return 0;
+}
+
+/* Queues the next read or write for a copy buffer */
+static void queue_slot(io_ring_t *ring, copy_slot_t *slots, int index, int src_fd, int dest_fd) {
+    copy_slot_t *slot = &slots[index];
+    unsigned char *buffer = ring->buffers + (size_t)index * IO_RING_BUFFER_SIZE;
+    int buffer_index = ring->fixed ? index : -1;
+
+    if (slot->writing) {
+        ring_queue(ring, ring->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, dest_fd,
+                   buffer + slot->written, slot->filled - slot->written,
+                   slot->offset + (off_t)slot->written, buffer_index, (uint64_t)index);
+    } else {
+        ring_queue(ring, ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, src_fd,
+                   buffer + slot->filled, slot->length - slot->filled,
+                   slot->offset + (off_t)slot->filled, buffer_index, (uint64_t)index);
+    }
+}
+
+/*
+ * Copies size bytes from src_fd to dest_fd, keeping every buffer busy:
+ * each one cycles through a read of the next unread range and a write of
+ * that range, so reads and writes from several buffers are in flight at
+ * once. Data beyond size (a file that grew) is copied synchronously at the
+ * end. Returns 0 on success or -1 with errno set.
+ */
+int io_ring_copy(io_ring_t *ring, int src_fd, int dest_fd, off_t size) {
+    copy_slot_t *slots = calloc(ring->buffer_count, sizeof(copy_slot_t));
+    off_t next_offset = 0;
+    unsigned inflight = 0;
+    int error = 0;
+    int eof = 0;
+
+    if (!slots) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (;;) {
+        struct io_uring_cqe *cqe;
+
+        for (unsigned i = 0; i < ring->buffer_count && next_offset < size && !error && !eof; i++) {
+            if (slots[i].busy) {
+                continue;
+            }
+            memset(&slots[i], 0, sizeof(copy_slot_t));
+            slots[i].busy = 1;
+            slots[i].offset = next_offset;
+            slots[i].length = size - next_offset < IO_RING_BUFFER_SIZE ? (size_t)(size - next_offset)
+                                                                       : IO_RING_BUFFER_SIZE;
+            next_offset += (off_t)slots[i].length;
+            queue_slot(ring, slots, (int)i, src_fd, dest_fd);
+            inflight++;
+        }
+        if (inflight == 0) {
+            break;
+        }
+        if (ring_submit_and_wait(ring) != 0) {
+            int saved_errno = errno;
+
+            ring_abandon(ring, inflight);
+            free(slots);
+            errno = saved_errno;
+            return -1;
+        }
+
+        while ((cqe = ring_peek(ring)) != NULL) {
+            int index = (int)cqe->user_data;
+            copy_slot_t *slot = &slots[index];
+            int res = cqe->res;
+
+            ring_advance(ring);
+            if (res < 0 || (slot->writing && res == 0)) {
+                error = res < 0 ? -res : EIO;
+            } else if (!slot->writing) {
+                slot->filled += (size_t)res;
+                if (res == 0) {
+                    eof = 1; /* The source shrank; write what was read */
+                }
+                if (res > 0 && slot->filled < slot->length && !error) {
+                    queue_slot(ring, slots, index, src_fd, dest_fd);
+                    continue;
+                }
+                if (slot->filled > 0 && !error) {
+                    slot->writing = 1;
+                    queue_slot(ring, slots, index, src_fd, dest_fd);
+                    continue;
+                }
+            } else {
+                slot->written += (size_t)res;
+                if (slot->written < slot->filled && !error) {
+                    queue_slot(ring, slots, index, src_fd, dest_fd);
+                    continue;
+                }
+            }
+            slot->busy = 0;
+            inflight--;
+        }
+    }
+    free(slots);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+
+    /* Pick up anything appended since the source was stat'ed */
+    if (!eof) {
+        unsigned char *buffer = ring->buffers;
+        ssize_t bytes;
+        while ((bytes = pread(src_fd, buffer, IO_RING_BUFFER_SIZE, next_offset)) > 0) {
+            if (pwrite(dest_fd, buffer, (size_t)bytes, next_offset) != bytes) {
+                return -1;
+            }
+            next_offset += bytes;
+        }
+        if (bytes < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static char ring_unavailable;   /* Marks threads whose ring could not be created */
+static int ring_warned;
+
+static void ring_key_destroy(void *value) {
+    if (value != &ring_unavailable) {
+        io_ring_destroy(value);
+    }
+}
+
+static void ring_key_create(void) {
+    pthread_key_create(&ring_key, ring_key_destroy);
+}
+
+/*
+ * Returns the calling thread's ring, creating it on first use, or NULL if
+ * --io-uring was not given or io_uring is unavailable (reported once).
+ */
+io_ring_t *io_ring_thread(const options_t *opts) {
+    io_ring_t *ring;
+
+    if (!opts->io_uring) {
+        return NULL;
+    }
+    pthread_once(&ring_key_once, ring_key_create);
+    ring = pthread_getspecific(ring_key);
+    if (ring == (void *)&ring_unavailable) {
+        return NULL;
+    }
+    if (ring && ring->broken) {
+        /* Reads may still land in its buffers, so it is never freed */
+        pthread_setspecific(ring_key, &ring_unavailable);
+        return NULL;
+    }
+    if (!ring) {
+        ring = io_ring_create((unsigned)opts->queue_depth, (unsigned)opts->io_buffers);
+        if (!ring) {
+            if (!__atomic_exchange_n(&ring_warned, 1, __ATOMIC_RELAXED)) {
+                fprintf(stderr, "Warning: io_uring unavailable (%s), using POSIX I/O\n", strerror(errno));
+            }
+            pthread_setspecific(ring_key, &ring_unavailable);
+            return NULL;
+        }
+        pthread_setspecific(ring_key, ring);
+    }
+    return ring;
+}
+
+#else /* !HAVE_IO_URING */
+
+io_ring_t *io_ring_thread(const options_t *opts) {
+    static int warned;
+
+    if (opts->io_uring && !warned) {
+        fprintf(stderr, "Warning: io_uring is not supported on this platform, using POSIX I/O\n");
+        warned = 1;
+    }
+    return NULL;
+}
+
+int io_ring_copy(io_ring_t *ring, int src_fd, int dest_fd, off_t size) {
+    (void)ring;
+    (void)src_fd;
+    (void)dest_fd;
+    (void)size;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* HAVE_IO_URING */
+
+/*
+ * Reads every request in full (or to EOF), through the ring when one is
+ * given so the reads are in flight together, and otherwise with pread.
+ * Each result holds the bytes read, or -1 on error.
+ */
+void read_requests(io_ring_t *ring, io_request_t *requests, int count) {
+#ifdef HAVE_IO_URING
+    if (ring && ring_read(ring, requests, count) == 0) {
+        return;
+    }
+    if (ring && ring->broken) {
+        /* The kernel may still be filling the buffers: reading them
+         * again now could race with it, so every read has failed */
+        for (int i = 0; i < count; i++) {
+            requests[i].result = -1;
+        }
+        return;
+    }
+#else
+    (void)ring;
+#endif
+    for (int i = 0; i < count; i++) {
+        io_request_t *req = &requests[i];
+        size_t total = 0;
+
+        req->result = 0;
+        while (total < req->length) {
+            ssize_t bytes = pread(req->fd, (char *)req->buffer + total, req->length - total,
+                                  req->offset + (off_t)total);
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes < 0) {
+                req->result = -1;
+                break;
+            }
+            if (bytes == 0) {
+                break;
+            }
+            total += (size_t)bytes;
+        }
+        if (req->result == 0) {
+            req->result = (ssize_t)total;
+        }
+    }
+}
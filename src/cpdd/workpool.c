@@ -0,0 +1,246 @@
+/*
+ * cpdd/workpool.c - Work-stealing pool for directory traversal
+ *
+ * Copyright (c) 2025 Lee de Byl <lee@32kb.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "cpdd.h"
+#include <pthread.h>
+
+/* Per-worker double-ended queue. The owner pushes and pops at the tail
+ * (depth-first, good locality), thieves take from the head (the oldest,
+ * and usually largest, unexplored subtrees). */
+typedef struct {
+    pthread_mutex_t lock;
+    void **items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} work_deque_t;
+
+struct work_pool {
+    work_deque_t *deques;
+    int nthreads;
+    pthread_mutex_t lock;   /* Protects queued and pending */
+    pthread_cond_t wake;    /* Signalled when work arrives or all work is done */
+    size_t queued;          /* Items sitting in deques */
+    size_t pending;         /* Items queued or being processed */
+    work_fn_t fn;
+    void *ctx;
+};
+
+typedef struct {
+    work_pool_t *pool;
+    int worker;
+} worker_arg_t;
+
+static int deque_push(work_deque_t *dq, void *item) {
+    int result = 0;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->capacity) {
+        if (dq->head > 0) {
+            /* Reclaim space consumed by thieves before growing */
+            memmove(dq->items, dq->items + dq->head, (dq->tail - dq->head) * sizeof(void *));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        } else {
+            size_t new_capacity = dq->capacity ? dq->capacity * 2 : 64;
+            void **new_items = realloc(dq->items, new_capacity * sizeof(void *));
+            if (!new_items) {
+                result = -1;
+            } else {
+                dq->items = new_items;
+                dq->capacity = new_capacity;
+            }
+        }
+    }
+    if (result == 0) {
+        dq->items[dq->tail++] = item;
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return result;
+}
+
+static void *deque_pop(work_deque_t *dq) {
+    void *item = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) {
+        item = dq->items[--dq->tail];
+        if (dq->tail == dq->head) {
+            dq->head = dq->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return item;
+}
+
+static void *deque_steal(work_deque_t *dq) {
+    void *item = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) {
+        item = dq->items[dq->head++];
+        if (dq->tail == dq->head) {
+            dq->head = dq->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return item;
+}
+
+/* Takes an item from the worker's own deque, or steals one from a peer */
+static void *take_work(work_pool_t *pool, int worker) {
+    void *item = deque_pop(&pool->deques[worker]);
+
+    for (int i = 1; !item && i < pool->nthreads; i++) {
+        item = deque_steal(&pool->deques[(worker + i) % pool->nthreads]);
+    }
+
+    if (item) {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return item;
+}
+
+static void run_worker(work_pool_t *pool, int worker) {
+    for (;;) {
+        void *item = take_work(pool, worker);
+
+        if (item) {
+            pool->fn(pool, worker, item, pool->ctx);
+
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->pending == 0) {
+                pthread_cond_broadcast(&pool->wake);
+            }
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        /* Nothing to do locally or to steal: sleep until more work is
+         * published, or until every outstanding item has been processed */
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && pool->pending > 0) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->pending == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void *worker_main(void *arg) {
+    worker_arg_t *wa = arg;
+    run_worker(wa->pool, wa->worker);
+    return NULL;
+}
+
+/* Queues an item on the calling worker's deque. If the deque cannot grow,
+ * the item is processed immediately on the calling thread instead. */
+void work_pool_push(work_pool_t *pool, int worker, void *item) {
+    if (deque_push(&pool->deques[worker], item) != 0) {
+        pool->fn(pool, worker, item, pool->ctx);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pool->pending++;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Runs fn over the initial items and everything they push, using nthreads
+ * workers. The calling thread acts as worker 0. Returns once all work is done. */
+int work_pool_run(int nthreads, void **items, int item_count, work_fn_t fn, void *ctx) {
+    work_pool_t pool;
+    pthread_t *threads = NULL;
+    worker_arg_t *args = NULL;
+    int started = 0;
+
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pool.nthreads = nthreads;
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.deques = calloc(nthreads, sizeof(work_deque_t));
+    if (!pool.deques) {
+        return -1;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+
+    /* Deal the initial items round-robin so every worker starts busy */
+    for (int i = 0; i < item_count; i++) {
+        work_pool_push(&pool, i % nthreads, items[i]);
+    }
+
+    if (nthreads > 1) {
+        threads = malloc(sizeof(pthread_t) * nthreads);
+        args = malloc(sizeof(worker_arg_t) * nthreads);
+        if (threads && args) {
+            for (int i = 1; i < nthreads; i++) {
+                args[i].pool = &pool;
+                args[i].worker = i;
+                if (pthread_create(&threads[i], NULL, worker_main, &args[i]) != 0) {
+                    break;
+                }
+                started = i;
+            }
+        }
+    }
+
+    /* The calling thread always participates, so the pool makes progress
+     * even if no helper threads could be started */
+    run_worker(&pool, 0);
+
+    for (int i = 1; i <= started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].items);
+    }
+    pthread_cond_destroy(&pool.wake);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.deques);
+    free(threads);
+    free(args);
+
+    return 0;
+}
@@ -237,6 +237,320 @@ test_case "soft link creation" \
     "./cpdd $VERBOSE $STATS -r '$REF_DIR' -s '$TEST_FILE' '$DEST7/soft_linked.txt'" \
     "pass"
 
+# Parallel reference scan must produce the same links as the serial scan
+echo
+echo "🧵 === Parallel Scan Tests ==="
+
+DEST8="$TEMP_DIR/dest8"
+test_case "recursive copy with parallel reference scan" \
+    "./cpdd $VERBOSE $STATS -r '$REF_DIR' -L -R --scan-threads 4 '$SRC_DIR' '$DEST8'" \
+    "pass"
+
+echo -n "Comparing parallel scan links with serial scan... "
+if diff <(cd "$DEST4" && find . -type f -links +1 | sort) <(cd "$DEST8" && find . -type f -links +1 | sort) >/dev/null; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL"
+    ((FAILED++))
+fi
+
+# Persistent index: second run must reuse the index and link the same files
+echo
+echo "🗂️  === Reference Index Tests ==="
+
+INDEX_FILE="$TEMP_DIR/reference.idx"
+DEST9="$TEMP_DIR/dest9"
+DEST10="$TEMP_DIR/dest10"
+test_case "copy saving reference index" \
+    "./cpdd $VERBOSE $STATS -r '$REF_DIR' -R --index '$INDEX_FILE' '$SRC_DIR' '$DEST9' && test -s '$INDEX_FILE'" \
+    "pass"
+test_case "copy reusing reference index" \
+    "./cpdd $VERBOSE $STATS -r '$REF_DIR' -R --index '$INDEX_FILE' '$SRC_DIR' '$DEST10'" \
+    "pass"
+
+DEST11="$TEMP_DIR/dest11"
+test_case "copy with index and full rescan" \
+    "./cpdd $VERBOSE $STATS -r '$REF_DIR' -R --index '$INDEX_FILE' --full-rescan '$SRC_DIR' '$DEST11'" \
+    "pass"
+
+echo -n "Comparing indexed run links with serial scan... "
+if diff <(cd "$DEST4" && find . -type f -links +1 | sort) <(cd "$DEST10" && find . -type f -links +1 | sort) >/dev/null; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL"
+    ((FAILED++))
+fi
+
+# A limit this small spills every directory's files to a run of its own
+DEST_SPILL="$TEMP_DIR/dest_spill"
+test_case "copy with reference index spilled to disk" \
+    "./cpdd $VERBOSE $STATS -r '$REF_DIR' -R --scan-threads 2 --max-index-memory 1K '$SRC_DIR' '$DEST_SPILL'" \
+    "pass"
+
+echo -n "Comparing spilled index links with serial scan... "
+if diff <(cd "$DEST4" && find . -type f -links +1 | sort) <(cd "$DEST_SPILL" && find . -type f -links +1 | sort) >/dev/null; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL"
+    ((FAILED++))
+fi
+
+# Pruning leaves out only references no source can match
+DEST_PRUNE="$TEMP_DIR/dest_prune"
+test_case "copy with references pruned by source sizes" \
+    "./cpdd $VERBOSE $STATS -r '$REF_DIR' -R --prune-references '$SRC_DIR' '$DEST_PRUNE'" \
+    "pass"
+
+echo -n "Comparing pruned index links with serial scan... "
+if diff <(cd "$DEST4" && find . -type f -links +1 | sort) <(cd "$DEST_PRUNE" && find . -type f -links +1 | sort) >/dev/null; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL"
+    ((FAILED++))
+fi
+
+echo
+echo "🔑 === Hash Algorithm Tests ==="
+
+DEST12="$TEMP_DIR/dest12"
+DEST13="$TEMP_DIR/dest13"
+test_case "copy with xxh3 hash and index" \
+    "./cpdd $VERBOSE $STATS -r '$REF_DIR' -R --hash xxh3 --index '$INDEX_FILE' '$SRC_DIR' '$DEST12'" \
+    "pass"
+test_case "copy with blake3 hash" \
+    "./cpdd $VERBOSE $STATS -r '$REF_DIR' -R --hash blake3 '$SRC_DIR' '$DEST13'" \
+    "pass"
+test_case "unknown hash algorithm" \
+    "./cpdd -r '$REF_DIR' -R --hash sha1 '$SRC_DIR' '$TEMP_DIR/dest_badhash'" \
+    "fail"
+
+echo -n "Comparing hash algorithm links with MD5 run... "
+if diff <(cd "$DEST4" && find . -type f -links +1 | sort) <(cd "$DEST12" && find . -type f -links +1 | sort) >/dev/null &&
+   diff <(cd "$DEST4" && find . -type f -links +1 | sort) <(cd "$DEST13" && find . -type f -links +1 | sort) >/dev/null; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL"
+    ((FAILED++))
+fi
+
+echo
+echo "🧬 === Same-Size Candidate Tests ==="
+
+# Large files of one size that differ only in a single byte, at the start,
+# in the middle and at the end; only an exact copy may be linked
+SAME_REF="$TEMP_DIR/same_ref"
+SAME_SRC="$TEMP_DIR/same_src"
+SAME_DEST="$TEMP_DIR/same_dest"
+mkdir -p "$SAME_REF" "$SAME_SRC"
+head -c 1048576 /dev/urandom > "$SAME_REF/base"
+for offset in 0 524287 1048575; do
+    cp "$SAME_REF/base" "$SAME_REF/variant_$offset"
+    printf 'X' | dd of="$SAME_REF/variant_$offset" bs=1 seek=$offset conv=notrunc 2>/dev/null
+done
+cp "$SAME_REF/variant_524287" "$SAME_SRC/middle"
+cp "$SAME_REF/base" "$SAME_SRC/base"
+printf 'Y' | dd of="$SAME_SRC/base" bs=1 seek=300000 conv=notrunc 2>/dev/null
+test_case "copy with same-sized reference candidates" \
+    "./cpdd $VERBOSE $STATS -r '$SAME_REF' -R '$SAME_SRC' '$SAME_DEST'" \
+    "pass"
+
+SAME_DEFER_DEST="$TEMP_DIR/same_defer_dest"
+test_case "copy with deferred hashing" \
+    "./cpdd $VERBOSE $STATS -r '$SAME_REF' -R --defer-hash '$SAME_SRC' '$SAME_DEFER_DEST'" \
+    "pass"
+
+echo -n "Checking same-size candidates link only exact copies... "
+if [[ "$SAME_DEST/middle" -ef "$SAME_REF/variant_524287" ]] && [[ $(stat -c %h "$SAME_DEST/base" 2>/dev/null || stat -f %l "$SAME_DEST/base") -eq 1 ]] &&
+   [[ "$SAME_DEFER_DEST/middle" -ef "$SAME_REF/variant_524287" ]] && [[ ! "$SAME_DEFER_DEST/base" -ef "$SAME_REF/base" ]] &&
+   cmp -s "$SAME_SRC/base" "$SAME_DEST/base" && cmp -s "$SAME_SRC/base" "$SAME_DEFER_DEST/base"; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL"
+    ((FAILED++))
+fi
+
+echo
+echo "⚡ === I/O Backend Tests ==="
+
+# Falls back to POSIX I/O (with a warning) where io_uring is unavailable
+DEST14="$TEMP_DIR/dest14"
+test_case "copy with io_uring backend" \
+    "./cpdd $VERBOSE $STATS -r '$REF_DIR' -R --io-uring --queue-depth 8 --io-buffers 4 '$SRC_DIR' '$DEST14'" \
+    "pass"
+
+echo -n "Comparing io_uring run with POSIX run... "
+if diff -r "$DEST4" "$DEST14" >/dev/null &&
+   diff <(cd "$DEST4" && find . -type f -links +1 | sort) <(cd "$DEST14" && find . -type f -links +1 | sort) >/dev/null; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL"
+    ((FAILED++))
+fi
+
+# Unique-sized files compared through mappings instead of read windows
+DEST14M="$TEMP_DIR/dest14_mapped"
+test_case "copy with mapped comparisons" \
+    "./cpdd $VERBOSE $STATS -r '$REF_DIR' -R --mmap-compare '$SRC_DIR' '$DEST14M'" \
+    "pass"
+
+echo -n "Comparing mapped run with read run... "
+if diff -r "$DEST4" "$DEST14M" >/dev/null &&
+   diff <(cd "$DEST4" && find . -type f -links +1 | sort) <(cd "$DEST14M" && find . -type f -links +1 | sort) >/dev/null; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL"
+    ((FAILED++))
+fi
+
+echo
+echo "🚰 === Pipeline Tests ==="
+
+DEST16="$TEMP_DIR/dest16"
+test_case "copy with match and copy worker threads" \
+    "./cpdd $VERBOSE $STATS -r '$REF_DIR' -R -p --match-threads 4 --copy-threads 3 '$SRC_DIR' '$DEST16'" \
+    "pass"
+
+echo -n "Comparing pipelined run with sequential run... "
+if diff -r "$DEST4" "$DEST16" >/dev/null &&
+   diff <(cd "$DEST4" && find . -type f -links +1 | sort) <(cd "$DEST16" && find . -type f -links +1 | sort) >/dev/null; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL"
+    ((FAILED++))
+fi
+
+# Directory times are applied after their contents have been written
+echo -n "Checking preserved directory timestamps... "
+if diff <(cd "$SRC_DIR" && find . -type d -exec stat -c '%n %Y' {} + | sort) \
+        <(cd "$DEST16" && find . -type d -exec stat -c '%n %Y' {} + | sort) >/dev/null; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL"
+    ((FAILED++))
+fi
+
+DEST17="$TEMP_DIR/dest17"
+test_case "copy with work-stealing source walkers" \
+    "./cpdd $VERBOSE $STATS -r '$REF_DIR' -R -p --walk-threads 4 --copy-threads 2 '$SRC_DIR' '$DEST17'" \
+    "pass"
+
+echo -n "Comparing parallel walk with sequential walk... "
+if diff -r "$DEST16" "$DEST17" >/dev/null &&
+   diff <(cd "$DEST16" && find . -type f -links +1 | sort) <(cd "$DEST17" && find . -type f -links +1 | sort) >/dev/null &&
+   diff <(cd "$DEST16" && find . -type d -exec stat -c '%n %Y' {} + | sort) \
+        <(cd "$DEST17" && find . -type d -exec stat -c '%n %Y' {} + | sort) >/dev/null; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL"
+    ((FAILED++))
+fi
+
+echo
+echo "♻️  === Copy Deduplication Tests ==="
+
+# The reference tree copied alongside the source: every source file that
+# matches a reference file is linked to the copy made moments earlier
+DEST18="$TEMP_DIR/dest18"
+mkdir -p "$DEST18"
+test_case "deduplicate files copied in the same run" \
+    "./cpdd $VERBOSE $STATS -R --dedup-copies '$REF_DIR' '$SRC_DIR' '$DEST18'" \
+    "pass"
+
+echo -n "Checking later duplicates are linked to earlier copies... "
+if diff -r "$SRC_DIR" "$DEST18/source" >/dev/null && diff -r "$REF_DIR" "$DEST18/reference" >/dev/null &&
+   diff <(cd "$DEST4" && find . -type f -links +1 | sort) \
+        <(cd "$DEST18/source" && find . -type f -links +1 | sort) >/dev/null; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL"
+    ((FAILED++))
+fi
+
+echo
+echo "🔗 === Hard-Linked Source Tests ==="
+
+# Sources linked to each other and to the reference: the group stays one
+# inode in the destination, and a source that is a reference file matches it
+LINKED_SRC="$TEMP_DIR/linked_source"
+DEST19="$TEMP_DIR/dest19"
+REF_FILE=$(find "$REF_DIR" -type f | head -1)
+mkdir -p "$LINKED_SRC/a" "$LINKED_SRC/b"
+echo "linked source content" > "$LINKED_SRC/a/one"
+ln "$LINKED_SRC/a/one" "$LINKED_SRC/b/two"
+ln "$REF_FILE" "$LINKED_SRC/a/ref_link"
+test_case "copy preserving source hard links" \
+    "./cpdd $VERBOSE $STATS -r '$REF_DIR' -R --preserve=links '$LINKED_SRC' '$DEST19'" \
+    "pass"
+
+echo -n "Checking hard-linked sources stay linked... "
+if diff -r "$LINKED_SRC" "$DEST19" >/dev/null &&
+   [[ "$DEST19/a/one" -ef "$DEST19/b/two" ]] &&
+   [[ "$DEST19/a/ref_link" -ef "$REF_FILE" ]]; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL"
+    ((FAILED++))
+fi
+
+# Many linked pairs through the worker threads, where both paths of an
+# inode are often in flight together
+PAIRED_SRC="$TEMP_DIR/paired_source"
+DEST19P="$TEMP_DIR/dest19_pipelined"
+mkdir -p "$PAIRED_SRC/a" "$PAIRED_SRC/b"
+for i in $(seq 1 100); do
+    echo "paired source $i" > "$PAIRED_SRC/a/file$i"
+    ln "$PAIRED_SRC/a/file$i" "$PAIRED_SRC/b/file$i"
+done
+test_case "pipelined copy preserving source hard links" \
+    "./cpdd $VERBOSE $STATS -R --preserve=links --match-threads 4 --copy-threads 4 '$PAIRED_SRC' '$DEST19P'" \
+    "pass"
+
+echo -n "Checking every pair stays linked with worker threads... "
+PAIRED_LINKS=$(find "$DEST19P" -type f -links 2 | wc -l)
+if diff -r "$PAIRED_SRC" "$DEST19P" >/dev/null && [ "$PAIRED_LINKS" -eq 200 ]; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL ($PAIRED_LINKS of 200 paths linked)"
+    ((FAILED++))
+fi
+
+echo
+echo "🧬 === Reflink Tests ==="
+
+# Clones where the filesystem supports it (btrfs, XFS), copies on ext4/tmpfs
+DEST15="$TEMP_DIR/dest15"
+test_case "copy with reflinks" \
+    "./cpdd $VERBOSE $STATS -r '$REF_DIR' -R --reflink '$SRC_DIR' '$DEST15'" \
+    "pass"
+
+test_case "reflink combined with hard links" \
+    "./cpdd -r '$REF_DIR' -L --reflink '$SRC_DIR' '$TEMP_DIR/dest_bad'" \
+    "fail"
+
+echo -n "Checking reflinked files are independent copies... "
+if diff -r "$SRC_DIR" "$DEST15" >/dev/null &&
+   [[ -z "$(find "$DEST15" \( -type l -o -type f -links +1 \) -print)" ]]; then
+    echo "PASS"
+    ((SUCCESS++))
+else
+    echo "FAIL"
+    ((FAILED++))
+fi
+
 echo
 echo "📋 === Final Results ==="
 echo "✅ Tests passed: $SUCCESS"